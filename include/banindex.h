@@ -0,0 +1,125 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2014 InspIRCd Development Team
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** A channel ban list compiled for matching against users.
+ *
+ * Every nick!ident@host mask is split at the first '@'. Masks whose host part
+ * contains no wildcards are kept in a hash table keyed by that host part, and
+ * those which are also valid CIDR ranges are kept in a table of ranges for each
+ * prefix length in use, so a user is only matched against the masks set on one
+ * of its own hosts or on a range containing its IP. Masks with a wildcard in the
+ * host part are checked one by one as before. Extbans can only be matched by
+ * modules, so they are kept in a list of their own.
+ *
+ * The result of Matches() is the same as calling Channel::CheckBan() on each
+ * of the non-extban masks, without the OnCheckBan hook.
+ */
+class CoreExport BanIndex
+{
+	/** A ban mask, split into the nick!ident part and the host part */
+	struct Entry
+	{
+		std::string mask;
+		std::string prefix;
+		std::string suffix;
+		Entry(const std::string& Mask, std::string::size_type at)
+			: mask(Mask), prefix(Mask, 0, at), suffix(Mask, at + 1) { }
+	};
+
+	typedef TR1NS::unordered_multimap<std::string, Entry, irc::insensitive, irc::StrHashComp> HostMap;
+	typedef std::multimap<irc::sockets::cidr_mask, Entry> RangeMap;
+
+	/** Masks with a literal host part, by host part */
+	HostMap hosts;
+
+	/** Masks with a literal host part that is a CIDR range, by range */
+	RangeMap ranges;
+
+	/** Number of masks in ranges for each address family and prefix length */
+	std::map<std::pair<int, int>, unsigned int> prefixlens;
+
+	/** Masks with a wildcard in the host part */
+	std::vector<Entry> wildcards;
+
+	/** Extbans, in the order they were added */
+	std::vector<std::string> extbans;
+
+	/** Changed every time a mask is added or removed, see GetSerial() */
+	unsigned long serial;
+
+	/** The next serial to give out; serials are never reused by any index */
+	static unsigned long nextserial;
+
+	/** Check the nick!ident part of a mask
+	 * @param nickident The user's nick!ident
+	 * @param entry The mask to check
+	 */
+	static bool MatchPrefix(const std::string& nickident, const Entry& entry)
+	{
+		return InspIRCd::Match(nickident, entry.prefix, NULL);
+	}
+
+	/** Check the masks in the hash table set on the given host
+	 * @param nickident The user's nick!ident
+	 * @param host The host to look up
+	 */
+	bool MatchHost(const std::string& nickident, const std::string& host) const;
+
+ public:
+	BanIndex() : serial(++nextserial) { }
+
+	/** Add a mask to the index
+	 * @param mask The ban mask to add
+	 */
+	void Add(const std::string& mask);
+
+	/** Remove a mask from the index. Only one copy is removed if the mask was added more than once.
+	 * @param mask The ban mask to remove
+	 */
+	void Remove(const std::string& mask);
+
+	/** Check whether any of the non-extban masks in the index match a user
+	 * @param user The user to check
+	 * @return True if the user matches one or more masks
+	 */
+	bool Matches(User* user) const;
+
+	/** Check whether any of the non-extban masks in the index match a nick!ident@host
+	 * that is not one of the user's own, such as a cloak the user is not using.
+	 * CIDR ranges are not matched, as the host is not an IP.
+	 * @param nickident The nick!ident to check
+	 * @param host The host to check
+	 * @return True if nickident@host matches one or more masks
+	 */
+	bool MatchesHost(const std::string& nickident, const std::string& host) const;
+
+	/** Get the extbans in the index; these have to be checked with Channel::CheckBan()
+	 * @return A list of extban masks
+	 */
+	const std::vector<std::string>& GetExtBans() const { return extbans; }
+
+	/** Get a number identifying the current contents of the index. The result
+	 * of Matches() for a given user stays the same for as long as this does,
+	 * unless the nick, ident, host or IP of the user changes.
+	 * @return A serial number that is never 0
+	 */
+	unsigned long GetSerial() const { return serial; }
+};
@@ -0,0 +1,71 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2014 InspIRCd Development Team
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** All channels, grouped by their number of users, so that the channels within a
+ * range of sizes can be found without looking at every channel.
+ *
+ * Each size has a list of the channels of that size, and each channel knows its
+ * position in that list, so a channel is moved to the next list in constant time
+ * when a user joins or leaves it.
+ */
+class CoreExport ChannelSizeIndex
+{
+	typedef std::map<size_t, std::vector<Channel*> > SizeMap;
+
+	/** The channels of each size that has any */
+	SizeMap sizes;
+
+	/** Add a channel to the list for a size
+	 * @param chan The channel
+	 * @param size The size
+	 */
+	void Insert(Channel* chan, size_t size);
+
+	/** Remove a channel from the list for a size
+	 * @param chan The channel
+	 * @param size The size
+	 */
+	void Erase(Channel* chan, size_t size);
+
+ public:
+	/** Add a new channel to the index, with its current number of users
+	 * @param chan The channel
+	 */
+	void Add(Channel* chan);
+
+	/** Remove a channel from the index. Does nothing if the channel is not in the index.
+	 * @param chan The channel
+	 */
+	void Remove(Channel* chan);
+
+	/** Move a channel to the list for its current number of users
+	 * @param chan The channel
+	 * @param oldsize The number of users the channel had before
+	 */
+	void Resize(Channel* chan, size_t oldsize);
+
+	/** Find the channels within a range of sizes
+	 * @param minsize The lowest number of users
+	 * @param maxsize The highest number of users
+	 * @param out The channels are appended to this, from the largest to the smallest
+	 */
+	void Find(size_t minsize, size_t maxsize, std::vector<Channel*>& out) const;
+};
@@ -25,6 +25,20 @@
 #include "membership.h"
 #include "mode.h"
 
+/** Formats of the NAMES list, set by modules in Module::OnNamesListFormat()
+ */
+enum NamesListFormat
+{
+	/** Show all prefixes of each member instead of only the highest one (NAMESX) */
+	NAMES_MULTIPREFIX = 1,
+	/** Show the nick!ident@host of each member instead of only the nick (UHNAMES) */
+	NAMES_UHNAMES = 2,
+	/** Call OnNamesListItem for every member, because a module may hide or change some
+	 * of them; the cached NAMES list of the channel is not used
+	 */
+	NAMES_FILTER = 4
+};
+
 /** Holds an entry for a ban list, exemption list, or invite list.
  * This class contains a single element in a channel list, such as a banlist.
  */
@@ -61,6 +75,35 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	void DelUser(const UserMembIter& membiter);
 
+	/** The local members of the channel, packed together so that sending to them does
+	 * not have to walk past every remote member. Kept in step with userlist by AddUser(),
+	 * DelUser() and SetPrefix().
+	 */
+	LocalMembList localusers;
+
+	/** The NAMES list of the channel, with and without NAMES_MULTIPREFIX and NAMES_UHNAMES.
+	 * Each list is built when it is first needed and then kept up to date as users join,
+	 * part, change nick and gain or lose prefixes. Every entry is preceded by a space.
+	 */
+	std::string nameslist[(NAMES_MULTIPREFIX | NAMES_UHNAMES) + 1];
+
+	/** Bit n is set if nameslist[n] is up to date
+	 */
+	unsigned int namesvalid;
+
+	/** Get the entry of a member in a NAMES list
+	 * @param memb The member
+	 * @param format The format of the list, a combination of NAMES_MULTIPREFIX and NAMES_UHNAMES
+	 * @return The prefixes and nick of the member
+	 */
+	std::string GetNamesListEntry(Membership* memb, unsigned int format);
+
+	/** Get the NAMES list of the channel, building it if it is not up to date
+	 * @param format The format of the list, a combination of NAMES_MULTIPREFIX and NAMES_UHNAMES
+	 * @return The entries of all members, each preceded by a space
+	 */
+	const std::string& GetNamesList(unsigned int format);
+
  public:
 	/** Creates a channel record and initialises it with default values
 	 * @throw Nothing at present.
@@ -78,6 +121,10 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	void CheckDestroy();
 
+	/** Removes the channel from the ChannelSizeIndex before it is deleted
+	 */
+	CullResult cull();
+
 	/** The channel's name.
 	 */
 	std::string name;
@@ -90,6 +137,15 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	UserMembList userlist;
 
+	/** Value of sizeindex for a channel that is not in the ChannelSizeIndex
+	 */
+	static const size_t NOT_INDEXED = (size_t)-1;
+
+	/** Position of the channel in the list for its size in InspIRCd::ChannelSizes, kept up
+	 * to date by ChannelSizeIndex, or NOT_INDEXED once the channel has been removed
+	 */
+	size_t sizeindex;
+
 	/** Channel topic.
 	 * If this is an empty string, no channel topic is set.
 	 */
@@ -181,6 +237,13 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	const UserMembList* GetUsers() const { return &userlist; }
 
+	/** Get the local members of the channel, with their ranks.
+	 * This should be preferred over GetUsers() when only local users are of interest.
+	 * The list must not be held on to while users join or leave the channel.
+	 * @return The local members of the channel
+	 */
+	const LocalMembList& GetLocalUsers() const { return localusers; }
+
 	/** Returns true if the user given is on the given channel.
 	 * @param user The user to look for
 	 * @return True if the user is on this channel
@@ -305,6 +368,17 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	void UserList(User *user);
 
+	/** Add a member to the cached NAMES lists of the channel
+	 * @param memb The member to add
+	 */
+	void AddNamesListEntry(Membership* memb);
+
+	/** Remove a member from the cached NAMES lists of the channel. This must be called
+	 * before anything shown in the NAMES list entry of the member changes.
+	 * @param memb The member to remove
+	 */
+	void RemoveNamesListEntry(Membership* memb);
+
 	/** Get a users prefix on this channel in a string.
 	 * @param user The user to look up
 	 * @return A character array containing the prefix string.
@@ -356,6 +430,12 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	bool IsBanned(User* user);
 
+	/** Check if a user matches any entry on the banlist, without calling OnCheckChannelBan
+	 * @param user A user to check against the banlist
+	 * @return True if any ban matches the user
+	 */
+	bool MatchesBanList(User* user);
+
 	/** Check a single ban for match
 	 */
 	bool CheckBan(User* user, const std::string& banmask);
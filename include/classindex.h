@@ -0,0 +1,67 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2014 InspIRCd Development Team
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** The allow and deny masks of the connect classes, compiled for finding the
+ * classes a connecting user can be put into.
+ *
+ * Like BanIndex, literal masks are kept in a hash table and CIDR ranges in a
+ * table for each prefix length in use, so that only the classes whose mask is
+ * one of the user's hosts or a range containing its IP are returned. Masks with
+ * wildcards are returned for every user, and still have to be matched. Named
+ * classes are never returned, as they can not be matched by host.
+ */
+class CoreExport ConnectClassIndex
+{
+	typedef TR1NS::unordered_multimap<std::string, size_t, irc::insensitive, irc::StrHashComp> HostMap;
+	typedef std::multimap<irc::sockets::cidr_mask, size_t> RangeMap;
+
+	/** Positions of the classes with a literal mask, by mask */
+	HostMap hosts;
+
+	/** Positions of the classes with a CIDR range as their mask, by range */
+	RangeMap ranges;
+
+	/** Number of ranges for each address family and prefix length */
+	std::map<std::pair<int, int>, unsigned int> prefixlens;
+
+	/** Positions of the classes with a wildcard in their mask */
+	std::vector<size_t> wildcards;
+
+	/** Add the classes with the given literal mask to a list
+	 * @param host The host to look up
+	 * @param out The list to add to
+	 */
+	void FindHost(const std::string& host, std::vector<size_t>& out) const;
+
+ public:
+	/** Compile the masks of a list of connect classes, replacing the current index
+	 * @param classes The connect classes, in the order they are checked in
+	 */
+	void Build(const ClassVector& classes);
+
+	/** Find the classes which may match a user
+	 * @param user The user to find the classes for
+	 * @param out Set to the positions of the classes in the list given to Build(), in
+	 * ascending order. The class masks still have to be checked, but the classes not
+	 * in this list can not match the user.
+	 */
+	void Find(LocalUser* user, std::vector<size_t>& out) const;
+};
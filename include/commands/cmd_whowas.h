@@ -23,20 +23,89 @@
 
 #include "modules.h"
 
-/* Forward ref for typedefs */
-class WhoWasGroup;
+struct WhoWasBlock;
 
-/** A group of users related by nickname
+/** A WHOWAS entry. Entries are packed one after another into the blocks of the
+ * WHOWAS arena, each followed by its nick, ident, host, displayed host and gecos.
  */
-typedef std::deque<WhoWasGroup*> whowas_set;
+struct WhoWasEntry
+{
+	/** The previous (older) entry of the same nick, or NULL if this is the oldest one
+	 */
+	WhoWasEntry* prev;
+	/** The block the entry is in
+	 */
+	WhoWasBlock* block;
+	/** Time the entry was added
+	 */
+	time_t added;
+	/** Signon time
+	 */
+	time_t signon;
+	/** Size of the entry and its strings, including padding
+	 */
+	unsigned int size;
+	/** Position of the server name in the server name table
+	 */
+	unsigned int server;
+	/** Lengths of the strings following the entry
+	 */
+	unsigned short nicklen, identlen, hostlen, dhostlen, gecoslen;
+	/** True if the entry has been removed, but is still taking up space in its block
+	 */
+	bool dead;
 
-/** Sets of users in the whowas system
+	const char* GetStrings() const { return reinterpret_cast<const char*>(this + 1); }
+	std::string GetNick() const { return std::string(GetStrings(), nicklen); }
+	std::string GetIdent() const { return std::string(GetStrings() + nicklen, identlen); }
+	std::string GetHost() const { return std::string(GetStrings() + nicklen + identlen, hostlen); }
+	std::string GetDisplayedHost() const { return std::string(GetStrings() + nicklen + identlen + hostlen, dhostlen); }
+	std::string GetGecos() const { return std::string(GetStrings() + nicklen + identlen + hostlen + dhostlen, gecoslen); }
+};
+
+/** A block of memory in the WHOWAS arena. Entries are only ever added at the end of
+ * the newest block; removing one marks it dead, and the block is freed when it has
+ * no live entries left.
+ */
+struct WhoWasBlock
+{
+	/** The memory of the block
+	 */
+	char* data;
+	/** Size of the block in bytes
+	 */
+	size_t capacity;
+	/** Bytes at the start of the block used by entries, dead or alive
+	 */
+	size_t used;
+	/** Offset of the first entry in the block which may still be live
+	 */
+	size_t head;
+	/** Number of live entries in the block
+	 */
+	unsigned int live;
+	/** Position of the block in the arena
+	 */
+	std::list<WhoWasBlock*>::iterator pos;
+};
+
+/** The entries of a nick, newest first
  */
-typedef std::map<irc::string,whowas_set*> whowas_users;
+struct WhoWasGroup
+{
+	/** The newest entry of the nick, the others are reached through WhoWasEntry::prev
+	 */
+	WhoWasEntry* newest;
+	/** Number of entries of the nick
+	 */
+	unsigned int count;
+
+	WhoWasGroup() : newest(NULL), count(0) { }
+};
 
-/** Sets of time and users in whowas list
+/** Sets of users in the whowas system
  */
-typedef std::deque<std::pair<time_t,irc::string> > whowas_users_fifo;
+typedef std::map<irc::string, WhoWasGroup> whowas_users;
 
 /** Handle /WHOWAS. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
@@ -46,13 +115,80 @@ typedef std::deque<std::pair<time_t,irc::string> > whowas_users_fifo;
 class CommandWhowas : public Command
 {
   private:
-	/** Whowas container, contains a map of vectors of users tracked by WHOWAS
+	/** Whowas container, contains a map of nicks to their entries in the arena
 	 */
 	whowas_users whowas;
 
-	/** Whowas container, contains a map of time_t to users tracked by WHOWAS
+	/** Blocks of the arena, oldest first. As entries are added in the order users
+	 * quit, this is also the order of the entries by age.
+	 */
+	std::list<WhoWasBlock*> blocks;
+
+	/** Server names of the entries, and the number of entries using each of them
+	 */
+	std::vector<std::pair<std::string, unsigned int> > servers;
+
+	/** Positions of the server names in servers
+	 */
+	std::map<std::string, unsigned int> serverpos;
+
+	/** Positions in servers which are no longer in use
+	 */
+	std::vector<unsigned int> freeservers;
+
+	/** Number of live entries
 	 */
-	whowas_users_fifo whowas_fifo;
+	size_t entries;
+
+	/** Bytes used by the blocks of the arena
+	 */
+	size_t arenabytes;
+
+	/** Bytes used by the server name table and the nicks in the whowas map
+	 */
+	size_t namebytes;
+
+	/** Make room for an entry at the end of the arena
+	 * @param size Size of the entry, including its strings
+	 * @return The memory of the new entry
+	 */
+	WhoWasEntry* Allocate(size_t size);
+
+	/** Mark an entry dead, freeing its block if it was the last live entry in it
+	 * @param entry The entry to release; it must no longer be reachable from the whowas map
+	 */
+	void Release(WhoWasEntry* entry);
+
+	/** Get the position of a server name, adding it to the table if needed
+	 * @param servername The server name
+	 * @return Position of the name in servers
+	 */
+	unsigned int InternServer(const std::string& servername);
+
+	/** Find the oldest live entry
+	 * @return The oldest entry, or NULL if there are none
+	 */
+	WhoWasEntry* Oldest();
+
+	/** Remove the oldest live entry, if any
+	 */
+	void RemoveOldest();
+
+	/** Remove all entries of a nick
+	 * @param iter The nick to remove
+	 */
+	void RemoveNick(whowas_users::iterator iter);
+
+	/** Remove the oldest entries of a nick until it has no more than a given number of them
+	 * @param iter The nick to trim
+	 * @param max The number of entries to keep
+	 */
+	void TrimNick(whowas_users::iterator iter, unsigned int max);
+
+	/** Remove entries until the limits in the config are no longer exceeded
+	 * @param t The current time
+	 */
+	void EnforceLimits(time_t t);
 
   public:
 	/** Max number of WhoWas entries per user.
@@ -68,6 +204,11 @@ class CommandWhowas : public Command
 	 */
 	int WhoWasMaxKeep;
 
+	/** Max bytes used by WhoWas, including the overhead of the whowas map.
+	 *  When exceeded, the oldest entries are removed.
+	 */
+	int WhoWasMaxBytes;
+
 	CommandWhowas(Module* parent);
 	/** Handle command.
 	 * @param parameters The parameters to the comamnd
@@ -78,39 +219,8 @@ class CommandWhowas : public Command
 	CmdResult Handle(const std::vector<std::string>& parameters, User *user);
 	void AddToWhoWas(User* user);
 	std::string GetStats();
+	size_t GetBytes() const;
 	void PruneWhoWas(time_t t);
 	void MaintainWhoWas(time_t t);
 	~CommandWhowas();
 };
-
-/** Used to hold WHOWAS information
- */
-class WhoWasGroup
-{
- public:
-	/** Real host
-	 */
-	std::string host;
-	/** Displayed host
-	 */
-	std::string dhost;
-	/** Ident
-	 */
-	std::string ident;
-	/** Server name
-	 */
-	std::string server;
-	/** Fullname (GECOS)
-	 */
-	std::string gecos;
-	/** Signon time
-	 */
-	time_t signon;
-
-	/** Initialize this WhoWasFroup with a user
-	 */
-	WhoWasGroup(User* user);
-	/** Destructor
-	 */
-	~WhoWasGroup();
-};
@@ -31,6 +31,7 @@
 #include "modules.h"
 #include "socketengine.h"
 #include "socket.h"
+#include "classindex.h"
 
 /** Structure representing a single \<tag> in config */
 class CoreExport ConfigTag : public refcountbase
@@ -366,6 +367,22 @@ class CoreExport ServerConfig
 	 */
 	int NetBufferSize;
 
+	/** The number of threads used to read from client
+	 * sockets, or 0 to read them in the main thread.
+	 * Changes only take effect on restart.
+	 */
+	unsigned int IOThreads;
+
+	/** The maximum number of results of a /WHO
+	 * that does not have the 'u' flag.
+	 */
+	unsigned int MaxWho;
+
+	/** True if the time spent in each module hook
+	 * should be recorded, see /STATS M.
+	 */
+	bool HookProfiling;
+
 	/** The value to be used for listen() backlogs
 	 * as default.
 	 */
@@ -420,6 +437,10 @@ class CoreExport ServerConfig
 	 */
 	ClassVector Classes;
 
+	/** The masks of the connect classes, compiled for LocalUser::SetClass()
+	 */
+	ConnectClassIndex ClassIndex;
+
 	/** STATS characters in this list are available
 	 * only to operators.
 	 */
@@ -0,0 +1,357 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2014 InspIRCd Development Team
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+namespace irc
+{
+	/** A hash table keyed by irc strings, such as nicks, UUIDs, channel and server names.
+	 *
+	 * Keys compare like they do with irc::StrHashComp and are folded with
+	 * national_case_insensitive_map before hashing, but the table uses open addressing
+	 * with linear probing instead of a node per entry: the hashes of all keys are kept
+	 * in one array, next to one array of entries. The hash of every key is stored when
+	 * it is added, so a lookup only folds the key it is looking for, and only compares
+	 * strings with entries whose stored hash is the same.
+	 *
+	 * The interface is the part of std::unordered_map that the core and modules use.
+	 * As with std::unordered_map, erasing an entry does not invalidate iterators to other
+	 * entries, but adding one may. Unlike with std::unordered_map, adding an entry may also
+	 * move the other entries, so pointers to entries must not be kept around.
+	 *
+	 * If national_case_insensitive_map changes, refold() must be called before the table is
+	 * used again.
+	 */
+	template<typename T>
+	class hash_map
+	{
+	 public:
+		typedef std::string key_type;
+		typedef T mapped_type;
+		typedef std::pair<std::string, T> value_type;
+		typedef size_t size_type;
+
+	 private:
+		enum
+		{
+			/** Stored hash of an empty slot */
+			EMPTY = 0,
+			/** Stored hash of a slot whose entry was erased; lookups have to probe past it */
+			ERASED = 1,
+			/** Number of slots in a new table; always a power of two */
+			MIN_SLOTS = 16
+		};
+
+		/** Hash of the key in each slot, or EMPTY or ERASED */
+		std::vector<size_t> hashes;
+
+		/** Entry in each slot; empty and erased slots hold a default constructed entry */
+		std::vector<value_type> entries;
+
+		/** Number of entries */
+		size_t used;
+
+		/** Number of ERASED slots */
+		size_t erased;
+
+		/** Shift which turns a mixed hash into a slot number, see SlotOf() */
+		unsigned int shift;
+
+		/** Multiplier used to mix hashes, 2^N/phi */
+		static size_t Golden()
+		{
+			return (sizeof(size_t) > 4) ? static_cast<size_t>(0x9E3779B97F4A7C15ULL) : static_cast<size_t>(0x9E3779B9UL);
+		}
+
+		/** Hash a key, folding it with national_case_insensitive_map. Keys are folded four
+		 * characters at a time, so that the table lookups for a word do not have to wait
+		 * on each other the way they do in irc::insensitive.
+		 * @return The hash of the key, never EMPTY or ERASED
+		 */
+		static size_t Hash(const std::string& key)
+		{
+			const unsigned char* map = national_case_insensitive_map;
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(key.data());
+			const size_t len = key.length();
+			size_t h = len;
+			size_t i = 0;
+			for (; i + 4 <= len; i += 4)
+			{
+				const size_t word = map[p[i]] | (map[p[i + 1]] << 8) | (map[p[i + 2]] << 16) | (static_cast<size_t>(map[p[i + 3]]) << 24);
+				h = (h ^ word) * Golden();
+				h ^= h >> 15;
+			}
+			for (; i < len; i++)
+				h = (h ^ map[p[i]]) * Golden();
+			h ^= h >> 15;
+			return (h < 2) ? h + 2 : h;
+		}
+
+		/** Compare two keys the way irc::StrHashComp does */
+		static bool Equal(const std::string& a, const std::string& b)
+		{
+			// Folding never changes the length of a string
+			if (a.length() != b.length())
+				return false;
+
+			// Keys are usually looked up in the same case they were added in, and memcmp()
+			// compares those a word or a vector at a time
+			if (!memcmp(a.data(), b.data(), a.length()))
+				return true;
+
+			const unsigned char* map = national_case_insensitive_map;
+			const unsigned char* x = reinterpret_cast<const unsigned char*>(a.data());
+			const unsigned char* y = reinterpret_cast<const unsigned char*>(b.data());
+			for (size_t i = 0; i < a.length(); i++)
+			{
+				if (map[x[i]] != map[y[i]])
+					return false;
+			}
+			return true;
+		}
+
+		/** Get the first slot to probe for a hash. The hash is multiplied by 2^N/phi and
+		 * the top bits of the result are used, so that hashes which only differ in their
+		 * high bits still spread over the table.
+		 */
+		size_t SlotOf(size_t hash) const
+		{
+			return (hash * Golden()) >> shift;
+		}
+
+		/** Find the slot holding a key
+		 * @return The slot number, or hashes.size() if the key is not in the table
+		 */
+		size_t Lookup(const std::string& key, size_t hash) const
+		{
+			const size_t mask = hashes.size() - 1;
+			for (size_t slot = SlotOf(hash); ; slot = (slot + 1) & mask)
+			{
+				const size_t h = hashes[slot];
+				if (h == EMPTY)
+					return hashes.size();
+				if (h == hash && Equal(entries[slot].first, key))
+					return slot;
+			}
+		}
+
+		/** Resize the table to the given number of slots, moving every entry to its new
+		 * slot by its stored hash. Erased slots are dropped.
+		 */
+		void Resize(size_t slots)
+		{
+			std::vector<size_t> oldhashes(slots, EMPTY);
+			std::vector<value_type> oldentries(slots);
+			oldhashes.swap(hashes);
+			oldentries.swap(entries);
+
+			shift = sizeof(size_t) * 8;
+			for (size_t n = slots; n > 1; n >>= 1)
+				shift--;
+
+			const size_t mask = slots - 1;
+			for (size_t i = 0; i < oldhashes.size(); i++)
+			{
+				if (oldhashes[i] < 2)
+					continue;
+
+				size_t slot = SlotOf(oldhashes[i]);
+				while (hashes[slot] != EMPTY)
+					slot = (slot + 1) & mask;
+
+				hashes[slot] = oldhashes[i];
+				entries[slot].first.swap(oldentries[i].first);
+				entries[slot].second = oldentries[i].second;
+			}
+			erased = 0;
+		}
+
+		/** Add a key which is not in the table yet
+		 * @return The slot the key was put in
+		 */
+		size_t Add(const std::string& key, size_t hash, const T& value)
+		{
+			// Keep at least a quarter of the slots empty, so that probe sequences stay short and
+			// every lookup ends at an empty slot. Erased slots count as used until the next resize.
+			if ((used + erased + 1) * 4 > hashes.size() * 3)
+				Resize((used + 1) * 2 > hashes.size() ? hashes.size() * 2 : hashes.size());
+
+			const size_t mask = hashes.size() - 1;
+			size_t slot = SlotOf(hash);
+			while (hashes[slot] >= 2)
+				slot = (slot + 1) & mask;
+
+			if (hashes[slot] == ERASED)
+				erased--;
+			hashes[slot] = hash;
+			entries[slot].first = key;
+			entries[slot].second = value;
+			used++;
+			return slot;
+		}
+
+		/** Empty a slot */
+		void Remove(size_t slot)
+		{
+			// An empty slot would end the probe sequence of any keys which were moved past this one
+			hashes[slot] = ERASED;
+			entries[slot].first.clear();
+			entries[slot].second = T();
+			used--;
+			erased++;
+		}
+
+	 public:
+		/** An iterator over the entries of a hash_map */
+		template<typename Map, typename Value>
+		class iterator_base
+		{
+			Map* map;
+			size_t slot;
+
+			void SkipUnused()
+			{
+				while (slot < map->hashes.size() && map->hashes[slot] < 2)
+					slot++;
+			}
+
+		 public:
+			iterator_base() : map(NULL), slot(0) { }
+			iterator_base(Map* m, size_t s, bool skip) : map(m), slot(s)
+			{
+				if (skip)
+					SkipUnused();
+			}
+
+			/** Allows iterators to be converted to const_iterators */
+			template<typename OtherMap, typename OtherValue>
+			iterator_base(const iterator_base<OtherMap, OtherValue>& other) : map(other.GetMap()), slot(other.GetSlot()) { }
+
+			Map* GetMap() const { return map; }
+			size_t GetSlot() const { return slot; }
+
+			Value& operator*() const { return map->entries[slot]; }
+			Value* operator->() const { return &map->entries[slot]; }
+
+			iterator_base& operator++()
+			{
+				slot++;
+				SkipUnused();
+				return *this;
+			}
+
+			iterator_base operator++(int)
+			{
+				iterator_base prev = *this;
+				++*this;
+				return prev;
+			}
+
+			bool operator==(const iterator_base& other) const { return slot == other.slot; }
+			bool operator!=(const iterator_base& other) const { return slot != other.slot; }
+		};
+
+		typedef iterator_base<hash_map, value_type> iterator;
+		typedef iterator_base<const hash_map, const value_type> const_iterator;
+
+		hash_map() : used(0), erased(0)
+		{
+			Resize(MIN_SLOTS);
+		}
+
+		iterator begin() { return iterator(this, 0, true); }
+		iterator end() { return iterator(this, hashes.size(), false); }
+		const_iterator begin() const { return const_iterator(this, 0, true); }
+		const_iterator end() const { return const_iterator(this, hashes.size(), false); }
+
+		size_type size() const { return used; }
+		bool empty() const { return used == 0; }
+
+		iterator find(const std::string& key)
+		{
+			return iterator(this, Lookup(key, Hash(key)), false);
+		}
+
+		const_iterator find(const std::string& key) const
+		{
+			return const_iterator(this, Lookup(key, Hash(key)), false);
+		}
+
+		size_type count(const std::string& key) const
+		{
+			return (Lookup(key, Hash(key)) != hashes.size()) ? 1 : 0;
+		}
+
+		std::pair<iterator, bool> insert(const value_type& value)
+		{
+			const size_t hash = Hash(value.first);
+			size_t slot = Lookup(value.first, hash);
+			if (slot != hashes.size())
+				return std::make_pair(iterator(this, slot, false), false);
+
+			slot = Add(value.first, hash, value.second);
+			return std::make_pair(iterator(this, slot, false), true);
+		}
+
+		T& operator[](const std::string& key)
+		{
+			const size_t hash = Hash(key);
+			size_t slot = Lookup(key, hash);
+			if (slot == hashes.size())
+				slot = Add(key, hash, T());
+			return entries[slot].second;
+		}
+
+		void erase(iterator it)
+		{
+			Remove(it.GetSlot());
+		}
+
+		size_type erase(const std::string& key)
+		{
+			const size_t slot = Lookup(key, Hash(key));
+			if (slot == hashes.size())
+				return 0;
+
+			Remove(slot);
+			return 1;
+		}
+
+		void clear()
+		{
+			hashes.clear();
+			entries.clear();
+			used = 0;
+			Resize(MIN_SLOTS);
+		}
+
+		/** Hash every key again. This has to be done when national_case_insensitive_map changes.
+		 * Keys which become equal to each other stay in the table, but only one of them can be found.
+		 */
+		void refold()
+		{
+			for (size_t i = 0; i < hashes.size(); i++)
+			{
+				if (hashes[i] >= 2)
+					hashes[i] = Hash(entries[i].first);
+			}
+			Resize(hashes.size());
+		}
+	};
+}
@@ -57,9 +57,11 @@ CoreExport extern InspIRCd* ServerInstance;
 #include "uid.h"
 #include "users.h"
 #include "channels.h"
+#include "chanindex.h"
 #include "timer.h"
 #include "hashcomp.h"
 #include "logger.h"
+#include "userindex.h"
 #include "usermanager.h"
 #include "socket.h"
 #include "ctables.h"
@@ -70,6 +72,7 @@ CoreExport extern InspIRCd* ServerInstance;
 #include "filelogger.h"
 #include "modules.h"
 #include "threadengine.h"
+#include "iothread.h"
 #include "configreader.h"
 #include "inspstring.h"
 #include "protocol.h"
@@ -271,16 +274,6 @@ class CoreExport InspIRCd
 	 */
 	void DoSocketTimeouts(time_t TIME);
 
-	/** Perform background user events such as PING checks
-	 */
-	void DoBackgroundUserStuff();
-
-	/** Returns true when all modules have done pre-registration checks on a user
-	 * @param user The user to verify
-	 * @return True if all modules have finished checking this user
-	 */
-	bool AllModulesReportReady(LocalUser* user);
-
 	/** The current time, updated in the mainloop
 	 */
 	struct timespec TIME;
@@ -291,6 +284,11 @@ class CoreExport InspIRCd
 	char ReadBuffer[65535];
 
  public:
+	/** Returns true when all modules have done pre-registration checks on a user
+	 * @param user The user to verify
+	 * @return True if all modules have finished checking this user
+	 */
+	bool AllModulesReportReady(LocalUser* user);
 
 	UIDGenerator UIDGen;
 
@@ -351,6 +349,10 @@ class CoreExport InspIRCd
 	 */
 	ThreadEngine* Threads;
 
+	/** I/O threads, read from client sockets in parallel if <performance:iothreads> is set
+	 */
+	IOThreadManager* IOThreads;
+
 	/** The thread/class used to read config files in REHASH and on startup
 	 */
 	ConfigReaderThread* ConfigThread;
@@ -398,6 +400,10 @@ class CoreExport InspIRCd
 	 */
 	chan_hash* chanlist;
 
+	/** All channels in chanlist, by their number of users
+	 */
+	ChannelSizeIndex ChannelSizes;
+
 	/** List of the open ports
 	 */
 	std::vector<ListenSocket*> ports;
@@ -95,25 +95,67 @@ class CoreExport SocketTimeout : public Timer
 	virtual bool Tick(time_t now);
 };
 
+/** An immutable, reference counted block of outbound data.
+ * When the same data is sent to many sockets (for example a message to a
+ * channel) it is built into a SendBuffer once and every recipient's sendq
+ * holds a reference to it instead of a private copy.
+ */
+class CoreExport SendBuffer : public refcountbase
+{
+ public:
+	/** The data to send */
+	const std::string data;
+
+	/** Create a new buffer holding a copy of the given data
+	 * @param text The data to send
+	 */
+	SendBuffer(const std::string& text) : data(text) {}
+};
+
 /**
  * StreamSocket is a class that wraps a TCP socket and handles send
  * and receive queues, including passing them to IO hooks
  */
 class CoreExport StreamSocket : public EventHandler
 {
+	/** An entry in the send queue: a (possibly shared) buffer, and how much of it has been sent */
+	struct SendQueueItem
+	{
+		reference<SendBuffer> buffer;
+		size_t pos;
+		SendQueueItem(SendBuffer* buf) : buffer(buf), pos(0) {}
+		inline const char* data() const { return buffer->data.data() + pos; }
+		inline size_t length() const { return buffer->data.length() - pos; }
+	};
+
 	/** Module that handles raw I/O for this socket, or NULL */
 	reference<Module> IOHook;
-	/** Private send queue. Note that individual strings may be shared
+	/** Private send queue. Individual buffers may be shared with other sockets.
 	 */
-	std::deque<std::string> sendq;
+	std::deque<SendQueueItem> sendq;
 	/** Length, in bytes, of the sendq */
 	size_t sendq_len;
 	/** Error - if nonempty, the socket is dead, and this is the reason. */
 	std::string error;
+	/** Offset of the first byte in recvq that has not been consumed by GetNextLine() yet */
+	std::string::size_type recvq_pos;
  protected:
+	/** Receive queue. Lines taken out of it with GetNextLine() are not removed one
+	 * at a time; the consumed part is discarded in one go once no complete line is
+	 * left, or before more data is read into it.
+	 */
 	std::string recvq;
+
+	/** Remove the lines already taken out of the recvq with GetNextLine(). This must be
+	 * called before data is appended to the recvq outside of DoRead().
+	 */
+	void DiscardReadLines()
+	{
+		recvq.erase(0, recvq_pos);
+		recvq_pos = 0;
+	}
  public:
-	StreamSocket() : sendq_len(0) {}
+	StreamSocket() : sendq_len(0), recvq_pos(0) {}
 	inline Module* GetIOHook();
 	inline void AddIOHook(Module* m);
 	inline void DelIOHook();
@@ -140,6 +182,10 @@ class CoreExport StreamSocket : public EventHandler
 	/** Send the given data out the socket, either now or when writes unblock
 	 */
 	void WriteData(const std::string& data);
+	/** Send the given shared buffer out the socket, either now or when writes unblock.
+	 * The buffer is not copied, so it may be queued on any number of sockets at once.
+	 */
+	void WriteData(const reference<SendBuffer>& data);
 	/** Convenience function: read a line from the socket
 	 * @param line The line read
 	 * @param delim The line delimiter
@@ -148,6 +194,10 @@ class CoreExport StreamSocket : public EventHandler
 	bool GetNextLine(std::string& line, char delim = '\n');
 	/** Useful for implementing sendq exceeded */
 	inline size_t getSendQSize() const { return sendq_len; }
+	/** Useful for implementing recvq exceeded
+	 * @return The number of bytes in the recvq that have not been read by GetNextLine() yet
+	 */
+	inline size_t getRecvQSize() const { return recvq.length() - recvq_pos; }
 
 	/**
 	 * Close the socket, remove from socket engine, etc
@@ -0,0 +1,90 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2014 InspIRCd Development Team
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+class IOThread;
+
+/** Spreads the reading of client sockets over a number of worker threads.
+ *
+ * Each worker has its own epoll instance and owns the read side of a share of the
+ * local client sockets. Workers recv() from their sockets, split the incoming data
+ * on line boundaries and pass only complete lines back to the main thread, which
+ * appends them to the user's recvq and runs the usual OnDataReady() logic. Sockets
+ * that carry an IOHook (e.g. SSL) are never handed to a worker, and sockets which
+ * get one later are taken back with DetachSocket(). All writes happen on the main
+ * thread as before.
+ *
+ * Only available with the epoll socket engine; elsewhere Start() never starts
+ * any threads, and every socket is read by the main thread.
+ */
+class CoreExport IOThreadManager
+{
+	/** The running workers */
+	std::vector<IOThread*> threads;
+
+	/** Index of the worker the next socket will be given to */
+	unsigned int nextthread;
+
+	/** Serial number given to the next socket handed to a worker. Lines queued
+	 * by a worker carry the serial of the socket they were read from, so lines
+	 * from a closed socket can never be delivered to a new socket reusing its fd.
+	 */
+	unsigned long nextserial;
+
+ public:
+	IOThreadManager();
+	~IOThreadManager();
+
+	/** Start the given number of worker threads. Does nothing if threads are
+	 * already running or the socket engine does not support worker threads.
+	 * @param count Number of workers to start; 0 disables worker threads
+	 */
+	void Start(unsigned int count);
+
+	/** Stop all worker threads and drop any data they have not delivered yet */
+	void Stop();
+
+	/** @return True if sockets can be handed to worker threads */
+	bool IsEnabled() const { return !threads.empty(); }
+
+	/** @return The number of running worker threads */
+	size_t GetThreadCount() const { return threads.size(); }
+
+	/** Hand the reading of a user socket over to a worker thread.
+	 * The socket must already be in the socket engine, without read events.
+	 * @param eh The socket to read in a worker thread
+	 * @return True on success, false if the socket should be read by the main thread
+	 */
+	bool AddSocket(UserIOHandler* eh);
+
+	/** Take a socket away from its worker thread. This must be called before
+	 * the fd is closed. Does nothing if the socket is not owned by a worker.
+	 * @param eh The socket to remove
+	 */
+	void DelSocket(UserIOHandler* eh);
+
+	/** Move the reading of a socket back to the main thread. This must be done before
+	 * an IOHook is added to a socket which is owned by a worker (e.g. by STARTTLS), as
+	 * the hook has to do all reads itself. Anything the worker has read but not yet
+	 * delivered is dropped. Does nothing if the socket is not owned by a worker.
+	 * @param eh The socket to read in the main thread from now on
+	 */
+	void DetachSocket(UserIOHandler* eh);
+};
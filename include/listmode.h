@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include "banindex.h"
+
 /** The base class for list modes, should be inherited.
  */
 class CoreExport ListModeBase : public ModeHandler
@@ -46,7 +48,13 @@ class CoreExport ListModeBase : public ModeHandler
 		ModeList list;
 		int maxitems;
 
-		ChanData() : maxitems(-1) { }
+		/** Index of the list for matching against users, built on first use
+		 * and kept up to date as entries are added and removed
+		 */
+		BanIndex* index;
+
+		ChanData() : maxitems(-1), index(NULL) { }
+		~ChanData() { delete index; }
 	};
 
 	/** The number of items a listmode's list may contain
@@ -128,6 +136,13 @@ class CoreExport ListModeBase : public ModeHandler
 	 */
 	ModeList* GetList(Channel* channel);
 
+	/** Retrieves the list of all modes set on the given channel as an index for
+	 * matching users against, building it if this is the first time it is needed
+	 * @param channel Channel to get the index of
+	 * @return The index of the entries set on the given channel, NULL if there are none
+	 */
+	const BanIndex* GetIndex(Channel* channel);
+
 	/** Display the list for this mode
 	 * See mode.h
 	 * @param user The user to send the list to
@@ -31,6 +31,9 @@ enum LogLevel
 	LOG_NONE    = 50
 };
 
+class LogWriterThread;
+class LogSyncTimer;
+
 /** Simple wrapper providing periodic flushing to a disk-backed file.
  */
 class CoreExport FileWriter
@@ -45,17 +48,18 @@ class CoreExport FileWriter
 	 */
 	int writeops;
 
+	/** True if lines written with fputs() may still be in the stdio buffer
+	 */
+	bool buffered;
+
  public:
 	/** The constructor takes an already opened logfile.
 	 */
 	FileWriter(FILE* logfile);
 
 	/** Write one or more preformatted log lines.
-	 * If the data cannot be written immediately,
-	 * this class will insert itself into the
-	 * SocketEngine, and register a write event,
-	 * and when the write event occurs it will
-	 * attempt again to write the data.
+	 * If the log writer thread is running, the lines are queued for it,
+	 * otherwise they are written to the file right away.
 	 */
 	void WriteLogLine(const std::string &line);
 
@@ -138,10 +142,32 @@ class CoreExport LogManager
 	 */
 	FileLogMap FileLogs;
 
+	/** Writes the lines of all FileWriters in the background if <performance:logbuffer> is set, NULL otherwise.
+	 */
+	LogWriterThread* writer;
+
+	/** Asks the writer thread to fsync the log files every <performance:logsync> seconds, if that is set.
+	 */
+	LogSyncTimer* synctimer;
+
+	/** Start the writer thread, if it is enabled in the config.
+	 */
+	void StartWriter();
+
  public:
 	LogManager();
 	~LogManager();
 
+	/** Get the log writer thread
+	 * @return The thread, or NULL if lines are written by the main thread
+	 */
+	LogWriterThread* GetWriter() const { return writer; }
+
+	/** Stop the writer thread after it has written everything queued, after which lines are
+	 * written by the main thread. Does nothing if the thread is not running.
+	 */
+	void StopWriter();
+
 	/** Adds a FileWriter instance to LogManager, or increments the reference count of an existing instance.
 	 * Used for file-stream sharing for FileLogStreams.
 	 */
@@ -26,7 +26,15 @@ class CoreExport Membership : public Extensible
 	Channel* const chan;
 	// mode list, sorted by prefix rank, higest first
 	std::string modes;
-	Membership(User* u, Channel* c) : user(u), chan(c) {}
+	/** Serial of the ban index of the channel when the user was last matched against it,
+	 * or 0 if the result below is not valid. See BanIndex::GetSerial().
+	 */
+	unsigned long banserial;
+	/** True if the user matched one of the nick!ident@host bans on the channel */
+	bool banned;
+	/** Position of the user in Channel::GetLocalUsers(), if the user is local */
+	size_t localindex;
+	Membership(User* u, Channel* c) : user(u), chan(c), banserial(0), banned(false), localindex(0) {}
 	inline bool hasMode(char m) const
 	{
 		return modes.find(m) != std::string::npos;
@@ -34,6 +42,17 @@ class CoreExport Membership : public Extensible
 	unsigned int getRank();
 };
 
+/** An entry in the list of local members of a channel, see Channel::GetLocalUsers()
+ */
+struct LocalMembership
+{
+	LocalUser* user;
+	Membership* memb;
+	/** The rank of the member on the channel, as returned by Membership::getRank() */
+	unsigned int rank;
+	LocalMembership(LocalUser* u, Membership* m, unsigned int r) : user(u), memb(m), rank(r) {}
+};
+
 class CoreExport InviteBase
 {
  protected:
@@ -129,6 +129,7 @@ struct ModResult {
 		++safei; \
 		try \
 		{ \
+			HookProfiler _prof(ServerInstance->Modules, *_i, y); \
 			(*_i)->x ; \
 		} \
 		catch (CoreException& modexcept) \
@@ -154,7 +155,10 @@ do { \
 		iter_ ## n ++; \
 		try \
 		{ \
-			v = (mod_ ## n)->n args;
+			{ \
+				HookProfiler prof_ ## n(ServerInstance->Modules, mod_ ## n, I_ ## n); \
+				v = (mod_ ## n)->n args; \
+			}
 
 #define WHILE_EACH_HOOK(n) \
 		} \
@@ -373,9 +377,35 @@ enum Implementation
 	I_OnWhoisLine, I_OnBuildNeighborList, I_OnGarbageCollect, I_OnSetConnectClass,
 	I_OnText, I_OnPassCompare, I_OnRunTestSuite, I_OnNamesListItem, I_OnNumeric, I_OnHookIO,
 	I_OnPreRehash, I_OnModuleRehash, I_OnSendWhoLine, I_OnChangeIdent, I_OnSetUserIP,
+	I_OnNamesListFormat, I_OnBufferFlushed,
 	I_END
 };
 
+/** Time spent by a module in one of its hooks, see ModuleManager::ProfileHooks
+ */
+struct CoreExport HookProfile
+{
+	/** Number of times the hook was called */
+	unsigned long calls;
+	/** Total time spent in the hook, in nanoseconds */
+	unsigned long long total;
+	/** Longest single call of the hook, in nanoseconds */
+	unsigned long long max;
+
+	HookProfile() : calls(0), total(0), max(0) { }
+
+	/** Record one call of the hook
+	 * @param elapsed Time the call took, in nanoseconds
+	 */
+	void Add(unsigned long long elapsed)
+	{
+		calls++;
+		total += elapsed;
+		if (elapsed > max)
+			max = elapsed;
+	}
+};
+
 /** Base class for all InspIRCd modules
  *  This class is the base class for InspIRCd modules. All modules must inherit from this class,
  *  its methods will be called when irc server events occur. class inherited from module must be
@@ -396,6 +426,11 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	bool dying;
 
+	/** Time spent in each hook of this module, only collected while ModuleManager::ProfileHooks is set.
+	 * Times include any hooks of other modules called from inside the hook.
+	 */
+	HookProfile profile[I_END];
+
 	/** Default constructor.
 	 * Creates a module class. Don't do any type of hook registration or checks
 	 * for other modules here; do that in init().
@@ -1054,7 +1089,10 @@ class CoreExport Module : public classbase, public usecountbase
 	virtual ModResult OnCheckChannelBan(User* user, Channel* chan);
 
 	/**
-	 * Checks for a user's match of a single ban
+	 * Checks for a user's match of a single ban.
+	 * When checking the ban list of a channel the core matches ordinary
+	 * nick!ident@host bans itself, and only calls this for extbans. Modules
+	 * checking their own lists with Channel::CheckBan() see every mask.
 	 * @param user The user to check for match
 	 * @param chan The channel on which the match is being checked
 	 * @param mask The mask being checked
@@ -1252,9 +1290,19 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	virtual void OnRunTestSuite();
 
+	/** Called before a NAMES list is sent, to choose its format. Members of a channel are normally sent
+	 * a cached copy of the list; modules which hide or change entries in OnNamesListItem() must set
+	 * NAMES_FILTER here when they may do so, or OnNamesListItem() will not be called.
+	 * @param issuer The user the NAMES list is for
+	 * @param chan The channel
+	 * @param format A combination of NamesListFormat flags, modules may add flags to it
+	 */
+	virtual void OnNamesListFormat(User* issuer, Channel* chan, unsigned int& format);
+
 	/** Called for every item in a NAMES list, so that modules may reformat portions of it as they see fit.
-	 * For example NAMESX, channel mode +u and +I, and UHNAMES. If the nick is set to an empty string by any
-	 * module, then this will cause the nickname not to be displayed at all.
+	 * For example channel mode +u and +D. If the nick is set to an empty string by any
+	 * module, then this will cause the nickname not to be displayed at all. This is only called if
+	 * NAMES_FILTER was set in OnNamesListFormat(), or the issuer is not on the channel.
 	 */
 	virtual void OnNamesListItem(User* issuer, Membership* item, std::string &prefixes, std::string &nick);
 
@@ -1273,6 +1321,13 @@ class CoreExport Module : public classbase, public usecountbase
 	 * @param user The user whose IP is being set
 	 */
 	virtual void OnSetUserIP(LocalUser* user);
+
+	/** Called when the send queue of a local user has been written out down to the size set in
+	 * UserIOHandler::flushwatermark, which is reset to 0 before this is called. This lets modules
+	 * send long replies a part at a time, as the client reads them.
+	 * @param user The user whose send queue was written out
+	 */
+	virtual void OnBufferFlushed(LocalUser* user);
 };
 
 /** Provides an easy method of reading a text file into memory. */
@@ -1355,6 +1410,11 @@ class CoreExport ModuleManager
 	 */
 	IntModuleList EventHandlers[I_END];
 
+	/** True if the time spent in each hook should be recorded in Module::profile,
+	 * set from <performance:hookprofiling>
+	 */
+	bool ProfileHooks;
+
 	/** List of data services keyed by name */
 	std::multimap<std::string, ServiceProvider*> DataProviders;
 
@@ -1505,6 +1565,46 @@ class CoreExport ModuleManager
 	 * @return The list of module names
 	 */
 	const std::vector<std::string> GetAllModuleNames(int filter);
+
+	/** Clear the hook profiles of all loaded modules */
+	void ResetHookProfiles();
+
+	/** Get the name of a hook, as shown in hook profiles
+	 * @param hook The hook to get the name of
+	 * @return The name of the hook, e.g. "OnUserJoin"
+	 */
+	static const char* GetHookName(Implementation hook);
+
+	/** Read the monotonic clock used to time hooks
+	 * @return The current time in nanoseconds, from an arbitrary starting point
+	 */
+	static unsigned long long GetHookClock();
+};
+
+/** Times a single call to a module hook while ModuleManager::ProfileHooks is set.
+ * Used by FOREACH_MOD and DO_EACH_HOOK; the time is recorded when it goes out of scope.
+ */
+class HookProfiler
+{
+	/** The profile to record the call in, or NULL if profiling is disabled */
+	HookProfile* const profile;
+
+	/** Time the call started */
+	unsigned long long start;
+
+ public:
+	HookProfiler(ModuleManager* manager, Module* mod, Implementation hook)
+		: profile(manager->ProfileHooks ? &mod->profile[hook] : NULL), start(0)
+	{
+		if (profile)
+			start = ModuleManager::GetHookClock();
+	}
+
+	~HookProfiler()
+	{
+		if (profile)
+			profile->Add(ModuleManager::GetHookClock() - start);
+	}
 };
 
 /** Do not mess with these functions unless you know the C preprocessor
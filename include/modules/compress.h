@@ -0,0 +1,68 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2014 InspIRCd Development Team
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "modules.h"
+
+/** One direction of a compressed stream, turning plain data into compressed data */
+class Compressor
+{
+ public:
+	virtual ~Compressor() { }
+
+	/** Compress data
+	 * @param in Data to compress
+	 * @param out The compressed data is appended to this; it may be left empty
+	 * if the compressor is still collecting input
+	 * @param flush True to write out everything given so far, so that the other
+	 * side can decompress all of it from what has been appended to out
+	 */
+	virtual void Compress(const std::string& in, std::string& out, bool flush) = 0;
+};
+
+/** One direction of a compressed stream, turning compressed data back into plain data */
+class Decompressor
+{
+ public:
+	virtual ~Decompressor() { }
+
+	/** Decompress data
+	 * @param in Data to decompress, which does not have to end on a flush
+	 * @param out The decompressed data is appended to this
+	 * @return False if the data is corrupt, in which case the stream can not be used any more
+	 */
+	virtual bool Decompress(const std::string& in, std::string& out) = 0;
+};
+
+/** A compression method, such as zlib. The name of the service is "compress/" followed
+ * by the name of the method.
+ */
+class CompressProvider : public DataProvider
+{
+ public:
+	CompressProvider(Module* mod, const std::string& Name)
+		: DataProvider(mod, "compress/" + Name) { }
+
+	/** Create the sending side of a new stream. The caller deletes it. */
+	virtual Compressor* CreateCompressor() = 0;
+
+	/** Create the receiving side of a new stream. The caller deletes it. */
+	virtual Decompressor* CreateDecompressor() = 0;
+};
@@ -230,6 +230,8 @@ class CoreExport EventHandler : public classbase
  */
 class CoreExport SocketEngine
 {
+	/** I/O threads read from sockets themselves, and pass the statistics on to the socket engine */
+	friend class IOThread;
  protected:
 	/** Current number of descriptors in the engine
 	 */
@@ -47,6 +47,17 @@ class CoreExport Timer
 	 */
 	bool repeat;
 
+	/** Next timer in the TimerManager wheel slot this timer is in
+	 */
+	Timer* next;
+
+	/** The pointer to this timer in the TimerManager wheel slot this timer is in,
+	 * or NULL if the timer is not in the TimerManager
+	 */
+	Timer** pprev;
+
+	friend class TimerManager;
+
  public:
 	/** Default constructor, initializes the triggering time
 	 * @param mod The module that created this timer
@@ -55,6 +66,7 @@ class CoreExport Timer
 	 * @param repeating Repeat this timer every secs_from_now seconds if set to true
 	 */
 	Timer(unsigned int secs_from_now, time_t now, bool repeating = false)
+		: next(NULL), pprev(NULL)
 	{
 		trigger = now + secs_from_now;
 		secs = secs_from_now;
@@ -114,32 +126,66 @@ class CoreExport Timer
 	{
 		repeat = false;
 	}
-};
 
-typedef std::multimap<time_t, Timer*> TimerMap;
+	/** Returns true if this timer is currently waiting in the TimerManager
+	 */
+	bool IsScheduled() const
+	{
+		return (pprev != NULL);
+	}
+};
 
 /** This class manages sets of Timers, and triggers them at their defined times.
  * This will ensure timers are not missed, as well as removing timers that have
  * expired and allowing the addition of new ones.
+ *
+ * Timers are kept in a hashed timer wheel with one slot per second: a timer
+ * lives in the slot for its trigger time modulo the wheel size, so adding and
+ * removing a timer is O(1) and each tick only visits the slots for the seconds
+ * that have passed. Timers further in the future than one turn of the wheel
+ * are skipped over until their turn comes.
  */
 class CoreExport TimerManager
 {
-	/** A list of all pending timers
+	/** Number of slots in the wheel, must be a power of two
 	 */
-	TimerMap Timers;
+	static const unsigned int WHEEL_SIZE = 1024;
+
+	/** The wheel; each slot is the head of a list of timers
+	 */
+	Timer* wheel[WHEEL_SIZE];
+
+	/** The time passed to the last TickTimers() call
+	 */
+	time_t lasttick;
+
+	/** The next timer to be visited in the slot that is being ticked.
+	 * DelTimer() updates this if a Tick() removes that timer.
+	 */
+	Timer* nexttimer;
+
+	/** Tick all due timers in one wheel slot
+	 * @param slot The slot to tick
+	 * @param TIME the current system time
+	 */
+	void TickSlot(unsigned int slot, time_t TIME);
 
  public:
+	/** Constructor, creates an empty wheel
+	 */
+	TimerManager();
+
 	/** Tick all pending Timers
 	 * @param TIME the current system time
 	 */
 	void TickTimers(time_t TIME);
 
-	/** Add an Timer
+	/** Add an Timer. If the timer is already added, it is moved to its current trigger time.
 	 * @param T an Timer derived class to add
 	 */
 	void AddTimer(Timer *T);
 
-	/** Remove a Timer
+	/** Remove a Timer. Does nothing if the timer is not added.
 	 * @param T an Timer derived class to remove
 	 */
 	void DelTimer(Timer* T);
@@ -33,7 +33,10 @@ class FakeUser;
 class InspIRCd;
 class Invitation;
 class InviteBase;
+class IOThread;
+class IOThreadManager;
 class LocalUser;
+struct LocalMembership;
 class Membership;
 class Module;
 class OperInfo;
@@ -49,10 +52,11 @@ struct ConnectClass;
 struct ModResult;
 
 #include "hashcomp.h"
+#include "hashmap.h"
 #include "base.h"
 
-typedef TR1NS::unordered_map<std::string, User*, irc::insensitive, irc::StrHashComp> user_hash;
-typedef TR1NS::unordered_map<std::string, Channel*, irc::insensitive, irc::StrHashComp> chan_hash;
+typedef irc::hash_map<User*> user_hash;
+typedef irc::hash_map<Channel*> chan_hash;
 
 /** A list holding local users, this is the type of UserManager::local_users
  */
@@ -119,6 +123,11 @@ typedef UserMembList::iterator UserMembIter;
 /** const Iterator of UserMembList */
 typedef UserMembList::const_iterator UserMembCIter;
 
+/** Local members of a channel, in no particular order */
+typedef std::vector<LocalMembership> LocalMembList;
+/** const Iterator of LocalMembList */
+typedef LocalMembList::const_iterator LocalMembCIter;
+
 /** Generic user list, used for exceptions */
 typedef std::set<User*> CUList;
 
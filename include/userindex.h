@@ -0,0 +1,174 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2014 InspIRCd Development Team
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Sorted indexes of the nicks, hosts and IPs of all users, for finding the users
+ * that may match a mask without looking at every user.
+ *
+ * Nicks are kept casefolded, so the users whose nick starts with the text before the
+ * first wildcard of a mask are next to each other. Hosts are kept reversed, which does
+ * the same for the text after the last wildcard, e.g. all users under *.example.com.
+ * IPs are kept as raw addresses, so a CIDR range is a range of the index too. For a
+ * mask that only has wildcards on the other side, the index can still tell that no
+ * nick or host matches it if the mask has a character that none of them have, such
+ * as the dots of *.example.com, which are not valid in nicks.
+ *
+ * The index is kept up to date by User::InvalidateCache() and User::SetClientIP(),
+ * which are called whenever a user's nick, host or IP changes.
+ */
+class CoreExport UserIndex
+{
+	typedef std::set<std::pair<std::string, User*> > KeySet;
+
+	/** A sorted index of one field of the users */
+	struct Field
+	{
+		/** The keys of all users */
+		KeySet keys;
+
+		/** Number of times each character is found in the keys */
+		unsigned int chars[256];
+
+		Field() { memset(chars, 0, sizeof(chars)); }
+
+		/** Add a user to the index
+		 * @param user The user
+		 * @param key The key of the user
+		 * @return The entry of the user, which is needed to remove it
+		 */
+		KeySet::iterator Add(User* user, const std::string& key);
+
+		/** Remove a user from the index
+		 * @param entry The entry of the user
+		 */
+		void Remove(KeySet::iterator entry);
+
+		/** Move a user to a new key, if its key changed
+		 * @param entry The entry of the user, updated to the new entry
+		 * @param key The current key of the user
+		 */
+		void Update(KeySet::iterator& entry, const std::string& key);
+
+		/** Add the users whose key starts with some text to a list
+		 * @param prefix The text
+		 * @param out The list to add to
+		 */
+		void FindPrefix(const std::string& prefix, std::vector<User*>& out) const;
+
+		/** Check if any key has all of the characters of a mask, apart from its wildcards
+		 * @param mask The mask, folded in the same way as the keys
+		 * @return False if no key can match the mask
+		 */
+		bool CanMatch(const std::string& mask) const;
+	};
+
+	/** The entries of a user in the indexes */
+	struct Entries
+	{
+		KeySet::iterator nick;
+		KeySet::iterator host;
+		KeySet::iterator dhost;
+		KeySet::iterator ip;
+	};
+	typedef std::map<User*, Entries> EntryMap;
+
+	/** The entries of every user in the index */
+	EntryMap users;
+
+	/** Casefolded nicks */
+	Field nicks;
+
+	/** Reversed, lowercased real hosts */
+	Field hosts;
+
+	/** Reversed, lowercased displayed hosts */
+	Field dhosts;
+
+	/** Address family followed by the raw address */
+	Field ips;
+
+	/** Number of users on each server */
+	std::map<std::string, unsigned int> servers;
+
+	/** Find the users whose host may match a mask
+	 * @param field The index of the real or the displayed hosts
+	 * @param mask The mask
+	 * @param out The users are added to this
+	 * @return False if the mask ends with a wildcard and some host may match it, in
+	 * which case the index can not find the users
+	 */
+	static bool FindHost(const Field& field, const std::string& mask, std::vector<User*>& out);
+
+ public:
+	/** Add a new user to the index
+	 * @param user The user, with its nick, host and IP set
+	 */
+	void Add(User* user);
+
+	/** Remove a user from the index
+	 * @param user The user
+	 */
+	void Remove(User* user);
+
+	/** Update the keys of a user after its nick, host or IP changed. Does nothing if the user
+	 * is not in the index yet.
+	 * @param user The user
+	 */
+	void Update(User* user);
+
+	/** Casefold all nicks again, after national_case_insensitive_map changed
+	 */
+	void Refold();
+
+	/** Find the users whose nick may match a mask
+	 * @param mask The mask, matched as InspIRCd::Match() would
+	 * @param out The users are added to this
+	 * @return False if the mask starts with a wildcard and some nick may match it, in
+	 * which case the index can not find the users
+	 */
+	bool FindNick(const std::string& mask, std::vector<User*>& out) const;
+
+	/** Find the users whose real host may match a mask
+	 * @param mask The mask, matched as InspIRCd::Match() with ascii_case_insensitive_map would
+	 * @param out The users are added to this
+	 * @return False if the mask ends with a wildcard and some host may match it, in
+	 * which case the index can not find the users
+	 */
+	bool FindHost(const std::string& mask, std::vector<User*>& out) const { return FindHost(hosts, mask, out); }
+
+	/** Find the users whose displayed host may match a mask
+	 * @param mask The mask, matched as InspIRCd::Match() with ascii_case_insensitive_map would
+	 * @param out The users are added to this
+	 * @return False if the mask ends with a wildcard and some host may match it, in
+	 * which case the index can not find the users
+	 */
+	bool FindDisplayedHost(const std::string& mask, std::vector<User*>& out) const { return FindHost(dhosts, mask, out); }
+
+	/** Find the users whose IP is within a range
+	 * @param range The range
+	 * @param out The users are added to this
+	 */
+	void FindIP(const irc::sockets::cidr_mask& range, std::vector<User*>& out) const;
+
+	/** Get the names of all servers that have users on them
+	 * @return A map of server names to their number of users
+	 */
+	const std::map<std::string, unsigned int>& GetServers() const { return servers; }
+};
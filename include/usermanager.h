@@ -59,6 +59,10 @@ class CoreExport UserManager
 	 */
 	std::list<User*> all_opers;
 
+	/** The nicks, hosts and IPs of all users in clientlist, for finding the users matching a mask
+	 */
+	UserIndex Index;
+
 	/** Number of unregistered users online right now.
 	 * (Unregistered means before USER/NICK/dns)
 	 */
@@ -400,6 +400,11 @@ class CoreExport User : public Extensible
 	 */
 	void InvalidateCache();
 
+	/** Forget whether this user matched the bans on its channels, see Membership::banserial.
+	 * Called by InvalidateCache() and whenever the IP of the user changes.
+	 */
+	void InvalidateBanCache();
+
 	/** Create a displayable mode string for this users snomasks
 	 * @return The notice mask character sequence
 	 */
@@ -696,16 +701,84 @@ class CoreExport UserIOHandler : public StreamSocket
 {
  public:
 	LocalUser* const user;
-	UserIOHandler(LocalUser* me) : user(me) {}
+
+	/** The I/O thread reading from this socket, or NULL if it is read by the main thread */
+	IOThread* iothread;
+
+	/** Serial number of this socket in its I/O thread, see IOThreadManager */
+	unsigned long ioserial;
+
+	/** If non-zero, Module::OnBufferFlushed() is called once the send queue is no larger than this
+	 * many bytes. Modules that send a reply in parts set this when they stop sending.
+	 */
+	unsigned long flushwatermark;
+
+	UserIOHandler(LocalUser* me) : user(me), iothread(NULL), ioserial(0), flushwatermark(0) {}
 	void OnDataReady();
+	void DoWrite();
 	void OnError(BufferedSocketError error);
 
+	/** Removes the socket from its I/O thread, if any, then closes it */
+	void Close();
+
+	/** Called in the main thread with data read from this socket by an I/O thread
+	 * @param data One or more complete lines, or an overlong partial line
+	 */
+	void ReadFromThread(const std::string& data);
+
 	/** Adds to the user's write buffer.
 	 * You may add any amount of text up to this users sendq value, if you exceed the
 	 * sendq value, the user will be removed, and further buffer adds will be dropped.
 	 * @param data The data to add to the write buffer
 	 */
 	void AddWriteBuf(const std::string &data);
+
+	/** Adds a shared buffer to the user's write buffer, without copying it.
+	 * The same sendq limits apply as for AddWriteBuf(const std::string&).
+	 * @param data The buffer to add to the write buffer
+	 */
+	void AddWriteBuf(const reference<SendBuffer>& data);
+};
+
+/** Sends PINGs to a registered local user and quits them if they do not answer.
+ * Fires when the user's ping deadline (LocalUser::nping) passes; if the user has
+ * been active since the timer was set, it just moves itself to the new deadline.
+ */
+class CoreExport UserPingTimer : public Timer
+{
+	LocalUser* const user;
+ public:
+	UserPingTimer(LocalUser* me);
+	bool Tick(time_t now);
+
+	/** Schedule this timer for the user's current ping deadline */
+	void Reset();
+};
+
+/** Once a second while a local user has not yet registered, checks whether all modules
+ * are ready for them to connect and enforces the registration timeout.
+ */
+class CoreExport UserRegistrationTimer : public Timer
+{
+	LocalUser* const user;
+ public:
+	UserRegistrationTimer(LocalUser* me);
+	bool Tick(time_t now);
+};
+
+/** Once a second while a local user has a command flood penalty or a sendq,
+ * reduces the penalty by their command rate and processes any lines that were
+ * held back because of it.
+ */
+class CoreExport UserFakeLagTimer : public Timer
+{
+	LocalUser* const user;
+ public:
+	UserFakeLagTimer(LocalUser* me);
+	bool Tick(time_t now);
+
+	/** Schedule this timer for the next second, unless it is already scheduled */
+	void Start();
 };
 
 typedef unsigned int already_sent_t;
@@ -790,6 +863,15 @@ class CoreExport LocalUser : public User, public InviteBase
 	 */
 	unsigned int CommandFloodPenalty;
 
+	/** Timer for ping checks, running once the user has registered */
+	UserPingTimer pingtimer;
+
+	/** Timer for the registration timeout, running until the user has registered */
+	UserRegistrationTimer regtimer;
+
+	/** Timer for draining CommandFloodPenalty, running while there is anything to drain */
+	UserFakeLagTimer fakelagtimer;
+
 	static already_sent_t already_sent_id;
 	already_sent_t already_sent;
 
@@ -818,6 +900,19 @@ class CoreExport LocalUser : public User, public InviteBase
 	void Write(const std::string& text);
 	void Write(const char*, ...) CUSTOM_PRINTF(2, 3);
 
+	/** Write a line built by MakeLine() to this user. The buffer is shared, not copied,
+	 * so a line sent to many users only has to be built once.
+	 * @param line The line to send, including the trailing CR/LF
+	 */
+	void Write(const reference<SendBuffer>& line);
+
+	/** Build a line for sending with Write(const reference<SendBuffer>&), cropping it
+	 * to the maximum line length and appending CR/LF.
+	 * @param text The line to send, without a trailing CR/LF
+	 * @return A shared buffer holding the line
+	 */
+	static reference<SendBuffer> MakeLine(const std::string& text);
+
 	/** Returns the list of channels this user has been invited to but has not yet joined.
 	 * @return A list of channels the user is invited to
 	 */
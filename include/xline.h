@@ -115,6 +115,14 @@ class CoreExport XLine : public classbase
 	 */
 	virtual void OnAdd() { }
 
+	/** Returns the part of the pattern which is matched against the host
+	 * and IP of a user, for lines which can only match users whose host or IP
+	 * is covered by it. XLineManager uses this to look up the lines of a type
+	 * which may match a user, instead of matching every line. Lines which
+	 * return an empty string are matched against every user.
+	 */
+	virtual std::string GetHostMask() { return std::string(); }
+
 	/** The time the line was added.
 	 */
 	time_t set_time;
@@ -178,6 +186,8 @@ class CoreExport KLine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual std::string GetHostMask() { return hostmask; }
+
 	virtual bool IsBurstable();
 
 	/** Ident mask (ident part only)
@@ -224,6 +234,8 @@ class CoreExport GLine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual std::string GetHostMask() { return hostmask; }
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -268,6 +280,8 @@ class CoreExport ELine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual std::string GetHostMask() { return hostmask; }
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -309,6 +323,8 @@ class CoreExport ZLine : public XLine
 
 	virtual const std::string& Displayable();
 
+	virtual std::string GetHostMask() { return ipaddr; }
+
 	/** IP mask (no ident part)
 	 */
 	std::string ipaddr;
@@ -391,6 +407,67 @@ class CoreExport XLineFactory
 	virtual ~XLineFactory() { }
 };
 
+/** Looks up the lines of one type which may match a user.
+ *
+ * Lines with a literal host mask (see XLine::GetHostMask()) are kept in a
+ * hash table keyed by that mask, and those which are also CIDR ranges in a
+ * table of ranges for each prefix length in use, so only the lines set on the
+ * host or IP of a user, or on a range containing its IP, are candidates for
+ * matching. Lines with wildcards in the host mask, or no host mask at all,
+ * have to be matched against every user.
+ */
+class CoreExport XLineIndex
+{
+	typedef TR1NS::unordered_multimap<std::string, XLine*> HostMap;
+	typedef std::multimap<irc::sockets::cidr_mask, XLine*> RangeMap;
+
+	/** Lines with a literal host mask, by lowercased host mask */
+	HostMap hosts;
+
+	/** Lines with a literal host mask that is a CIDR range, by range */
+	RangeMap ranges;
+
+	/** Number of lines in ranges for each address family and prefix length */
+	std::map<std::pair<int, int>, unsigned int> prefixlens;
+
+	/** Lines which can not be looked up by host, by Displayable() */
+	XLineLookup unindexed;
+
+	/** Get the host mask of a line if it can be indexed
+	 * @param line The line to check
+	 * @param mask Set to the lowercased host mask of the line
+	 * @param range Set to the range of the host mask if it is a CIDR range
+	 * @param isrange Set to true if the host mask is a CIDR range
+	 * @return True if the line can be looked up by host, false if it has to be matched against every user
+	 */
+	static bool GetKey(XLine* line, std::string& mask, irc::sockets::cidr_mask& range, bool& isrange);
+
+ public:
+	/** Add a line to the index
+	 * @param line The line to add
+	 */
+	void Add(XLine* line);
+
+	/** Remove a line from the index
+	 * @param line The line to remove
+	 */
+	void Remove(XLine* line);
+
+	/** Get the lines which are set on the host or IP of a user, or a range containing its IP.
+	 * These still have to be matched with XLine::Matches().
+	 * @param user The user to look up
+	 * @param out Receives the lines found, possibly more than once
+	 */
+	void Find(User* user, std::vector<XLine*>& out) const;
+
+	/** Get the lines which can not be looked up by host, which have to be matched against every user
+	 * @return The lines which are not in the host and range tables, in the same order as in XLineManager
+	 */
+	const XLineLookup& GetUnindexed() const { return unindexed; }
+};
+
+class XLineExpiryTimer;
+
 /** XLineManager is a class used to manage glines, klines, elines, zlines and qlines,
  * or any other line created by a module. It also manages XLineFactory classes which
  * can generate a specialized XLine for use by another module.
@@ -413,6 +490,27 @@ class CoreExport XLineManager
 	 */
 	XLineContainer lookup_lines;
 
+	/** Indexes of the lines in lookup_lines, by type
+	 */
+	std::map<std::string, XLineIndex> line_index;
+
+	/** Lines which have a duration, ordered by the time they expire
+	 */
+	std::set<std::pair<time_t, XLine*> > expiring;
+
+	/** Fires when the first line in expiring is due to expire
+	 */
+	XLineExpiryTimer* expirytimer;
+
+	/** Remove a line from the expiry list
+	 * @param line The line to remove
+	 */
+	void RemoveExpiring(XLine* line);
+
+	/** Set the expiry timer to fire when the first line in the expiry list expires
+	 */
+	void ScheduleExpiry();
+
  public:
 
 	/** Constructor
@@ -433,8 +531,6 @@ class CoreExport XLineManager
 	void CheckELines();
 
 	/** Get all lines of a certain type to an XLineLookup (std::map<std::string, XLine*>).
-	 * NOTE: When this function runs any expired items are removed from the list before it
-	 * is returned to the caller.
 	 * @param type The type to look up
 	 * @return A list of all XLines of the given type.
 	 */
@@ -509,6 +605,13 @@ class CoreExport XLineManager
 	 */
 	void ExpireLine(ContainerIter container, LookupIter item);
 
+	/** Expire all lines whose expiry time has passed. This is called by a timer
+	 * when the first line is due to expire, so lines never have to be checked
+	 * for expiry when they are matched.
+	 * @param current The current time
+	 */
+	void ExpireLines(time_t current);
+
 	/** Apply any new lines that are pending to be applied.
 	 * This will only apply lines in the pending_lines list, to save on
 	 * CPU time.
@@ -516,8 +619,6 @@ class CoreExport XLineManager
 	void ApplyLines();
 
 	/** Handle /STATS for a given type.
-	 * NOTE: Any items in the list for this particular line type which have expired
-	 * will be expired and removed before the list is displayed.
 	 * @param type The type of stats to show
 	 * @param numeric The numeric to give to each result line
 	 * @param user The username making the query
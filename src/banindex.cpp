@@ -0,0 +1,201 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2014 InspIRCd Development Team
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "banindex.h"
+
+unsigned long BanIndex::nextserial = 0;
+
+/** Check whether the host part of a mask is a CIDR range, the way MatchCIDR() would parse it
+ * @param suffix The host part of the mask
+ * @param range Set to the range if it is one
+ */
+static bool ParseRange(const std::string& suffix, irc::sockets::cidr_mask& range)
+{
+	std::string::size_type slash = suffix.rfind('/');
+	if (slash == std::string::npos)
+		return false;
+
+	irc::sockets::sockaddrs sa;
+	if (!irc::sockets::aptosa(suffix.substr(0, slash), 0, sa))
+		return false;
+
+	range = irc::sockets::cidr_mask(suffix);
+	return true;
+}
+
+void BanIndex::Add(const std::string& mask)
+{
+	serial = ++nextserial;
+
+	// Anything that is not a nick!ident@host mask is left to the modules
+	if ((mask.length() <= 2) || (mask[1] == ':'))
+	{
+		extbans.push_back(mask);
+		return;
+	}
+
+	std::string::size_type at = mask.find('@');
+	if (at == std::string::npos)
+		return;
+
+	Entry entry(mask, at);
+	if (entry.suffix.find_first_of("*?@") != std::string::npos)
+	{
+		wildcards.push_back(entry);
+		return;
+	}
+
+	irc::sockets::cidr_mask range;
+	if (ParseRange(entry.suffix, range))
+	{
+		ranges.insert(std::make_pair(range, entry));
+		prefixlens[std::make_pair(range.type, range.length)]++;
+	}
+	hosts.insert(std::make_pair(entry.suffix, entry));
+}
+
+void BanIndex::Remove(const std::string& mask)
+{
+	serial = ++nextserial;
+
+	if ((mask.length() <= 2) || (mask[1] == ':'))
+	{
+		std::vector<std::string>::iterator i = std::find(extbans.begin(), extbans.end(), mask);
+		if (i != extbans.end())
+			extbans.erase(i);
+		return;
+	}
+
+	std::string::size_type at = mask.find('@');
+	if (at == std::string::npos)
+		return;
+
+	const std::string suffix = mask.substr(at + 1);
+	if (suffix.find_first_of("*?@") != std::string::npos)
+	{
+		for (std::vector<Entry>::iterator i = wildcards.begin(); i != wildcards.end(); ++i)
+		{
+			if (i->mask == mask)
+			{
+				wildcards.erase(i);
+				break;
+			}
+		}
+		return;
+	}
+
+	irc::sockets::cidr_mask range;
+	if (ParseRange(suffix, range))
+	{
+		std::pair<RangeMap::iterator, RangeMap::iterator> matches = ranges.equal_range(range);
+		for (RangeMap::iterator i = matches.first; i != matches.second; ++i)
+		{
+			if (i->second.mask == mask)
+			{
+				ranges.erase(i);
+				std::map<std::pair<int, int>, unsigned int>::iterator len = prefixlens.find(std::make_pair(range.type, range.length));
+				if (len != prefixlens.end() && !--len->second)
+					prefixlens.erase(len);
+				break;
+			}
+		}
+	}
+
+	std::pair<HostMap::iterator, HostMap::iterator> matches = hosts.equal_range(suffix);
+	for (HostMap::iterator i = matches.first; i != matches.second; ++i)
+	{
+		if (i->second.mask == mask)
+		{
+			hosts.erase(i);
+			break;
+		}
+	}
+}
+
+bool BanIndex::MatchHost(const std::string& nickident, const std::string& host) const
+{
+	std::pair<HostMap::const_iterator, HostMap::const_iterator> matches = hosts.equal_range(host);
+	for (HostMap::const_iterator i = matches.first; i != matches.second; ++i)
+	{
+		if (MatchPrefix(nickident, i->second))
+			return true;
+	}
+	return false;
+}
+
+bool BanIndex::Matches(User* user) const
+{
+	if (hosts.empty() && wildcards.empty())
+		return false;
+
+	const std::string nickident = user->nick + "!" + user->ident;
+	const std::string& ip = user->GetIPString();
+
+	if (!hosts.empty())
+	{
+		if (MatchHost(nickident, user->host))
+			return true;
+		if (user->dhost != user->host && MatchHost(nickident, user->dhost))
+			return true;
+		if (ip != user->host && ip != user->dhost && MatchHost(nickident, ip))
+			return true;
+	}
+
+	// Look up the user's address masked to each prefix length that has a range set on it
+	if (!prefixlens.empty() && (user->client_sa.sa.sa_family == AF_INET || user->client_sa.sa.sa_family == AF_INET6))
+	{
+		for (std::map<std::pair<int, int>, unsigned int>::const_iterator len = prefixlens.begin(); len != prefixlens.end(); ++len)
+		{
+			if (len->first.first != user->client_sa.sa.sa_family)
+				continue;
+
+			irc::sockets::cidr_mask range(user->client_sa, len->first.second);
+			std::pair<RangeMap::const_iterator, RangeMap::const_iterator> matches = ranges.equal_range(range);
+			for (RangeMap::const_iterator i = matches.first; i != matches.second; ++i)
+			{
+				if (MatchPrefix(nickident, i->second))
+					return true;
+			}
+		}
+	}
+
+	for (std::vector<Entry>::const_iterator i = wildcards.begin(); i != wildcards.end(); ++i)
+	{
+		if (MatchPrefix(nickident, *i) &&
+			(InspIRCd::Match(user->host, i->suffix, NULL) ||
+			InspIRCd::Match(user->dhost, i->suffix, NULL) ||
+			InspIRCd::MatchCIDR(ip, i->suffix, NULL)))
+			return true;
+	}
+	return false;
+}
+
+bool BanIndex::MatchesHost(const std::string& nickident, const std::string& host) const
+{
+	if (MatchHost(nickident, host))
+		return true;
+
+	for (std::vector<Entry>::const_iterator i = wildcards.begin(); i != wildcards.end(); ++i)
+	{
+		if (MatchPrefix(nickident, *i) && InspIRCd::Match(host, i->suffix, NULL))
+			return true;
+	}
+	return false;
+}
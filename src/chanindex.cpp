@@ -0,0 +1,76 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2014 InspIRCd Development Team
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+void ChannelSizeIndex::Insert(Channel* chan, size_t size)
+{
+	std::vector<Channel*>& list = sizes[size];
+	chan->sizeindex = list.size();
+	list.push_back(chan);
+}
+
+void ChannelSizeIndex::Erase(Channel* chan, size_t size)
+{
+	SizeMap::iterator it = sizes.find(size);
+	std::vector<Channel*>& list = it->second;
+
+	// Move the last channel of this size into the gap
+	list[chan->sizeindex] = list.back();
+	list[chan->sizeindex]->sizeindex = chan->sizeindex;
+	list.pop_back();
+	if (list.empty())
+		sizes.erase(it);
+}
+
+void ChannelSizeIndex::Add(Channel* chan)
+{
+	Insert(chan, chan->GetUserCounter());
+}
+
+void ChannelSizeIndex::Remove(Channel* chan)
+{
+	if (chan->sizeindex == Channel::NOT_INDEXED)
+		return;
+
+	Erase(chan, chan->GetUserCounter());
+	chan->sizeindex = Channel::NOT_INDEXED;
+}
+
+void ChannelSizeIndex::Resize(Channel* chan, size_t oldsize)
+{
+	if (chan->sizeindex == Channel::NOT_INDEXED)
+		return;
+
+	Erase(chan, oldsize);
+	Insert(chan, chan->GetUserCounter());
+}
+
+void ChannelSizeIndex::Find(size_t minsize, size_t maxsize, std::vector<Channel*>& out) const
+{
+	if (minsize > maxsize)
+		return;
+
+	SizeMap::const_iterator first = sizes.lower_bound(minsize);
+	SizeMap::const_iterator last = sizes.upper_bound(maxsize);
+	SizeMap::const_reverse_iterator i(last);
+	SizeMap::const_reverse_iterator end(first);
+	for (; i != end; ++i)
+		out.insert(out.end(), i->second.begin(), i->second.end());
+}
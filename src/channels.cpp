@@ -42,6 +42,8 @@ Channel::Channel(const std::string &cname, time_t ts)
 
 	topicset = 0;
 	modes.reset();
+	namesvalid = 0;
+	ServerInstance->ChannelSizes.Add(this);
 }
 
 void Channel::SetMode(char mode,bool mode_on)
@@ -133,6 +135,14 @@ Membership* Channel::AddUser(User* user)
 		return NULL;
 
 	memb = new Membership(user, this);
+	ServerInstance->ChannelSizes.Resize(this, userlist.size() - 1);
+	LocalUser* luser = IS_LOCAL(user);
+	if (luser)
+	{
+		memb->localindex = localusers.size();
+		localusers.push_back(LocalMembership(luser, memb, memb->getRank()));
+	}
+	AddNamesListEntry(memb);
 	return memb;
 }
 
@@ -160,17 +170,33 @@ void Channel::CheckDestroy()
 		FOREACH_MOD(I_OnChannelDelete, OnChannelDelete(this));
 		ServerInstance->chanlist->erase(iter);
 	}
+	ServerInstance->ChannelSizes.Remove(this);
 
 	ClearInvites();
 	ServerInstance->GlobalCulls.AddItem(this);
 }
 
+CullResult Channel::cull()
+{
+	ServerInstance->ChannelSizes.Remove(this);
+	return Extensible::cull();
+}
+
 void Channel::DelUser(const UserMembIter& membiter)
 {
 	Membership* memb = membiter->second;
+	RemoveNamesListEntry(memb);
+	if (IS_LOCAL(memb->user))
+	{
+		// Move the last local member into the gap
+		localusers[memb->localindex] = localusers.back();
+		localusers[memb->localindex].memb->localindex = memb->localindex;
+		localusers.pop_back();
+	}
 	memb->cull();
 	delete memb;
 	userlist.erase(membiter);
+	ServerInstance->ChannelSizes.Resize(this, userlist.size() + 1);
 
 	// If this channel became empty then it should be removed
 	CheckDestroy();
@@ -428,15 +454,42 @@ bool Channel::IsBanned(User* user)
 	if (result != MOD_RES_PASSTHRU)
 		return (result == MOD_RES_DENY);
 
+	return MatchesBanList(user);
+}
+
+bool Channel::MatchesBanList(User* user)
+{
 	ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
-	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
+	const BanIndex* bans = banlm->GetIndex(this);
+	if (!bans)
+		return false;
+
+	// Bans other than extbans only depend on the user's nick, ident, host and IP, so the
+	// result is cached for members of the channel until one of those or the list changes
+	Membership* memb = GetUser(user);
+	if (memb && memb->banserial == bans->GetSerial())
+	{
+		if (memb->banned)
+			return true;
+	}
+	else
 	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); it++)
+		bool banned = bans->Matches(user);
+		if (memb)
 		{
-			if (CheckBan(user, it->mask))
-				return true;
+			memb->banserial = bans->GetSerial();
+			memb->banned = banned;
 		}
+		if (banned)
+			return true;
+	}
+
+	// Only modules can match extbans
+	const std::vector<std::string>& extbans = bans->GetExtBans();
+	for (std::vector<std::string>::const_iterator it = extbans.begin(); it != extbans.end(); ++it)
+	{
+		if (CheckBan(user, *it))
+			return true;
 	}
 	return false;
 }
@@ -476,17 +529,8 @@ ModResult Channel::GetExtBanStatus(User *user, char type)
 	if (rv != MOD_RES_PASSTHRU)
 		return rv;
 
-	ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
-	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
-
-	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); ++it)
-		{
-			if (CheckBan(user, it->mask))
-				return MOD_RES_DENY;
-		}
-	}
+	if (MatchesBanList(user))
+		return MOD_RES_DENY;
 	return MOD_RES_PASSTHRU;
 }
 
@@ -574,13 +618,10 @@ void Channel::WriteChannel(User* user, const char* text, ...)
 
 void Channel::WriteChannel(User* user, const std::string &text)
 {
-	const std::string message = ":" + user->GetFullHost() + " " + text;
+	const reference<SendBuffer> message = LocalUser::MakeLine(":" + user->GetFullHost() + " " + text);
 
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
-	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(message);
-	}
+	for (LocalMembCIter i = localusers.begin(); i != localusers.end(); ++i)
+		i->user->Write(message);
 }
 
 void Channel::WriteChannelWithServ(const std::string& ServName, const char* text, ...)
@@ -592,13 +633,10 @@ void Channel::WriteChannelWithServ(const std::string& ServName, const char* text
 
 void Channel::WriteChannelWithServ(const std::string& ServName, const std::string &text)
 {
-	const std::string message = ":" + (ServName.empty() ? ServerInstance->Config->ServerName : ServName) + " " + text;
+	const reference<SendBuffer> message = LocalUser::MakeLine(":" + (ServName.empty() ? ServerInstance->Config->ServerName : ServName) + " " + text);
 
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
-	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(message);
-	}
+	for (LocalMembCIter i = localusers.begin(); i != localusers.end(); ++i)
+		i->user->Write(message);
 }
 
 /* write formatted text from a source user to all users on a channel except
@@ -633,16 +671,17 @@ void Channel::RawWriteAllExcept(User* user, bool serversource, char status, CULi
 		if (mh)
 			minrank = mh->GetPrefixRank();
 	}
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
+
+	// Build the line once; every recipient's sendq shares the same buffer
+	const reference<SendBuffer> line = LocalUser::MakeLine(out);
+	for (LocalMembCIter i = localusers.begin(); i != localusers.end(); ++i)
 	{
-		if (IS_LOCAL(i->first) && (except_list.find(i->first) == except_list.end()))
-		{
-			/* User doesn't have the status we're after */
-			if (minrank && i->second->getRank() < minrank)
-				continue;
+		/* User doesn't have the status we're after */
+		if (i->rank < minrank)
+			continue;
 
-			i->first->Write(out);
-		}
+		if (except_list.find(i->user) == except_list.end())
+			i->user->Write(line);
 	}
 }
 
@@ -689,6 +728,30 @@ const char* Channel::ChanModes(bool showkey)
 /* compile a userlist of a channel into a string, each nick seperated by
  * spaces and op, voice etc status shown as @ and +, and send it to 'user'
  */
+/** Append an entry to a NAMES reply, sending the reply first if the entry does not fit
+ * @param user The user the reply is for
+ * @param list The reply
+ * @param pos The length of the constant part of the reply
+ * @param entry The entry to append
+ * @param len The length of the entry
+ * @param has_one Set to true if the reply contains any entries
+ */
+static void AddNamesReplyEntry(User* user, std::string& list, std::string::size_type pos, const char* entry, std::string::size_type len, bool& has_one)
+{
+	if (list.size() + len + 1 > 480)
+	{
+		/* list overflowed into multiple numerics */
+		user->WriteNumeric(RPL_NAMREPLY, list);
+
+		// Erase all nicks, keep the constant part
+		list.erase(pos);
+		has_one = false;
+	}
+
+	list.append(entry, len).push_back(' ');
+	has_one = true;
+}
+
 void Channel::UserList(User *user)
 {
 	if (this->IsModeSet('s') && !this->HasUser(user) && !user->HasPrivPermission("channels/auspex"))
@@ -711,43 +774,52 @@ void Channel::UserList(User *user)
 	 */
 	bool has_user = this->HasUser(user);
 
-	std::string prefixlist;
-	std::string nick;
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); ++i)
+	unsigned int format = 0;
+	FOREACH_MOD(I_OnNamesListFormat, OnNamesListFormat(user, this, format));
+
+	if (has_user && !(format & NAMES_FILTER))
 	{
-		if (i->first->quitting)
-			continue;
-		if ((!has_user) && (i->first->IsModeSet('i')))
+		/* Members see everyone, and no module needs to look at each entry: send the cached list */
+		const std::string& names = GetNamesList(format & (NAMES_MULTIPREFIX | NAMES_UHNAMES));
+		std::string::size_type start = 1;
+		while (start < names.length())
 		{
-			/*
-			 * user is +i, and source not on the channel, does not show
-			 * nick in NAMES list
-			 */
-			continue;
+			std::string::size_type end = names.find(' ', start);
+			if (end == std::string::npos)
+				end = names.length();
+			AddNamesReplyEntry(user, list, pos, names.data() + start, end - start, has_one);
+			start = end + 1;
 		}
+	}
+	else
+	{
+		std::string prefixlist;
+		std::string nick;
+		for (UserMembIter i = userlist.begin(); i != userlist.end(); ++i)
+		{
+			if (i->first->quitting)
+				continue;
+			if ((!has_user) && (i->first->IsModeSet('i')))
+			{
+				/*
+				 * user is +i, and source not on the channel, does not show
+				 * nick in NAMES list
+				 */
+				continue;
+			}
 
-		prefixlist = this->GetPrefixChar(i->first);
-		nick = i->first->nick;
-
-		FOREACH_MOD(I_OnNamesListItem, OnNamesListItem(user, i->second, prefixlist, nick));
+			prefixlist = (format & NAMES_MULTIPREFIX) ? this->GetAllPrefixChars(i->first) : this->GetPrefixChar(i->first);
+			nick = (format & NAMES_UHNAMES) ? i->first->GetFullHost() : i->first->nick;
 
-		/* Nick was nuked, a module wants us to skip it */
-		if (nick.empty())
-			continue;
+			FOREACH_MOD(I_OnNamesListItem, OnNamesListItem(user, i->second, prefixlist, nick));
 
-		if (list.size() + prefixlist.length() + nick.length() + 1 > 480)
-		{
-			/* list overflowed into multiple numerics */
-			user->WriteNumeric(RPL_NAMREPLY, list);
+			/* Nick was nuked, a module wants us to skip it */
+			if (nick.empty())
+				continue;
 
-			// Erase all nicks, keep the constant part
-			list.erase(pos);
-			has_one = false;
+			prefixlist.append(nick);
+			AddNamesReplyEntry(user, list, pos, prefixlist.data(), prefixlist.length(), has_one);
 		}
-
-		list.append(prefixlist).append(nick).push_back(' ');
-
-		has_one = true;
 	}
 
 	/* if whats left in the list isnt empty, send it */
@@ -759,6 +831,78 @@ void Channel::UserList(User *user)
 	user->WriteNumeric(RPL_ENDOFNAMES, "%s %s :End of /NAMES list.", user->nick.c_str(), this->name.c_str());
 }
 
+std::string Channel::GetNamesListEntry(Membership* memb, unsigned int format)
+{
+	std::string entry = (format & NAMES_MULTIPREFIX) ? GetAllPrefixChars(memb->user) : GetPrefixChar(memb->user);
+	if (format & NAMES_UHNAMES)
+		entry.append(memb->user->GetFullHost());
+	else
+		entry.append(memb->user->nick);
+	return entry;
+}
+
+const std::string& Channel::GetNamesList(unsigned int format)
+{
+	std::string& names = nameslist[format];
+	if (namesvalid & (1 << format))
+		return names;
+
+	names.clear();
+	for (UserMembIter i = userlist.begin(); i != userlist.end(); ++i)
+	{
+		if (i->first->quitting)
+			continue;
+		names.push_back(' ');
+		names.append(GetNamesListEntry(i->second, format));
+	}
+	namesvalid |= (1 << format);
+	return names;
+}
+
+void Channel::AddNamesListEntry(Membership* memb)
+{
+	// Quitting users are never in the lists
+	if (memb->user->quitting)
+		return;
+
+	for (unsigned int format = 0; namesvalid >> format; format++)
+	{
+		if (namesvalid & (1 << format))
+			nameslist[format].append(" ").append(GetNamesListEntry(memb, format));
+	}
+}
+
+void Channel::RemoveNamesListEntry(Membership* memb)
+{
+	// Taken out of the lists when they quit
+	if (memb->user->quitting)
+		return;
+
+	for (unsigned int format = 0; namesvalid >> format; format++)
+	{
+		if (!(namesvalid & (1 << format)))
+			continue;
+
+		std::string& names = nameslist[format];
+		const std::string entry = " " + GetNamesListEntry(memb, format);
+		std::string::size_type at = names.find(entry);
+		// Only a whole entry will do, not the start of a longer one
+		while (at != std::string::npos && at + entry.length() < names.length() && names[at + entry.length()] != ' ')
+			at = names.find(entry, at + 1);
+
+		if (at != std::string::npos)
+		{
+			names.erase(at, entry.length());
+		}
+		else
+		{
+			// Out of step with the member list somehow, build it again when it is next needed
+			namesvalid &= ~(1 << format);
+			names.clear();
+		}
+	}
+}
+
 /* returns the status character for a given user on a channel, e.g. @ for op,
  * % for halfop etc. If the user has several modes set, the highest mode
  * the user has must be returned.
@@ -836,7 +980,11 @@ bool Channel::SetPrefix(User* user, char prefix, bool adding)
 	UserMembIter m = userlist.find(user);
 	if (m == userlist.end())
 		return false;
-	for(unsigned int i=0; i < m->second->modes.length(); i++)
+
+	RemoveNamesListEntry(m->second);
+	bool changed = adding;
+	unsigned int i = 0;
+	for (; i < m->second->modes.length(); i++)
 	{
 		char mchar = m->second->modes[i];
 		ModeHandler* mh = ServerInstance->Modes->FindMode(mchar, MODETYPE_CHANNEL);
@@ -846,12 +994,16 @@ bool Channel::SetPrefix(User* user, char prefix, bool adding)
 				m->second->modes.substr(0,i) +
 				(adding ? std::string(1, prefix) : "") +
 				m->second->modes.substr(mchar == prefix ? i+1 : i);
-			return adding != (mchar == prefix);
+			changed = (adding != (mchar == prefix));
+			break;
 		}
 	}
-	if (adding)
+	if (adding && i == m->second->modes.length())
 		m->second->modes += std::string(1, prefix);
-	return adding;
+	if (IS_LOCAL(user))
+		localusers[m->second->localindex].rank = m->second->getRank();
+	AddNamesListEntry(m->second);
+	return changed;
 }
 
 void Invitation::Create(Channel* c, LocalUser* u, time_t timeout)
@@ -0,0 +1,96 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2014 InspIRCd Development Team
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+void ConnectClassIndex::Build(const ClassVector& classes)
+{
+	hosts.clear();
+	ranges.clear();
+	prefixlens.clear();
+	wildcards.clear();
+
+	for (size_t i = 0; i < classes.size(); ++i)
+	{
+		ConnectClass* c = classes[i];
+		if (c->type == CC_NAMED)
+			continue;
+
+		const std::string& mask = c->host;
+		if (mask.find_first_of("*?@") != std::string::npos)
+		{
+			wildcards.push_back(i);
+			continue;
+		}
+
+		std::string::size_type slash = mask.rfind('/');
+		if (slash == std::string::npos)
+		{
+			hosts.insert(std::make_pair(mask, i));
+			continue;
+		}
+
+		// A range is matched against the IP only; anything else with a '/' in it is left to MatchCIDR()
+		irc::sockets::sockaddrs sa;
+		if (!irc::sockets::aptosa(mask.substr(0, slash), 0, sa))
+		{
+			wildcards.push_back(i);
+			continue;
+		}
+
+		irc::sockets::cidr_mask range(mask);
+		ranges.insert(std::make_pair(range, i));
+		prefixlens[std::make_pair(range.type, range.length)]++;
+	}
+}
+
+void ConnectClassIndex::FindHost(const std::string& host, std::vector<size_t>& out) const
+{
+	std::pair<HostMap::const_iterator, HostMap::const_iterator> matches = hosts.equal_range(host);
+	for (HostMap::const_iterator i = matches.first; i != matches.second; ++i)
+		out.push_back(i->second);
+}
+
+void ConnectClassIndex::Find(LocalUser* user, std::vector<size_t>& out) const
+{
+	out.assign(wildcards.begin(), wildcards.end());
+
+	if (!hosts.empty())
+	{
+		const std::string& ip = user->GetIPString();
+		FindHost(ip, out);
+		if (user->host != ip)
+			FindHost(user->host, out);
+	}
+
+	// Look up the user's address masked to each prefix length that has a range set on it
+	for (std::map<std::pair<int, int>, unsigned int>::const_iterator len = prefixlens.begin(); len != prefixlens.end(); ++len)
+	{
+		if (len->first.first != user->client_sa.sa.sa_family)
+			continue;
+
+		irc::sockets::cidr_mask range(user->client_sa, len->first.second);
+		std::pair<RangeMap::const_iterator, RangeMap::const_iterator> matches = ranges.equal_range(range);
+		for (RangeMap::const_iterator i = matches.first; i != matches.second; ++i)
+			out.push_back(i->second);
+	}
+
+	// The first class that matches wins, so the caller needs these in the order of the config
+	std::sort(out.begin(), out.end());
+}
@@ -142,9 +142,14 @@ class Packet : public Query
 		record.ttl = (input[pos] << 24) | (input[pos + 1] << 16) | (input[pos + 2] << 8) | input[pos + 3];
 		pos += 4;
 
-		//record.rdlength = input[pos] << 8 | input[pos + 1];
+		unsigned short rdlength = input[pos] << 8 | input[pos + 1];
 		pos += 2;
 
+		if (pos + rdlength > input_size)
+			throw Exception("Unable to unpack resource record");
+		/* Records of types we do not know are skipped over instead of being parsed */
+		unsigned short rdata_end = pos + rdlength;
+
 		switch (record.type)
 		{
 			case QUERY_A:
@@ -185,10 +190,28 @@ class Packet : public Query
 				record.rdata = this->UnpackName(input, input_size, pos);
 				break;
 			}
+			case QUERY_SOA:
+			{
+				/* The primary nameserver, then the mailbox of the zone's admin */
+				record.rdata = this->UnpackName(input, input_size, pos);
+				this->UnpackName(input, input_size, pos);
+
+				/* Serial, refresh, retry and expire come before the minimum */
+				if (pos + 20 > input_size)
+					throw Exception("Unable to unpack resource record");
+				pos += 16;
+
+				/* RFC 2308: a negative answer may be cached for the lower of the SOA's TTL and its minimum field */
+				unsigned int minimum = (input[pos] << 24) | (input[pos + 1] << 16) | (input[pos + 2] << 8) | input[pos + 3];
+				record.ttl = std::min(record.ttl, minimum);
+				break;
+			}
 			default:
 				break;
 		}
 
+		pos = rdata_end;
+
 		if (!record.name.empty() && !record.rdata.empty())
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: " + record.name + " -> " + record.rdata);
 
@@ -204,8 +227,10 @@ class Packet : public Query
 	unsigned short id;
 	/* Flags on the packet */
 	unsigned short flags;
+	/* TTL of the SOA record in the authority section, if there is one */
+	unsigned int negative_ttl;
 
-	Packet() : id(0), flags(0)
+	Packet() : id(0), flags(0), negative_ttl(0)
 	{
 	}
 
@@ -244,6 +269,26 @@ class Packet : public Query
 
 		for (unsigned i = 0; i < ancount; ++i)
 			this->answers.push_back(this->UnpackResourceRecord(input, len, packet_pos));
+
+		/* The authority section is only needed for the SOA record that comes with a negative
+		 * answer, so a packet with a broken authority section is still usable.
+		 */
+		try
+		{
+			for (unsigned i = 0; i < nscount; ++i)
+			{
+				ResourceRecord rr = this->UnpackResourceRecord(input, len, packet_pos);
+				if (rr.type == QUERY_SOA)
+				{
+					this->negative_ttl = rr.ttl;
+					break;
+				}
+			}
+		}
+		catch (Exception& ex)
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, std::string("Resolver: Ignoring authority section: ") + ex.GetReason());
+		}
 	}
 
 	unsigned short Pack(unsigned char* output, unsigned short output_size)
@@ -396,15 +441,48 @@ class Packet : public Query
 
 class MyManager : public Manager, public Timer, public EventHandler
 {
-	typedef TR1NS::unordered_map<Question, Query, Question::hash> cache_map;
+	/** A cached answer. Negative answers are cached too, with their error and no records.
+	 */
+	struct CacheEntry
+	{
+		Query query;
+		/* When the answer is no longer valid */
+		time_t expires;
+		/* Roughly how much memory the entry takes up */
+		size_t size;
+		/* Position in the LRU list */
+		std::list<const Question*>::iterator lru;
+	};
+
+	typedef TR1NS::unordered_map<Question, CacheEntry, Question::hash> cache_map;
 	cache_map cache;
 
+	/** Keys of the cache, most recently used first. These point at the keys stored
+	 * in the map, which stay where they are for as long as the entry exists.
+	 */
+	std::list<const Question*> lru;
+
+	/** Memory used by all entries in the cache */
+	size_t cachebytes;
+
 	irc::sockets::sockaddrs myserver;
 
-	static bool IsExpired(const Query& record, time_t now = ServerInstance->Time())
+	static size_t EstimateSize(const Question& question, const Query& r)
 	{
-		const ResourceRecord& req = record.answers[0];
-		return (req.created + static_cast<time_t>(req.ttl) < now);
+		/* The entry and its key, the LRU list node, and the strings they own */
+		size_t size = sizeof(cache_map::value_type) + sizeof(void*) * 4 + question.name.length();
+		for (std::vector<Question>::const_iterator i = r.questions.begin(); i != r.questions.end(); ++i)
+			size += sizeof(Question) + i->name.length();
+		for (std::vector<ResourceRecord>::const_iterator i = r.answers.begin(); i != r.answers.end(); ++i)
+			size += sizeof(ResourceRecord) + i->name.length() + i->rdata.length();
+		return size;
+	}
+
+	void RemoveCache(cache_map::iterator it)
+	{
+		this->cachebytes -= it->second.size;
+		this->lru.erase(it->second.lru);
+		this->cache.erase(it);
 	}
 
 	/** Check the DNS cache to see if request can be handled by a cached result
@@ -418,33 +496,243 @@ class MyManager : public Manager, public Timer, public EventHandler
 		if (it == this->cache.end())
 			return false;
 
-		Query& record = it->second;
-		if (IsExpired(record))
+		CacheEntry& entry = it->second;
+		if (entry.expires < ServerInstance->Time())
 		{
-			this->cache.erase(it);
+			this->RemoveCache(it);
 			return false;
 		}
 
-		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: Using cached result for " + question.name);
+		this->lru.splice(this->lru.begin(), this->lru, entry.lru);
+
+		Query& record = entry.query;
 		record.cached = true;
-		req->OnLookupComplete(&record);
+		if (record.error != ERROR_NONE)
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: Using cached negative result for " + question.name);
+			req->OnError(&record);
+		}
+		else
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: Using cached result for " + question.name);
+			req->OnLookupComplete(&record);
+		}
 		return true;
 	}
 
-	/** Add a record to the dns cache
+	/** Add a record to the dns cache, evicting the least recently used entries if it is full
 	 * @param r The record
+	 * @param expires When the record expires
 	 */
-	void AddCache(Query& r)
+	void AddCache(const Query& r, time_t expires)
+	{
+		const Question& question = r.questions[0];
+		size_t size = EstimateSize(question, r);
+		if (size > this->maxcachebytes)
+			return;
+
+		cache_map::iterator it = this->cache.find(question);
+		if (it != this->cache.end())
+			this->RemoveCache(it);
+
+		while (!this->lru.empty() && this->cachebytes + size > this->maxcachebytes)
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: cache is full, evicting " + this->lru.back()->name);
+			this->RemoveCache(this->cache.find(*this->lru.back()));
+		}
+
+		it = this->cache.insert(std::make_pair(question, CacheEntry())).first;
+		CacheEntry& entry = it->second;
+		entry.query = r;
+		entry.query.cached = false;
+		entry.expires = expires;
+		entry.size = size;
+		entry.lru = this->lru.insert(this->lru.begin(), &it->first);
+		this->cachebytes += size;
+	}
+
+	/** Cache a successful answer, for as long as the TTL of its first record
+	 * @param r The record
+	 */
+	void AddCache(const Query& r)
 	{
 		const ResourceRecord& rr = r.answers[0];
+		if (!rr.ttl)
+			return;
+
 		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: added cache for " + rr.name + " -> " + rr.rdata + " ttl: " + ConvToStr(rr.ttl));
-		this->cache[r.questions[0]] = r;
+		this->AddCache(r, rr.created + rr.ttl);
+	}
+
+	/** Cache a negative answer. Without an SOA record in the answer there is no
+	 * TTL to go by, so it is not cached (RFC 2308 section 5).
+	 * @param r The record, with its error set
+	 * @param ttl TTL of the SOA record that came with the answer
+	 */
+	void AddNegativeCache(const Query& r, unsigned int ttl)
+	{
+		ttl = std::min(ttl, this->maxnegativettl);
+		if (!ttl || r.questions.empty())
+			return;
+
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: added negative cache for " + r.questions[0].name + " ttl: " + ConvToStr(ttl));
+		this->AddCache(r, ServerInstance->Time() + ttl);
+	}
+
+	/** Remove expired entries from the cache */
+	void PurgeCache(time_t now)
+	{
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: purging DNS cache");
+
+		for (cache_map::iterator it = this->cache.begin(); it != this->cache.end(); )
+		{
+			if (it->second.expires < now)
+				this->RemoveCache(it++);
+			else
+				++it;
+		}
+	}
+
+	/** Check that a name or rdata can be stored as one token of a cache file line.
+	 * Answers come from the network, so anything holding whitespace or control
+	 * characters could forge extra fields or lines and is never written or read.
+	 */
+	static bool IsCacheToken(const std::string& token)
+	{
+		if (token.empty())
+			return false;
+
+		for (std::string::const_iterator i = token.begin(); i != token.end(); ++i)
+		{
+			unsigned char c = *i;
+			if (c <= ' ' || c == 0x7F)
+				return false;
+		}
+		return true;
+	}
+
+	/** Load the cache saved by WriteCache(), skipping entries that have expired since.
+	 * Each line is: expires error qtype qclass qname, followed by the type, name
+	 * and rdata of each record.
+	 */
+	void ReadCache()
+	{
+		std::ifstream stream(this->cachefile.c_str());
+		if (!stream.is_open())
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: unable to open %s: %s", this->cachefile.c_str(), strerror(errno));
+			return;
+		}
+
+		time_t now = ServerInstance->Time();
+		unsigned int count = 0;
+		std::string line;
+		while (std::getline(stream, line))
+		{
+			irc::spacesepstream tokens(line);
+			std::string expires, error, qtype, qclass, qname;
+			if (!tokens.GetToken(expires) || !tokens.GetToken(error) || !tokens.GetToken(qtype) || !tokens.GetToken(qclass) || !tokens.GetToken(qname))
+				continue;
+
+			Query r(Question(qname, static_cast<QueryType>(ConvToInt(qtype)), ConvToInt(qclass)));
+			r.error = static_cast<Error>(ConvToInt(error));
+			time_t expiry = ConvToInt(expires);
+			if (expiry < now || r.error > ERROR_INVALIDTYPE || !IsCacheToken(qname))
+				continue;
+
+			bool valid = true;
+			std::string type, rrname, rdata;
+			while (tokens.GetToken(type) && tokens.GetToken(rrname) && tokens.GetToken(rdata))
+			{
+				if (!IsCacheToken(rrname) || !IsCacheToken(rdata))
+				{
+					valid = false;
+					break;
+				}
+
+				ResourceRecord rr(rrname, static_cast<QueryType>(ConvToInt(type)));
+				rr.ttl = expiry - now;
+				rr.rdata = rdata;
+				r.answers.push_back(rr);
+			}
+
+			if (!valid || (r.error == ERROR_NONE && r.answers.empty()))
+				continue;
+
+			this->AddCache(r, expiry);
+			count++;
+		}
+
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEFAULT, "Resolver: cache: loaded %u entries from %s", count, this->cachefile.c_str());
+	}
+
+	/** Save the cache to disk, least recently used entries first so that ReadCache()
+	 * puts them back in the same order. Like m_xline_db, this writes a new file and
+	 * renames it over the old one.
+	 */
+	void WriteCache()
+	{
+		if (this->cachefile.empty())
+			return;
+
+		std::string newfile = this->cachefile + ".new";
+		FILE* f = fopen(newfile.c_str(), "w");
+		if (!f)
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEFAULT, "Resolver: cache: unable to create %s: %s", newfile.c_str(), strerror(errno));
+			return;
+		}
+
+		for (std::list<const Question*>::reverse_iterator i = this->lru.rbegin(); i != this->lru.rend(); ++i)
+		{
+			const Question& question = **i;
+			const CacheEntry& entry = this->cache.find(question)->second;
+
+			std::string line = ConvToStr(entry.expires) + " " + ConvToStr(entry.query.error) + " " + ConvToStr(question.type) + " " + ConvToStr(question.qclass) + " " + question.name;
+			bool complete = IsCacheToken(question.name);
+			for (std::vector<ResourceRecord>::const_iterator rr = entry.query.answers.begin(); rr != entry.query.answers.end(); ++rr)
+			{
+				/* Records without rdata, or with names or rdata that would split the line,
+				 * can not be written in this format, so the whole answer is left out
+				 */
+				if (!IsCacheToken(rr->name) || !IsCacheToken(rr->rdata))
+				{
+					complete = false;
+					break;
+				}
+				line += " " + ConvToStr(rr->type) + " " + rr->name + " " + rr->rdata;
+			}
+
+			if (complete)
+				fprintf(f, "%s\n", line.c_str());
+		}
+
+		int write_error = ferror(f);
+		write_error |= fclose(f);
+		if (write_error)
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEFAULT, "Resolver: cache: unable to write %s: %s", newfile.c_str(), strerror(errno));
+			return;
+		}
+
+#ifdef _WIN32
+		remove(this->cachefile.c_str());
+#endif
+		if (rename(newfile.c_str(), this->cachefile.c_str()) < 0)
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEFAULT, "Resolver: cache: unable to replace %s: %s", this->cachefile.c_str(), strerror(errno));
 	}
 
  public:
 	DNS::Request* requests[MAX_REQUEST_ID];
 
-	MyManager(Module* c) : Manager(c), Timer(3600, ServerInstance->Time(), true)
+	/* Memory the cache may use, from <dns:cachesize> */
+	size_t maxcachebytes;
+	/* Longest time a negative answer is cached for, from <dns:maxnegativettl> */
+	unsigned int maxnegativettl;
+	/* Where the cache is saved, from <dns:cachefile>; empty if it is not */
+	std::string cachefile;
+
+	MyManager(Module* c) : Manager(c), Timer(3600, ServerInstance->Time(), true), cachebytes(0), maxcachebytes(0), maxnegativettl(0)
 	{
 		for (int i = 0; i < MAX_REQUEST_ID; ++i)
 			requests[i] = NULL;
@@ -453,6 +741,8 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 	~MyManager()
 	{
+		this->WriteCache();
+
 		for (int i = 0; i < MAX_REQUEST_ID; ++i)
 		{
 			DNS::Request* request = requests[i];
@@ -640,6 +930,8 @@ class MyManager : public Manager, public Timer, public EventHandler
 			ServerInstance->stats->statsDnsBad++;
 			recv_packet.error = error;
 			request->OnError(&recv_packet);
+			if (error == ERROR_DOMAIN_NOT_FOUND)
+				this->AddNegativeCache(recv_packet, recv_packet.negative_ttl);
 		}
 		else if (recv_packet.questions.empty() || recv_packet.answers.empty())
 		{
@@ -647,6 +939,7 @@ class MyManager : public Manager, public Timer, public EventHandler
 			ServerInstance->stats->statsDnsBad++;
 			recv_packet.error = ERROR_NO_RECORDS;
 			request->OnError(&recv_packet);
+			this->AddNegativeCache(recv_packet, recv_packet.negative_ttl);
 		}
 		else
 		{
@@ -664,17 +957,41 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 	bool Tick(time_t now)
 	{
-		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: purging DNS cache");
+		this->PurgeCache(now);
+		this->WriteCache();
+		return true;
+	}
 
-		for (cache_map::iterator it = this->cache.begin(); it != this->cache.end(); )
+	/** Apply the cache settings from <dns>
+	 * @param maxbytes Memory the cache may use; 0 disables the cache
+	 * @param maxnegttl Longest time a negative answer is cached for; 0 disables negative caching
+	 * @param file Where to save the cache; empty to not save it. If this changes, the cache is loaded from it.
+	 */
+	void SetCacheOptions(size_t maxbytes, unsigned int maxnegttl, const std::string& file)
+	{
+		this->maxcachebytes = maxbytes;
+		this->maxnegativettl = maxnegttl;
+
+		while (this->cachebytes > this->maxcachebytes)
+			this->RemoveCache(this->cache.find(*this->lru.back()));
+
+		if (!maxnegttl)
 		{
-			const Query& query = it->second;
-			if (IsExpired(query, now))
-				this->cache.erase(it++);
-			else
-				++it;
+			for (cache_map::iterator it = this->cache.begin(); it != this->cache.end(); )
+			{
+				if (it->second.query.error != ERROR_NONE)
+					this->RemoveCache(it++);
+				else
+					++it;
+			}
+		}
+
+		if (file != this->cachefile)
+		{
+			this->cachefile = file;
+			if (!file.empty())
+				this->ReadCache();
 		}
-		return true;
 	}
 
 	void Rehash(const std::string& dnsserver)
@@ -687,7 +1004,7 @@ class MyManager : public Manager, public Timer, public EventHandler
 			this->SetFd(-1);
 
 			/* Remove expired entries from the cache */
-			this->Tick(ServerInstance->Time());
+			this->PurgeCache(ServerInstance->Time());
 		}
 
 		irc::sockets::aptosa(dnsserver, DNS::PORT, myserver);
@@ -814,6 +1131,14 @@ class ModuleDNS : public Module
 
 		if (oldserver != DNSServer)
 			this->manager.Rehash(DNSServer);
+
+		ConfigTag* tag = ServerInstance->Config->ConfValue("dns");
+		std::string cachefile = tag->getString("cachefile");
+		if (!cachefile.empty() && cachefile[0] != '/')
+			cachefile = DATA_PATH "/" + cachefile;
+		long cachesize = tag->getInt("cachesize", 1024 * 1024);
+		long maxnegativettl = tag->getInt("maxnegativettl", 3600);
+		this->manager.SetCacheOptions(std::max(cachesize, 0L), std::max(maxnegativettl, 0L), cachefile);
 	}
 
 	void OnUnloadModule(Module* mod)
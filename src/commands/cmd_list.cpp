@@ -20,6 +20,13 @@
 
 #include "inspircd.h"
 
+/** A /LIST that is being sent a part at a time, see CommandList::Send() */
+struct ListState
+{
+	/** Names of the channels left to send, from the last one to the next one */
+	std::vector<std::string> channels;
+};
+
 /** Handle /LIST. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
  * the same way, however, they can be fully unloaded, where these
@@ -27,10 +34,19 @@
  */
 class CommandList : public Command
 {
+	/** Send the entry of a channel
+	 * @param user The user running the LIST
+	 * @param chan The channel
+	 */
+	void SendChannel(User* user, Channel* chan);
+
  public:
+	/** The lists that are not finished yet */
+	SimpleExtItem<ListState> liststate;
+
 	/** Constructor for list.
 	 */
-	CommandList ( Module* parent) : Command(parent,"LIST", 0, 0) { Penalty = 5; }
+	CommandList(Module* parent) : Command(parent,"LIST", 0, 0), liststate("list_state", parent) { Penalty = 5; }
 	/** Handle command.
 	 * @param parameters The parameters to the comamnd
 	 * @param pcnt The number of parameters passed to teh command
@@ -38,68 +54,160 @@ class CommandList : public Command
 	 * @return A value from CmdResult to indicate command success or failure.
 	 */
 	CmdResult Handle(const std::vector<std::string>& parameters, User *user);
+
+	/** Send the next part of a list, until the user's sendq reaches half the hard limit of its class
+	 * or LIST_WATERMARK, whichever is lower. If the list is not finished, the rest is sent from
+	 * OnBufferFlushed() once the client has read enough of it.
+	 * @param user The user running the LIST
+	 * @param state The list
+	 */
+	void Send(User* user, ListState* state);
 };
 
+/** The most a list may add to the sendq of a user before the client has to read some of it */
+static const unsigned long LIST_WATERMARK = 65536;
 
-/** Handle /LIST
- */
-CmdResult CommandList::Handle (const std::vector<std::string>& parameters, User *user)
+void CommandList::SendChannel(User* user, Channel* chan)
 {
-	int minusers = 0, maxusers = 0;
+	long users = chan->GetUserCounter();
 
-	user->WriteNumeric(321, "%s Channel :Users Name",user->nick.c_str());
+	// if the channel is not private/secret, OR the user is on the channel anyway
+	bool n = (chan->HasUser(user) || user->HasPrivPermission("channels/auspex"));
 
-	/* Work around mIRC suckyness. YOU SUCK, KHALED! */
-	if (parameters.size() == 1)
+	if (!n && chan->IsModeSet('p'))
+	{
+		/* Channel is +p and user is outside/not privileged */
+		user->WriteNumeric(322, "%s * %ld :",user->nick.c_str(), users);
+	}
+	else
 	{
-		if (parameters[0][0] == '<')
+		if (n || !chan->IsModeSet('s'))
 		{
-			maxusers = atoi((parameters[0].c_str())+1);
+			/* User is in the channel/privileged, channel is not +s */
+			user->WriteNumeric(322, "%s %s %ld :[+%s] %s",user->nick.c_str(),chan->name.c_str(),users,chan->ChanModes(n),chan->topic.c_str());
 		}
-		else if (parameters[0][0] == '>')
+	}
+}
+
+void CommandList::Send(User* user, ListState* state)
+{
+	LocalUser* luser = IS_LOCAL(user);
+	unsigned long watermark = luser ? std::min(LIST_WATERMARK, luser->GetClass()->GetSendqHardMax() / 2) : 0;
+
+	while (!state->channels.empty())
+	{
+		if (luser && luser->eh.getSendQSize() >= watermark)
 		{
-			minusers = atoi((parameters[0].c_str())+1);
+			// Carry on when the client has read some of it
+			luser->eh.flushwatermark = watermark / 2;
+			return;
 		}
+
+		// Channels that were deleted since the LIST started are skipped
+		Channel* chan = ServerInstance->FindChan(state->channels.back());
+		state->channels.pop_back();
+		if (chan)
+			SendChannel(user, chan);
 	}
 
-	for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); i++)
-	{
-		// attempt to match a glob pattern
-		long users = i->second->GetUserCounter();
+	user->WriteNumeric(323, "%s :End of channel list.",user->nick.c_str());
+	liststate.unset(user);
+}
 
-		bool too_few = (minusers && (users <= minusers));
-		bool too_many = (maxusers && (users >= maxusers));
+/** Handle /LIST
+ */
+CmdResult CommandList::Handle (const std::vector<std::string>& parameters, User *user)
+{
+	size_t minusers = 0, maxusers = (size_t)-1;
+	std::vector<std::string> masks;
 
-		if (too_many || too_few)
-			continue;
+	user->WriteNumeric(321, "%s Channel :Users Name",user->nick.c_str());
 
-		if (parameters.size() && !parameters[0].empty() && (parameters[0][0] != '<' && parameters[0][0] != '>'))
+	/* Work around mIRC suckyness. YOU SUCK, KHALED! */
+	if (!parameters.empty())
+	{
+		// ELIST=MU: a comma separated list of masks and user count conditions
+		irc::commasepstream conditions(parameters[0]);
+		std::string condition;
+		while (conditions.GetToken(condition))
 		{
-			if (!InspIRCd::Match(i->second->name, parameters[0]) && !InspIRCd::Match(i->second->topic, parameters[0]))
+			if (condition.empty())
 				continue;
+			if (condition[0] == '<')
+			{
+				long n = atol(condition.c_str() + 1);
+				if (n > 0)
+					maxusers = std::min(maxusers, (size_t)n - 1);
+			}
+			else if (condition[0] == '>')
+			{
+				long n = atol(condition.c_str() + 1);
+				if (n > 0)
+					minusers = std::max(minusers, (size_t)n + 1);
+			}
+			else
+				masks.push_back(condition);
 		}
+	}
 
-		// if the channel is not private/secret, OR the user is on the channel anyway
-		bool n = (i->second->HasUser(user) || user->HasPrivPermission("channels/auspex"));
+	// The channels that fail the user count conditions are never looked at
+	std::vector<Channel*> channels;
+	ServerInstance->ChannelSizes.Find(minusers, maxusers, channels);
 
-		if (!n && i->second->IsModeSet('p'))
-		{
-			/* Channel is +p and user is outside/not privileged */
-			user->WriteNumeric(322, "%s * %ld :",user->nick.c_str(), users);
-		}
-		else
+	ListState* state = new ListState;
+	state->channels.reserve(channels.size());
+	for (std::vector<Channel*>::const_reverse_iterator i = channels.rbegin(); i != channels.rend(); ++i)
+	{
+		Channel* chan = *i;
+
+		// attempt to match a glob pattern
+		if (!masks.empty())
 		{
-			if (n || !i->second->IsModeSet('s'))
-			{
-				/* User is in the channel/privileged, channel is not +s */
-				user->WriteNumeric(322, "%s %s %ld :[+%s] %s",user->nick.c_str(),i->second->name.c_str(),users,i->second->ChanModes(n),i->second->topic.c_str());
-			}
+			bool matched = false;
+			for (std::vector<std::string>::const_iterator mask = masks.begin(); mask != masks.end() && !matched; ++mask)
+				matched = (InspIRCd::Match(chan->name, *mask) || InspIRCd::Match(chan->topic, *mask));
+			if (!matched)
+				continue;
 		}
+
+		state->channels.push_back(chan->name);
 	}
-	user->WriteNumeric(323, "%s :End of channel list.",user->nick.c_str());
+
+	// A new LIST replaces one that is still being sent
+	liststate.set(user, state);
+	Send(user, state);
 
 	return CMD_SUCCESS;
 }
 
+class ModuleList : public Module
+{
+	CommandList cmd;
+
+ public:
+	ModuleList() : cmd(this)
+	{
+	}
+
+	void init()
+	{
+		ServerInstance->Modules->AddService(cmd);
+		ServerInstance->Modules->AddService(cmd.liststate);
+		Implementation events[] = { I_OnBufferFlushed };
+		ServerInstance->Modules->Attach(events, this, sizeof(events)/sizeof(Implementation));
+	}
+
+	void OnBufferFlushed(LocalUser* user)
+	{
+		ListState* state = cmd.liststate.get(user);
+		if (state)
+			cmd.Send(user, state);
+	}
+
+	Version GetVersion()
+	{
+		return Version("LIST", VF_VENDOR | VF_CORE);
+	}
+};
 
-COMMAND_INIT(CommandList)
+MODULE_INIT(ModuleList)
@@ -68,6 +68,13 @@ CmdResult CommandRehash::Handle (const std::vector<std::string>& parameters, Use
 		if (param[0] == '-')
 			param = param.substr(1);
 
+		// hook profiles are kept by the core, so reset them here instead of in a module
+		if (param == "hookstats")
+		{
+			ServerInstance->Modules->ResetHookProfiles();
+			ServerInstance->SNO->WriteGlobalSno('a', "%s reset the module hook profiles on %s", user->nick.c_str(), ServerInstance->Config->ServerName.c_str());
+		}
+
 		FOREACH_MOD(I_OnModuleRehash,OnModuleRehash(user, param));
 		return CMD_SUCCESS;
 	}
@@ -210,6 +210,30 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 			}
 		break;
 
+		/* stats M (time spent in each module hook, see <performance:hookprofiling>) */
+		case 'M':
+		{
+			if (!ServerInstance->Modules->ProfileHooks)
+				results.push_back(sn+" 249 "+user->nick+" :Hook profiling is disabled, set <performance:hookprofiling> to enable it");
+			results.push_back(sn+" 249 "+user->nick+" :module hook calls total_usecs max_usecs");
+
+			const std::vector<std::string> modules = ServerInstance->Modules->GetAllModuleNames(0);
+			for (std::vector<std::string>::const_iterator i = modules.begin(); i != modules.end(); ++i)
+			{
+				Module* mod = ServerInstance->Modules->Find(*i);
+				for (int hook = I_BEGIN + 1; hook != I_END; hook++)
+				{
+					const HookProfile& prof = mod->profile[hook];
+					if (!prof.calls)
+						continue;
+
+					results.push_back(sn+" 249 "+user->nick+" :"+*i+" "+ModuleManager::GetHookName((Implementation)hook)+" "+ConvToStr(prof.calls)+" "+
+						ConvToStr(prof.total / 1000)+" "+ConvToStr(prof.max / 1000));
+				}
+			}
+		}
+		break;
+
 		/* stats z (debug and memory info) */
 		case 'z':
 		{
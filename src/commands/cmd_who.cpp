@@ -39,12 +39,25 @@ class CommandWho : public Command
 	bool opt_local;
 	bool opt_far;
 	bool opt_time;
+	bool opt_unlimit;
+
+	/** Set if the mask is a CIDR range and opt_showrealhost is set, in which case it is matched against IPs */
+	bool cidr;
+	irc::sockets::cidr_mask cidrmask;
+
+	/** Find the users that may match a mask using the UserIndex, instead of looking at every user
+	 * @param user The user running the WHO
+	 * @param matchtext The mask
+	 * @param out Set to the users that may match; whomatch() still has to be called on them
+	 * @return False if the mask or the flags can not be looked up in the index
+	 */
+	bool FindCandidates(User* user, const std::string& matchtext, std::vector<User*>& out);
 
  public:
 	/** Constructor for who.
 	 */
 	CommandWho ( Module* parent) : Command(parent,"WHO", 1) {
-		syntax = "<server>|<nickname>|<channel>|<realname>|<host>|0 [ohurmMiaplf]";
+		syntax = "<server>|<nickname>|<channel>|<realname>|<host>|0 [ohurmMiaplft]";
 	}
 	void SendWhoLine(User* user, const std::vector<std::string>& parms, const std::string &initial, Channel* ch, User* u, std::vector<std::string> &whoresults);
 	/** Handle command.
@@ -120,7 +133,7 @@ bool CommandWho::whomatch(User* cuser, User* user, const char* matchtext)
 		else if (opt_realname)
 			match = InspIRCd::Match(user->fullname, matchtext);
 		else if (opt_showrealhost)
-			match = InspIRCd::Match(user->host, matchtext, ascii_case_insensitive_map);
+			match = (InspIRCd::Match(user->host, matchtext, ascii_case_insensitive_map) || (cidr && cidrmask.match(user->client_sa)));
 		else if (opt_ident)
 			match = InspIRCd::Match(user->ident, matchtext, ascii_case_insensitive_map);
 		else if (opt_port)
@@ -166,6 +179,35 @@ bool CommandWho::whomatch(User* cuser, User* user, const char* matchtext)
 	}
 }
 
+bool CommandWho::FindCandidates(User* user, const std::string& matchtext, std::vector<User*>& out)
+{
+	// Only the nick, the hosts and the server are matched without these flags
+	if (opt_mode || opt_metadata || opt_realname || opt_ident || opt_port || opt_away || opt_time)
+		return false;
+
+	// A mask that matches any server matches all of its users
+	if (ServerInstance->Config->HideWhoisServer.empty() || user->HasPrivPermission("users/auspex"))
+	{
+		const std::map<std::string, unsigned int>& servers = ServerInstance->Users->Index.GetServers();
+		for (std::map<std::string, unsigned int>::const_iterator i = servers.begin(); i != servers.end(); ++i)
+			if (InspIRCd::Match(i->first, matchtext))
+				return false;
+	}
+
+	UserIndex& index = ServerInstance->Users->Index;
+	if (!index.FindNick(matchtext, out) || !index.FindDisplayedHost(matchtext, out) || (opt_showrealhost && !index.FindHost(matchtext, out)))
+	{
+		out.clear();
+		return false;
+	}
+	if (cidr)
+		index.FindIP(cidrmask, out);
+
+	std::sort(out.begin(), out.end());
+	out.erase(std::unique(out.begin(), out.end()), out.end());
+	return true;
+}
+
 bool CommandWho::CanView(Channel* chan, User* user)
 {
 	if (!user || !chan)
@@ -248,6 +290,8 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 	opt_local = false;
 	opt_far = false;
 	opt_time = false;
+	opt_unlimit = false;
+	cidr = false;
 
 	std::vector<std::string> whoresults;
 	std::string initial = "352 " + user->nick + " ";
@@ -303,10 +347,28 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 				case 't':
 					opt_time = true;
 					break;
+				case 'u':
+					if (user->HasPrivPermission("users/auspex"))
+						opt_unlimit = true;
+					break;
 			}
 		}
 	}
 
+	if (opt_showrealhost)
+	{
+		std::string::size_type slash = matchtext.find('/');
+		irc::sockets::sockaddrs sa;
+		if (slash != std::string::npos && irc::sockets::aptosa(matchtext.substr(0, slash), 0, sa))
+		{
+			cidr = true;
+			cidrmask = irc::sockets::cidr_mask(matchtext);
+		}
+	}
+
+	// The results past the limit are not even formatted
+	size_t maxresults = (opt_unlimit ? (size_t)-1 : ServerInstance->Config->MaxWho);
+
 
 	/* who on a channel? */
 	Channel* ch = ServerInstance->FindChan(matchtext);
@@ -320,7 +382,7 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 			/* who on a channel. */
 			const UserMembList *cu = ch->GetUsers();
 
-			for (UserMembCIter i = cu->begin(); i != cu->end(); i++)
+			for (UserMembCIter i = cu->begin(); i != cu->end() && whoresults.size() < maxresults; i++)
 			{
 				/* None of this applies if we WHO ourselves */
 				if (user != i->first)
@@ -344,7 +406,7 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 		if (opt_viewopersonly)
 		{
 			/* Showing only opers */
-			for (std::list<User*>::iterator i = ServerInstance->Users->all_opers.begin(); i != ServerInstance->Users->all_opers.end(); i++)
+			for (std::list<User*>::iterator i = ServerInstance->Users->all_opers.begin(); i != ServerInstance->Users->all_opers.end() && whoresults.size() < maxresults; i++)
 			{
 				User* oper = *i;
 
@@ -362,17 +424,26 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 		}
 		else
 		{
-			for (user_hash::iterator i = ServerInstance->Users->clientlist->begin(); i != ServerInstance->Users->clientlist->end(); i++)
+			std::vector<User*> candidates;
+			if (!FindCandidates(user, matchtext, candidates))
+			{
+				candidates.reserve(ServerInstance->Users->clientlist->size());
+				for (user_hash::iterator i = ServerInstance->Users->clientlist->begin(); i != ServerInstance->Users->clientlist->end(); i++)
+					candidates.push_back(i->second);
+			}
+
+			for (std::vector<User*>::const_iterator i = candidates.begin(); i != candidates.end() && whoresults.size() < maxresults; ++i)
 			{
-				if (whomatch(user, i->second, matchtext.c_str()))
+				User* u = *i;
+				if (whomatch(user, u, matchtext.c_str()))
 				{
-					if (!user->SharesChannelWith(i->second))
+					if (!user->SharesChannelWith(u))
 					{
-						if (usingwildcards && (i->second->IsModeSet('i')) && (!user->HasPrivPermission("users/auspex")))
+						if (usingwildcards && (u->IsModeSet('i')) && (!user->HasPrivPermission("users/auspex")))
 							continue;
 					}
 
-					SendWhoLine(user, parameters, initial, NULL, i->second, whoresults);
+					SendWhoLine(user, parameters, initial, NULL, u, whoresults);
 				}
 			}
 		}
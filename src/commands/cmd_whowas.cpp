@@ -23,8 +23,15 @@
 #include "inspircd.h"
 #include "commands/cmd_whowas.h"
 
+/** Size of the blocks of the WHOWAS arena; an entry bigger than this gets a block of its own */
+static const size_t WHOWAS_BLOCK_SIZE = 16 * 1024;
+
+/** Memory used by a node of the whowas map, not counting the nick */
+static const size_t WHOWAS_NODE_SIZE = sizeof(whowas_users::value_type) + 4 * sizeof(void*);
+
 CommandWhowas::CommandWhowas( Module* parent)
-	: Command(parent, "WHOWAS", 1), WhoWasGroupSize(0), WhoWasMaxGroups(0), WhoWasMaxKeep(0)
+	: Command(parent, "WHOWAS", 1), entries(0), arenabytes(0), namebytes(0)
+	, WhoWasGroupSize(0), WhoWasMaxGroups(0), WhoWasMaxKeep(0), WhoWasMaxBytes(0)
 {
 	syntax = "<nick>{,<nick>}";
 	Penalty = 2;
@@ -47,252 +54,302 @@ CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, Use
 		user->WriteNumeric(369, "%s %s :End of WHOWAS",user->nick.c_str(),parameters[0].c_str());
 		return CMD_FAILURE;
 	}
-	else
+
+	// The entries are chained newest first, but are shown oldest first
+	std::vector<const WhoWasEntry*> group;
+	for (const WhoWasEntry* u = i->second.newest; u; u = u->prev)
+		group.push_back(u);
+
+	for (std::vector<const WhoWasEntry*>::reverse_iterator ux = group.rbegin(); ux != group.rend(); ++ux)
 	{
-		whowas_set* grp = i->second;
-		if (grp->size())
-		{
-			for (whowas_set::iterator ux = grp->begin(); ux != grp->end(); ux++)
-			{
-				WhoWasGroup* u = *ux;
-				time_t rawtime = u->signon;
-				tm *timeinfo;
-				char b[25];
-
-				timeinfo = localtime(&rawtime);
-
-				strncpy(b,asctime(timeinfo),24);
-				b[24] = 0;
-
-				user->WriteNumeric(314, "%s %s %s %s * :%s",user->nick.c_str(),parameters[0].c_str(),
-					u->ident.c_str(),u->dhost.c_str(),u->gecos.c_str());
-
-				if (user->HasPrivPermission("users/auspex"))
-					user->WriteNumeric(379, "%s %s :was connecting from *@%s",
-						user->nick.c_str(), parameters[0].c_str(), u->host.c_str());
-
-				if (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"))
-					user->WriteNumeric(312, "%s %s %s :%s",user->nick.c_str(),parameters[0].c_str(), ServerInstance->Config->HideWhoisServer.c_str(), b);
-				else
-					user->WriteNumeric(312, "%s %s %s :%s",user->nick.c_str(),parameters[0].c_str(), u->server.c_str(), b);
-			}
-		}
+		const WhoWasEntry* u = *ux;
+		time_t rawtime = u->signon;
+		tm *timeinfo;
+		char b[25];
+
+		timeinfo = localtime(&rawtime);
+
+		strncpy(b,asctime(timeinfo),24);
+		b[24] = 0;
+
+		user->WriteNumeric(314, "%s %s %s %s * :%s",user->nick.c_str(),parameters[0].c_str(),
+			u->GetIdent().c_str(),u->GetDisplayedHost().c_str(),u->GetGecos().c_str());
+
+		if (user->HasPrivPermission("users/auspex"))
+			user->WriteNumeric(379, "%s %s :was connecting from *@%s",
+				user->nick.c_str(), parameters[0].c_str(), u->GetHost().c_str());
+
+		if (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"))
+			user->WriteNumeric(312, "%s %s %s :%s",user->nick.c_str(),parameters[0].c_str(), ServerInstance->Config->HideWhoisServer.c_str(), b);
 		else
-		{
-			user->WriteNumeric(406, "%s %s :There was no such nickname",user->nick.c_str(),parameters[0].c_str());
-			user->WriteNumeric(369, "%s %s :End of WHOWAS",user->nick.c_str(),parameters[0].c_str());
-			return CMD_FAILURE;
-		}
+			user->WriteNumeric(312, "%s %s %s :%s",user->nick.c_str(),parameters[0].c_str(), servers[u->server].first.c_str(), b);
 	}
 
 	user->WriteNumeric(369, "%s %s :End of WHOWAS",user->nick.c_str(),parameters[0].c_str());
 	return CMD_SUCCESS;
 }
 
+size_t CommandWhowas::GetBytes() const
+{
+	return arenabytes + namebytes + whowas.size() * WHOWAS_NODE_SIZE;
+}
+
 std::string CommandWhowas::GetStats()
 {
-	int whowas_size = 0;
-	int whowas_bytes = 0;
-	whowas_users_fifo::iterator iter;
-	for (iter = whowas_fifo.begin(); iter != whowas_fifo.end(); iter++)
+	return "Whowas entries: " + ConvToStr(entries) + " of " + ConvToStr(whowas.size()) + " nicks (" + ConvToStr(GetBytes()) + " bytes, "
+		+ ConvToStr(arenabytes) + " in " + ConvToStr(blocks.size()) + " blocks, " + ConvToStr(servers.size() - freeservers.size()) + " server names)";
+}
+
+WhoWasEntry* CommandWhowas::Allocate(size_t size)
+{
+	WhoWasBlock* block = blocks.empty() ? NULL : blocks.back();
+	if (!block || block->capacity - block->used < size)
 	{
-		whowas_set* n = (whowas_set*)whowas.find(iter->second)->second;
-		if (n->size())
-		{
-			whowas_size += n->size();
-			whowas_bytes += (sizeof(whowas_set) + ( sizeof(WhoWasGroup) * n->size() ) );
-		}
+		block = new WhoWasBlock;
+		block->capacity = std::max(size, WHOWAS_BLOCK_SIZE);
+		block->data = new char[block->capacity];
+		block->used = block->head = 0;
+		block->live = 0;
+		block->pos = blocks.insert(blocks.end(), block);
+		arenabytes += sizeof(WhoWasBlock) + block->capacity;
 	}
-	return "Whowas entries: " +ConvToStr(whowas_size)+" ("+ConvToStr(whowas_bytes)+" bytes)";
+
+	WhoWasEntry* entry = reinterpret_cast<WhoWasEntry*>(block->data + block->used);
+	block->used += size;
+	block->live++;
+	entry->block = block;
+	entry->size = size;
+	entry->dead = false;
+	entries++;
+	return entry;
 }
 
-void CommandWhowas::AddToWhoWas(User* user)
+void CommandWhowas::Release(WhoWasEntry* entry)
 {
-	/* if whowas disabled */
-	if (this->WhoWasGroupSize == 0 || this->WhoWasMaxGroups == 0)
+	entry->dead = true;
+	entries--;
+
+	std::pair<std::string, unsigned int>& server = servers[entry->server];
+	if (--server.second == 0)
 	{
-		return;
+		namebytes -= server.first.length() + 1 + WHOWAS_NODE_SIZE;
+		serverpos.erase(server.first);
+		server.first.clear();
+		freeservers.push_back(entry->server);
 	}
 
-	whowas_users::iterator iter = whowas.find(irc::string(user->nick.c_str()));
+	WhoWasBlock* block = entry->block;
+	if (--block->live)
+		return;
 
-	if (iter == whowas.end())
+	arenabytes -= sizeof(WhoWasBlock) + block->capacity;
+	blocks.erase(block->pos);
+	delete[] block->data;
+	delete block;
+}
+
+unsigned int CommandWhowas::InternServer(const std::string& servername)
+{
+	std::map<std::string, unsigned int>::iterator i = serverpos.find(servername);
+	if (i != serverpos.end())
 	{
-		whowas_set* n = new whowas_set;
-		WhoWasGroup *a = new WhoWasGroup(user);
-		n->push_back(a);
-		whowas[user->nick.c_str()] = n;
-		whowas_fifo.push_back(std::make_pair(ServerInstance->Time(),user->nick.c_str()));
+		servers[i->second].second++;
+		return i->second;
+	}
 
-		if ((int)(whowas.size()) > this->WhoWasMaxGroups)
-		{
-			whowas_users::iterator iter2 = whowas.find(whowas_fifo[0].second);
-			if (iter2 != whowas.end())
-			{
-				whowas_set* n2 = (whowas_set*)iter2->second;
-
-				if (n2->size())
-				{
-					while (n2->begin() != n2->end())
-					{
-						WhoWasGroup *a2 = *(n2->begin());
-						delete a2;
-						n2->pop_front();
-					}
-				}
-
-				delete n2;
-				whowas.erase(iter2);
-			}
-			whowas_fifo.pop_front();
-		}
+	unsigned int pos;
+	if (freeservers.empty())
+	{
+		pos = servers.size();
+		servers.push_back(std::make_pair(servername, 1));
 	}
 	else
 	{
-		whowas_set* group = (whowas_set*)iter->second;
-		WhoWasGroup *a = new WhoWasGroup(user);
-		group->push_back(a);
-
-		if ((int)(group->size()) > this->WhoWasGroupSize)
-		{
-			WhoWasGroup *a2 = (WhoWasGroup*)*(group->begin());
-			delete a2;
-			group->pop_front();
-		}
+		pos = freeservers.back();
+		freeservers.pop_back();
+		servers[pos] = std::make_pair(servername, 1);
 	}
+	serverpos.insert(std::make_pair(servername, pos));
+	namebytes += servername.length() + 1 + WHOWAS_NODE_SIZE;
+	return pos;
 }
 
-/* on rehash, refactor maps according to new conf values */
-void CommandWhowas::PruneWhoWas(time_t t)
+WhoWasEntry* CommandWhowas::Oldest()
 {
-	/* config values */
-	int groupsize = this->WhoWasGroupSize;
-	int maxgroups = this->WhoWasMaxGroups;
-	int maxkeep =   this->WhoWasMaxKeep;
-
-	/* first cut the list to new size (maxgroups) and also prune entries that are timed out. */
-	whowas_users::iterator iter;
-	int fifosize;
-	while ((fifosize = (int)whowas_fifo.size()) > 0)
+	// Blocks without live entries are freed, so the oldest entry is always in the first block
+	if (blocks.empty())
+		return NULL;
+
+	WhoWasBlock* block = blocks.front();
+	WhoWasEntry* entry = reinterpret_cast<WhoWasEntry*>(block->data + block->head);
+	while (entry->dead)
 	{
-		if (fifosize > maxgroups || whowas_fifo[0].first < t - maxkeep)
-		{
-			iter = whowas.find(whowas_fifo[0].second);
-
-			/* hopefully redundant integrity check, but added while debugging r6216 */
-			if (iter == whowas.end())
-			{
-				/* this should never happen, if it does maps are corrupt */
-				ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "BUG: Whowas maps got corrupted! (1)");
-				return;
-			}
-
-			whowas_set* n = (whowas_set*)iter->second;
-
-			if (n->size())
-			{
-				while (n->begin() != n->end())
-				{
-					WhoWasGroup *a = *(n->begin());
-					delete a;
-					n->pop_front();
-				}
-			}
-
-			delete n;
-			whowas.erase(iter);
-			whowas_fifo.pop_front();
-		}
-		else
-			break;
+		block->head += entry->size;
+		entry = reinterpret_cast<WhoWasEntry*>(block->data + block->head);
 	}
+	return entry;
+}
+
+void CommandWhowas::RemoveOldest()
+{
+	WhoWasEntry* oldest = Oldest();
+	if (!oldest)
+		return;
 
-	/* Then cut the whowas sets to new size (groupsize) */
-	fifosize = (int)whowas_fifo.size();
-	for (int i = 0; i < fifosize; i++)
+	whowas_users::iterator iter = whowas.find(oldest->GetNick().c_str());
+	if (iter == whowas.end())
 	{
-		iter = whowas.find(whowas_fifo[0].second);
-		/* hopefully redundant integrity check, but added while debugging r6216 */
-		if (iter == whowas.end())
-		{
-			/* this should never happen, if it does maps are corrupt */
-			ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "BUG: Whowas maps got corrupted! (2)");
-			return;
-		}
-		whowas_set* n = (whowas_set*)iter->second;
-		if (n->size())
-		{
-			int nickcount = n->size();
-			while (n->begin() != n->end() && nickcount > groupsize)
-			{
-				WhoWasGroup *a = *(n->begin());
-				delete a;
-				n->pop_front();
-				nickcount--;
-			}
-		}
+		/* this should never happen, if it does maps are corrupt */
+		ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "BUG: Whowas maps got corrupted! (1)");
+		// Release it anyway, or the callers looping until the oldest entry is recent enough would never stop
+		Release(oldest);
+		return;
 	}
+
+	// Being the oldest of all entries, it is also the oldest of its nick
+	TrimNick(iter, iter->second.count - 1);
 }
 
-/* call maintain once an hour to remove expired nicks */
-void CommandWhowas::MaintainWhoWas(time_t t)
+void CommandWhowas::RemoveNick(whowas_users::iterator iter)
 {
-	for (whowas_users::iterator iter = whowas.begin(); iter != whowas.end(); iter++)
+	WhoWasEntry* entry = iter->second.newest;
+	namebytes -= iter->first.length() + 1;
+	whowas.erase(iter);
+
+	while (entry)
 	{
-		whowas_set* n = (whowas_set*)iter->second;
-		if (n->size())
-		{
-			while ((n->begin() != n->end()) && ((*n->begin())->signon < t - this->WhoWasMaxKeep))
-			{
-				WhoWasGroup *a = *(n->begin());
-				delete a;
-				n->erase(n->begin());
-			}
-		}
+		WhoWasEntry* prev = entry->prev;
+		Release(entry);
+		entry = prev;
 	}
 }
 
-CommandWhowas::~CommandWhowas()
+void CommandWhowas::TrimNick(whowas_users::iterator iter, unsigned int max)
 {
-	whowas_users::iterator iter;
-	int fifosize;
-	while ((fifosize = (int)whowas_fifo.size()) > 0)
+	WhoWasGroup& group = iter->second;
+	if (group.count <= max)
+		return;
+
+	if (max == 0)
 	{
-		iter = whowas.find(whowas_fifo[0].second);
+		RemoveNick(iter);
+		return;
+	}
+
+	WhoWasEntry* last = group.newest;
+	for (unsigned int i = 1; i < max; i++)
+		last = last->prev;
 
-		/* hopefully redundant integrity check, but added while debugging r6216 */
+	WhoWasEntry* entry = last->prev;
+	last->prev = NULL;
+	group.count = max;
+
+	while (entry)
+	{
+		WhoWasEntry* prev = entry->prev;
+		Release(entry);
+		entry = prev;
+	}
+}
+
+void CommandWhowas::EnforceLimits(time_t t)
+{
+	while ((int)whowas.size() > this->WhoWasMaxGroups)
+	{
+		whowas_users::iterator iter = whowas.find(Oldest()->GetNick().c_str());
 		if (iter == whowas.end())
 		{
 			/* this should never happen, if it does maps are corrupt */
-			ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "BUG: Whowas maps got corrupted! (3)");
+			ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "BUG: Whowas maps got corrupted! (2)");
 			return;
 		}
+		RemoveNick(iter);
+	}
 
-		whowas_set* n = (whowas_set*)iter->second;
+	// Removing an entry only gives memory back once the rest of its block is gone as well
+	while (entries && GetBytes() > (size_t)this->WhoWasMaxBytes)
+		RemoveOldest();
 
-		if (n->size())
-		{
-			while (n->begin() != n->end())
-			{
-				WhoWasGroup *a = *(n->begin());
-				delete a;
-				n->pop_front();
-			}
-		}
+	MaintainWhoWas(t);
+}
+
+void CommandWhowas::AddToWhoWas(User* user)
+{
+	/* if whowas disabled */
+	if (this->WhoWasGroupSize == 0 || this->WhoWasMaxGroups == 0)
+	{
+		return;
+	}
+
+	const size_t maxlen = USHRT_MAX;
+	unsigned short nicklen = std::min(user->nick.length(), maxlen);
+	unsigned short identlen = std::min(user->ident.length(), maxlen);
+	unsigned short hostlen = std::min(user->host.length(), maxlen);
+	unsigned short dhostlen = std::min(user->dhost.length(), maxlen);
+	unsigned short gecoslen = std::min(user->fullname.length(), maxlen);
+
+	// Round up to the alignment of the fields of the next entry
+	size_t size = sizeof(WhoWasEntry) + nicklen + identlen + hostlen + dhostlen + gecoslen;
+	size = (size + sizeof(time_t) - 1) & ~(sizeof(time_t) - 1);
+
+	WhoWasEntry* entry = Allocate(size);
+	entry->added = ServerInstance->Time();
+	entry->signon = user->signon;
+	entry->server = InternServer(user->server);
+	entry->nicklen = nicklen;
+	entry->identlen = identlen;
+	entry->hostlen = hostlen;
+	entry->dhostlen = dhostlen;
+	entry->gecoslen = gecoslen;
+
+	char* p = reinterpret_cast<char*>(entry + 1);
+	p = std::copy(user->nick.begin(), user->nick.begin() + nicklen, p);
+	p = std::copy(user->ident.begin(), user->ident.begin() + identlen, p);
+	p = std::copy(user->host.begin(), user->host.begin() + hostlen, p);
+	p = std::copy(user->dhost.begin(), user->dhost.begin() + dhostlen, p);
+	std::copy(user->fullname.begin(), user->fullname.begin() + gecoslen, p);
+
+	std::pair<whowas_users::iterator, bool> ret = whowas.insert(std::make_pair(irc::string(entry->GetNick().c_str()), WhoWasGroup()));
+	if (ret.second)
+		namebytes += nicklen + 1;
+
+	WhoWasGroup& group = ret.first->second;
+	entry->prev = group.newest;
+	group.newest = entry;
+	group.count++;
+
+	TrimNick(ret.first, this->WhoWasGroupSize);
+	EnforceLimits(ServerInstance->Time());
+}
 
-		delete n;
-		whowas.erase(iter);
-		whowas_fifo.pop_front();
+/* on rehash, refactor maps according to new conf values */
+void CommandWhowas::PruneWhoWas(time_t t)
+{
+	/* cut the whowas sets to new size (groupsize) */
+	for (whowas_users::iterator iter = whowas.begin(); iter != whowas.end(); )
+	{
+		whowas_users::iterator cur = iter++;
+		TrimNick(cur, this->WhoWasGroupSize);
 	}
+
+	/* then cut the list to new size (maxgroups, maxbytes) and also prune entries that are timed out. */
+	EnforceLimits(t);
 }
 
-WhoWasGroup::WhoWasGroup(User* user) : host(user->host), dhost(user->dhost), ident(user->ident),
-	server(user->server), gecos(user->fullname), signon(user->signon)
+/* call maintain once an hour to remove expired nicks */
+void CommandWhowas::MaintainWhoWas(time_t t)
 {
+	for (WhoWasEntry* oldest = Oldest(); oldest && oldest->added < t - this->WhoWasMaxKeep; oldest = Oldest())
+		RemoveOldest();
 }
 
-WhoWasGroup::~WhoWasGroup()
+CommandWhowas::~CommandWhowas()
 {
+	for (std::list<WhoWasBlock*>::iterator i = blocks.begin(); i != blocks.end(); ++i)
+	{
+		delete[] (*i)->data;
+		delete *i;
+	}
 }
 
 class ModuleWhoWas : public Module
@@ -347,17 +404,21 @@ class ModuleWhoWas : public Module
 		int NewGroupSize = tag->getInt("groupsize");
 		int NewMaxGroups = tag->getInt("maxgroups");
 		int NewMaxKeep = InspIRCd::Duration(tag->getString("maxkeep"));
+		int NewMaxBytes = tag->getInt("maxbytes", 64 * 1024 * 1024);
 
 		RangeCheck(NewGroupSize, 0, 10000, 10, "<whowas:groupsize>");
 		RangeCheck(NewMaxGroups, 0, 1000000, 10240, "<whowas:maxgroups>");
 		RangeCheck(NewMaxKeep, 3600, INT_MAX, 3600, "<whowas:maxkeep>");
+		RangeCheck(NewMaxBytes, 64 * 1024, INT_MAX, 64 * 1024 * 1024, "<whowas:maxbytes>");
 
-		if ((NewGroupSize == cmd.WhoWasGroupSize) && (NewMaxGroups == cmd.WhoWasMaxGroups) && (NewMaxKeep == cmd.WhoWasMaxKeep))
+		if ((NewGroupSize == cmd.WhoWasGroupSize) && (NewMaxGroups == cmd.WhoWasMaxGroups) && (NewMaxKeep == cmd.WhoWasMaxKeep)
+			&& (NewMaxBytes == cmd.WhoWasMaxBytes))
 			return;
 
 		cmd.WhoWasGroupSize = NewGroupSize;
 		cmd.WhoWasMaxGroups = NewMaxGroups;
 		cmd.WhoWasMaxKeep = NewMaxKeep;
+		cmd.WhoWasMaxBytes = NewMaxBytes;
 		cmd.PruneWhoWas(ServerInstance->Time());
 	}
 
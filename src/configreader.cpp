@@ -36,6 +36,7 @@ ServerConfig::ServerConfig()
 	dns_timeout = 5;
 	MaxTargets = 20;
 	NetBufferSize = 10240;
+	HookProfiling = false;
 	SoftLimit = ServerInstance->SE->GetMaxFds();
 	MaxConn = SOMAXCONN;
 	MaxChans = 20;
@@ -323,6 +324,8 @@ void ServerConfig::CrossCheckConnectBlocks(ServerConfig* current)
 			Classes[i] = me;
 		}
 	}
+
+	ClassIndex.Build(Classes);
 }
 
 /** Represents a deprecated configuration tag.
@@ -391,6 +394,9 @@ void ServerConfig::Fill()
 	AdminNick = ConfValue("admin")->getString("nick", "admin");
 	ModPath = ConfValue("path")->getString("moduledir", MOD_PATH);
 	NetBufferSize = ConfValue("performance")->getInt("netbuffersize", 10240);
+	IOThreads = ConfValue("performance")->getInt("iothreads", 0);
+	MaxWho = ConfValue("performance")->getInt("maxwho", 4096);
+	HookProfiling = ConfValue("performance")->getBool("hookprofiling");
 	dns_timeout = ConfValue("dns")->getInt("timeout", 5);
 	DisabledCommands = ConfValue("disabled")->getString("commands", "");
 	DisabledDontExist = ConfValue("disabled")->getBool("fakenonexistant");
@@ -431,6 +437,8 @@ void ServerConfig::Fill()
 		range(MaxConn, 0, SOMAXCONN, SOMAXCONN, "<performance:somaxconn>");
 	range(MaxTargets, 1, 31, 20, "<security:maxtargets>");
 	range(NetBufferSize, 1024, 65534, 10240, "<performance:netbuffersize>");
+	range(IOThreads, 0, 64, 0, "<performance:iothreads>");
+	range(MaxWho, 1, 1000000, 4096, "<performance:maxwho>");
 
 	std::string defbind = options->getString("defaultbind");
 	if (assign(defbind) == "ipv4")
@@ -582,7 +590,10 @@ void ServerConfig::Apply(ServerConfig* old, const std::string &useruid)
 
 	// write once here, to try it out and make sure its ok
 	if (valid)
+	{
 		ServerInstance->WritePID(this->PID);
+		ServerInstance->Modules->ProfileHooks = HookProfiling;
+	}
 
 	if (old)
 	{
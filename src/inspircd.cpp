@@ -143,6 +143,8 @@ void InspIRCd::Cleanup()
 	DeleteZero(this->Config);
 	DeleteZero(this->chanlist);
 	DeleteZero(this->PI);
+	this->Logs->StopWriter();
+	DeleteZero(this->IOThreads);
 	DeleteZero(this->Threads);
 	DeleteZero(this->Timers);
 	DeleteZero(this->SE);
@@ -291,6 +293,7 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	// Initialize so that if we exit before proper initialization they're not deleted
 	this->Logs = 0;
 	this->Threads = 0;
+	this->IOThreads = 0;
 	this->PI = 0;
 	this->Users = 0;
 	this->chanlist = 0;
@@ -315,6 +318,7 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	SE = CreateSocketEngine();
 
 	this->Threads = new ThreadEngine;
+	this->IOThreads = new IOThreadManager;
 
 	/* Default implementation does nothing */
 	this->PI = new ProtocolInterface;
@@ -507,6 +511,9 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	this->XLines->CheckELines();
 	this->XLines->ApplyLines();
 
+	// Must come after forking, threads do not survive fork()
+	this->IOThreads->Start(Config->IOThreads);
+
 	int bounditems = BindPorts(pl);
 
 	std::cout << std::endl;
@@ -749,7 +756,6 @@ int InspIRCd::Run()
 			}
 
 			Timers->TickTimers(TIME.tv_sec);
-			this->DoBackgroundUserStuff();
 
 			if ((TIME.tv_sec % 5) == 0)
 			{
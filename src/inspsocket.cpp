@@ -150,17 +150,25 @@ CullResult StreamSocket::cull()
 
 bool StreamSocket::GetNextLine(std::string& line, char delim)
 {
-	std::string::size_type i = recvq.find(delim);
+	std::string::size_type i = recvq.find(delim, recvq_pos);
 	if (i == std::string::npos)
+	{
+		// No complete line left, throw away everything that has been read so far.
+		// Doing this once per batch instead of once per line keeps a burst of
+		// pipelined lines linear in the size of the recvq.
+		DiscardReadLines();
 		return false;
-	line = recvq.substr(0, i);
-	// TODO is this the most efficient way to split?
-	recvq = recvq.substr(i + 1);
+	}
+	line.assign(recvq, recvq_pos, i - recvq_pos);
+	recvq_pos = i + 1;
 	return true;
 }
 
 void StreamSocket::DoRead()
 {
+	// Discard lines that were consumed before the reader stopped early
+	DiscardReadLines();
+
 	if (IOHook)
 	{
 		int rv = -1;
@@ -238,7 +246,11 @@ void StreamSocket::DoWrite()
 		{
 			while (error.empty() && !sendq.empty())
 			{
-				if (sendq.size() > 1 && sendq[0].length() < 1024)
+				// IOHooks work on a mutable string, so the data has to be copied
+				// out of the (possibly shared) send buffers here.
+				size_t items = 1;
+				std::string front;
+				if (sendq.size() > 1 && sendq.front().length() < 1024)
 				{
 					// Avoid multiple repeated SSL encryption invocations
 					// This adds a single copy of the queue, but avoids
@@ -247,14 +259,15 @@ void StreamSocket::DoWrite()
 					//
 					// The length limit of 1024 is to prevent merging strings
 					// more than once when writes begin to block.
-					std::string tmp;
-					tmp.reserve(sendq_len);
-					for(unsigned int i=0; i < sendq.size(); i++)
-						tmp.append(sendq[i]);
-					sendq.clear();
-					sendq.push_back(tmp);
+					items = sendq.size();
+					front.reserve(sendq_len);
+					for (size_t i = 0; i < items; i++)
+						front.append(sendq[i].data(), sendq[i].length());
+				}
+				else
+				{
+					front.assign(sendq.front().data(), sendq.front().length());
 				}
-				std::string& front = sendq.front();
 				int itemlen = front.length();
 				if (IOHook)
 				{
@@ -263,14 +276,18 @@ void StreamSocket::DoWrite()
 					{
 						// consumed the entire string, and is ready for more
 						sendq_len -= itemlen;
-						sendq.pop_front();
+						sendq.erase(sendq.begin(), sendq.begin() + items);
 					}
 					else if (rv == 0)
 					{
 						// socket has blocked. Stop trying to send data.
 						// IOHook has requested unblock notification from the socketengine
 
-						// Since it is possible that a partial write took place, adjust sendq_len
+						// Since it is possible that a partial write took place, replace
+						// the items we handed to the IOHook with whatever it left over
+						sendq.erase(sendq.begin(), sendq.begin() + items);
+						if (!front.empty())
+							sendq.push_front(SendQueueItem(new SendBuffer(front)));
 						sendq_len = sendq_len - itemlen + front.length();
 						return;
 					}
@@ -300,14 +317,15 @@ void StreamSocket::DoWrite()
 					else if (rv < itemlen)
 					{
 						ServerInstance->SE->ChangeEventMask(this, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
-						front = front.substr(rv);
+						sendq.erase(sendq.begin(), sendq.begin() + items);
+						sendq.push_front(SendQueueItem(new SendBuffer(front.substr(rv))));
 						sendq_len -= rv;
 						return;
 					}
 					else
 					{
 						sendq_len -= itemlen;
-						sendq.pop_front();
+						sendq.erase(sendq.begin(), sendq.begin() + items);
 						if (sendq.empty())
 							ServerInstance->SE->ChangeEventMask(this, FD_WANT_EDGE_WRITE);
 					}
@@ -344,6 +362,7 @@ void StreamSocket::DoWrite()
 			iovec* iovecs = new iovec[bufcount];
 			for(int i=0; i < bufcount; i++)
 			{
+				// Send straight out of the (possibly shared) buffers, no copying needed
 				iovecs[i].iov_base = const_cast<char*>(sendq[i].data());
 				iovecs[i].iov_len = sendq[i].length();
 				rv_max += sendq[i].length();
@@ -369,17 +388,17 @@ void StreamSocket::DoWrite()
 				sendq_len -= rv;
 				while (rv > 0 && !sendq.empty())
 				{
-					std::string& front = sendq.front();
+					SendQueueItem& front = sendq.front();
 					if (front.length() <= (size_t)rv)
 					{
-						// this string got fully written out
+						// this buffer got fully written out
 						rv -= front.length();
 						sendq.pop_front();
 					}
 					else
 					{
-						// stopped in the middle of this string
-						front = front.substr(rv);
+						// stopped in the middle of this buffer
+						front.pos += rv;
 						rv = 0;
 					}
 				}
@@ -425,12 +444,28 @@ void StreamSocket::WriteData(const std::string &data)
 	}
 
 	/* Append the data to the back of the queue ready for writing */
-	sendq.push_back(data);
+	sendq.push_back(SendQueueItem(new SendBuffer(data)));
 	sendq_len += data.length();
 
 	ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
 }
 
+void StreamSocket::WriteData(const reference<SendBuffer>& data)
+{
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to write data to dead socket: %s",
+			data->data.c_str());
+		return;
+	}
+
+	/* Append a reference to the shared buffer to the back of the queue */
+	sendq.push_back(SendQueueItem(data));
+	sendq_len += data->data.length();
+
+	ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+}
+
 bool SocketTimeout::Tick(time_t)
 {
 	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "SocketTimeout::Tick");
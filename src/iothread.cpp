@@ -0,0 +1,396 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2014 InspIRCd Development Team
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "iothread.h"
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+
+/** A worker thread which reads from a set of client sockets using its own epoll instance.
+ *
+ * The worker never touches anything but its own epoll fd, the client fds, and the
+ * structures below. Everything it reads is handed to the main thread through the
+ * SocketThread queue; OnNotify() then runs in the main thread and feeds the lines
+ * to the owning UserIOHandler.
+ */
+class IOThread : public SocketThread
+{
+	/** Maximum number of events taken out of epoll in one go */
+	static const int MAX_EVENTS = 512;
+
+	/** Per socket state, owned by the main thread but only freed by the worker */
+	struct Connection
+	{
+		int fd;
+		unsigned long serial;
+		/** Data received after the last complete line, not yet passed on */
+		std::string partial;
+		/** True once the socket has been removed from the epoll set */
+		bool dead;
+		Connection(int Fd, unsigned long Serial) : fd(Fd), serial(Serial), dead(false) { }
+	};
+
+	/** Data or an error read from a socket, waiting to be handled by the main thread */
+	struct Result
+	{
+		int fd;
+		unsigned long serial;
+		std::string data;
+		/** 0 if data was read, -1 if the connection was closed, errno otherwise */
+		int error;
+		Result() : fd(-1), serial(0), error(0) { }
+		Result(Connection* c, int err) : fd(c->fd), serial(c->serial), error(err) { }
+	};
+
+	/** epoll instance watching the sockets owned by this thread */
+	int EngineHandle;
+
+	/** Size of the recv() buffer; this is <performance:netbuffersize> at startup */
+	const int bufsize;
+
+	/** recv() buffer, only used by the worker */
+	char* buffer;
+
+	/** Held by the worker while it handles a batch of events, and by the main
+	 * thread while it removes a socket. A socket removed by the main thread is
+	 * marked dead and freed by the worker at the end of its current batch, so the
+	 * worker never touches a Connection after it is gone, or an fd after it has
+	 * been closed.
+	 */
+	Mutex connlock;
+
+	/** Connections removed from the set, waiting to be freed. Guarded by connlock */
+	std::vector<Connection*> graveyard;
+
+	/** Sockets owned by this thread, by fd. Only used by the main thread */
+	std::map<int, Connection*> connections;
+
+	/** Results waiting for the main thread. Guarded by the queue lock */
+	std::vector<Result> results;
+
+	/** Bytes read since the main thread last collected the results. Guarded by the queue lock */
+	size_t bytesin;
+
+	/** Read once from a socket that epoll says is readable, and queue any complete lines
+	 * @param c Socket to read from
+	 * @param out Where to queue the result
+	 * @return Number of bytes read
+	 */
+	size_t ReadConnection(Connection* c, std::vector<Result>& out)
+	{
+		int n = recv(c->fd, buffer, bufsize, 0);
+		if (n > 0)
+		{
+			c->partial.append(buffer, n);
+			std::string::size_type eol = c->partial.rfind('\n');
+			if (eol == std::string::npos && c->partial.length() < MAXBUF)
+				return n;
+
+			// Pass on everything up to and including the last line ending. A partial line
+			// that has grown past the maximum line length is passed on as well; the recvq
+			// limits of the main thread take care of connections that never send a newline.
+			out.push_back(Result(c, 0));
+			if (eol == std::string::npos || eol == c->partial.length() - 1)
+			{
+				out.back().data.swap(c->partial);
+			}
+			else
+			{
+				out.back().data.assign(c->partial, 0, eol + 1);
+				c->partial.erase(0, eol + 1);
+			}
+			return n;
+		}
+
+		if (n < 0 && (SocketEngine::IgnoreError() || errno == EINTR))
+			return 0;
+
+		// Connection closed or failed, stop watching it and let the main thread clean up
+		int error = (n == 0 ? -1 : errno);
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		epoll_ctl(EngineHandle, EPOLL_CTL_DEL, c->fd, &ev);
+		c->dead = true;
+		out.push_back(Result(c, error));
+		return 0;
+	}
+
+ public:
+	IOThread() : bufsize(ServerInstance->Config->NetBufferSize), bytesin(0)
+	{
+		EngineHandle = epoll_create(128);
+		if (EngineHandle == -1)
+			throw CoreException("Could not create epoll instance for I/O thread: " + std::string(strerror(errno)));
+		buffer = new char[bufsize];
+	}
+
+	~IOThread()
+	{
+		for (std::map<int, Connection*>::iterator i = connections.begin(); i != connections.end(); ++i)
+			delete i->second;
+		for (std::vector<Connection*>::iterator i = graveyard.begin(); i != graveyard.end(); ++i)
+			delete *i;
+		close(EngineHandle);
+		delete[] buffer;
+	}
+
+	/** Start watching a socket. Called in the main thread. */
+	bool Add(int fd, unsigned long serial)
+	{
+		Connection* c = new Connection(fd, serial);
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(EngineHandle, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Error adding fd: %d to I/O thread: %s", fd, strerror(errno));
+			delete c;
+			return false;
+		}
+		connections[fd] = c;
+		return true;
+	}
+
+	/** Stop watching a socket. Called in the main thread, before the fd is closed. */
+	void Remove(int fd)
+	{
+		std::map<int, Connection*>::iterator i = connections.find(fd);
+		if (i == connections.end())
+			return;
+
+		connlock.Lock();
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		epoll_ctl(EngineHandle, EPOLL_CTL_DEL, fd, &ev);
+		i->second->dead = true;
+		graveyard.push_back(i->second);
+		connlock.Unlock();
+
+		connections.erase(i);
+	}
+
+	void Run()
+	{
+		std::vector<struct epoll_event> events(MAX_EVENTS);
+		std::vector<Result> batch;
+		size_t readlen = 0;
+
+		while (!GetExitFlag())
+		{
+			int n = epoll_wait(EngineHandle, &events[0], MAX_EVENTS, 1000);
+
+			connlock.Lock();
+			for (int j = 0; j < n; j++)
+			{
+				Connection* c = static_cast<Connection*>(events[j].data.ptr);
+				if (!c->dead)
+					readlen += ReadConnection(c, batch);
+			}
+			for (std::vector<Connection*>::iterator i = graveyard.begin(); i != graveyard.end(); ++i)
+				delete *i;
+			graveyard.clear();
+			connlock.Unlock();
+
+			// Partial lines are kept back, so don't wake up the main thread for them
+			if (batch.empty())
+				continue;
+
+			LockQueue();
+			bytesin += readlen;
+			bool wasempty = results.empty();
+			if (wasempty)
+			{
+				results.swap(batch);
+			}
+			else
+			{
+				for (std::vector<Result>::iterator i = batch.begin(); i != batch.end(); ++i)
+				{
+					results.push_back(Result());
+					Result& r = results.back();
+					r.fd = i->fd;
+					r.serial = i->serial;
+					r.error = i->error;
+					r.data.swap(i->data);
+				}
+			}
+			UnlockQueue();
+			batch.clear();
+			readlen = 0;
+
+			// If the main thread has not collected the previous results yet, it has been notified already
+			if (wasempty)
+				NotifyParent();
+		}
+	}
+
+	void OnNotify()
+	{
+		std::vector<Result> pending;
+		LockQueue();
+		pending.swap(results);
+		size_t len = bytesin;
+		bytesin = 0;
+		UnlockQueue();
+
+		ServerInstance->SE->UpdateStats(len, 0);
+
+		for (std::vector<Result>::iterator i = pending.begin(); i != pending.end(); ++i)
+		{
+			// The socket may have gone away, and its fd may even have been reused, since this was read
+			UserIOHandler* eh = dynamic_cast<UserIOHandler*>(ServerInstance->SE->GetRef(i->fd));
+			if (!eh || eh->iothread != this || eh->ioserial != i->serial || eh->user->quitting)
+				continue;
+
+			if (!eh->getError().empty())
+				continue;
+
+			// A hook must see the raw data, so a socket that got one is read by the main thread from now on
+			if (eh->GetIOHook())
+			{
+				ServerInstance->IOThreads->DetachSocket(eh);
+				continue;
+			}
+
+			if (i->error)
+			{
+				eh->SetError(i->error < 0 ? "Connection closed" : strerror(i->error));
+			}
+			else
+			{
+				try
+				{
+					eh->ReadFromThread(i->data);
+				}
+				catch (CoreException& ex)
+				{
+					ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Caught exception in socket processing on FD %d - '%s'",
+						i->fd, ex.GetReason());
+					eh->SetError(ex.GetReason());
+				}
+			}
+
+			if (!eh->getError().empty())
+			{
+				ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Error on FD %d - '%s'", i->fd, eh->getError().c_str());
+				eh->OnError(I_ERR_OTHER);
+			}
+		}
+	}
+};
+#else
+/** Placeholder for socket engines without worker thread support */
+class IOThread : public SocketThread
+{
+ public:
+	bool Add(int, unsigned long) { return false; }
+	void Remove(int) { }
+	void Run() { }
+	void OnNotify() { }
+};
+#endif
+
+IOThreadManager::IOThreadManager() : nextthread(0), nextserial(0)
+{
+}
+
+IOThreadManager::~IOThreadManager()
+{
+	Stop();
+}
+
+void IOThreadManager::Start(unsigned int count)
+{
+	if (!threads.empty() || !count)
+		return;
+
+#ifdef USE_EPOLL
+	for (unsigned int i = 0; i < count; i++)
+	{
+		IOThread* thread = NULL;
+		try
+		{
+			thread = new IOThread;
+			ServerInstance->Threads->Start(thread);
+		}
+		catch (CoreException& ex)
+		{
+			ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Unable to start I/O thread: %s", ex.GetReason());
+			delete thread;
+			break;
+		}
+		threads.push_back(thread);
+	}
+	ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Started %u of %u I/O threads", (unsigned int)threads.size(), count);
+#else
+	ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "I/O threads are not supported by the %s socket engine, reading all sockets in the main thread",
+		ServerInstance->SE->GetName().c_str());
+#endif
+}
+
+void IOThreadManager::Stop()
+{
+	// Tell every thread to exit first, so they can all wind down at the same time
+	for (std::vector<IOThread*>::iterator i = threads.begin(); i != threads.end(); ++i)
+		(*i)->SetExitFlag();
+
+	for (std::vector<IOThread*>::iterator i = threads.begin(); i != threads.end(); ++i)
+	{
+		(*i)->join();
+		delete *i;
+	}
+	threads.clear();
+}
+
+bool IOThreadManager::AddSocket(UserIOHandler* eh)
+{
+	if (threads.empty() || eh->iothread)
+		return false;
+
+	IOThread* thread = threads[nextthread];
+	nextthread = (nextthread + 1) % threads.size();
+
+	if (!thread->Add(eh->GetFd(), ++nextserial))
+		return false;
+
+	eh->iothread = thread;
+	eh->ioserial = nextserial;
+	return true;
+}
+
+void IOThreadManager::DelSocket(UserIOHandler* eh)
+{
+	if (!eh->iothread)
+		return;
+
+	eh->iothread->Remove(eh->GetFd());
+	eh->iothread = NULL;
+}
+
+void IOThreadManager::DetachSocket(UserIOHandler* eh)
+{
+	if (!eh->iothread)
+		return;
+
+	// Once Remove() returns the worker will not read from the fd again
+	DelSocket(eh);
+	ServerInstance->SE->ChangeEventMask(eh, FD_WANT_FAST_READ);
+}
@@ -126,6 +126,21 @@ unsigned int ListModeBase::GetLimit(Channel* channel)
 	return GetLimitInternal(channel->name, cd);
 }
 
+const BanIndex* ListModeBase::GetIndex(Channel* channel)
+{
+	ChanData* cd = extItem.get(channel);
+	if (!cd)
+		return NULL;
+
+	if (!cd->index)
+	{
+		cd->index = new BanIndex;
+		for (ModeList::const_iterator it = cd->list.begin(); it != cd->list.end(); ++it)
+			cd->index->Add(it->mask);
+	}
+	return cd->index;
+}
+
 ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std::string &parameter, bool adding)
 {
 	// Try and grab the list
@@ -182,6 +197,8 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 		{
 			// And now add the mask onto the list...
 			cd->list.push_back(ListItem(parameter, source->nick, ServerInstance->Time()));
+			if (cd->index)
+				cd->index->Add(parameter);
 			return MODEACTION_ALLOW;
 		}
 		else
@@ -199,6 +216,8 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 			{
 				if (parameter == it->mask)
 				{
+					if (cd->index)
+						cd->index->Remove(it->mask);
 					cd->list.erase(it);
 					return MODEACTION_ALLOW;
 				}
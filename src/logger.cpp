@@ -22,6 +22,15 @@
 
 #include "inspircd.h"
 #include "filelogger.h"
+#include "threadengine.h"
+
+#ifndef DISABLE_WRITEV
+#include <sys/uio.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 /*
  * Suggested implementation...
@@ -54,13 +63,360 @@ const char LogStream::LogHeader[] =
 	"Log started for " VERSION " (" REVISION ", " MODULE_INIT_STR ")"
 	" - compiled on " SYSTEM;
 
+/** Writes the lines queued by FileWriters to their files, so that the main thread does not
+ * wait for the disk.
+ *
+ * The lines are kept in a ring buffer of a fixed size, each one as a RecordHeader followed
+ * by the text, padded to the size of a header so that the headers stay aligned. When a line
+ * does not fit before the end of the buffer, a header with no file fills the rest and the
+ * line goes at the start. The thread takes all the lines in the buffer at once and writes
+ * the consecutive lines for the same file with a single writev().
+ */
+class LogWriterThread : public QueuedThread
+{
+	struct RecordHeader
+	{
+		/** The file descriptor to write the line to, or -1 for padding */
+		int fd;
+		/** Length of the line, not including the header and the padding */
+		unsigned int len;
+	};
+
+	/** The ring buffer */
+	std::vector<char> ring;
+
+	/** Offset of the oldest line in the ring, which the writer thread is going to write next */
+	size_t tail;
+
+	/** Number of bytes in the ring, starting at tail */
+	size_t used;
+
+	/** True if the main thread should wait for space instead of dropping lines when the ring is full */
+	bool block;
+
+	/** Number of lines dropped because the ring was full, since the last time that was logged */
+	unsigned long dropped;
+
+	/** True while the writer thread is writing or syncing without holding the lock */
+	bool busy;
+
+	/** True if the writer thread should fsync the files written to since the last sync */
+	bool syncrequested;
+
+	/** Files written to since the last sync */
+	std::set<int> dirtyfds;
+
+	static size_t Align(size_t len)
+	{
+		return (len + sizeof(RecordHeader) - 1) & ~(sizeof(RecordHeader) - 1);
+	}
+
+	RecordHeader* HeaderAt(size_t offset)
+	{
+		return reinterpret_cast<RecordHeader*>(&ring[offset]);
+	}
+
+	/** Write a run of records to their files. Must be called without the lock held.
+	 * @param start Offset of the first record
+	 * @param len Number of bytes of records, which must not go past the end of the ring
+	 * @param fds Set to the files written to
+	 */
+	void WriteRecords(size_t start, size_t len, std::set<int>& fds)
+	{
+		size_t end = start + len;
+		size_t pos = start;
+		while (pos < end)
+		{
+			RecordHeader* hdr = HeaderAt(pos);
+			int fd = hdr->fd;
+			if (fd < 0)
+			{
+				pos += sizeof(RecordHeader) + Align(hdr->len);
+				continue;
+			}
+
+			fds.insert(fd);
+#ifndef DISABLE_WRITEV
+			iovec iovecs[IOV_MAX < 128 ? IOV_MAX : 128];
+			int count = 0;
+			while (pos < end && count < (int)(sizeof(iovecs) / sizeof(iovec)))
+			{
+				hdr = HeaderAt(pos);
+				if (hdr->fd != fd)
+					break;
+				iovecs[count].iov_base = &ring[pos + sizeof(RecordHeader)];
+				iovecs[count].iov_len = hdr->len;
+				count++;
+				pos += sizeof(RecordHeader) + Align(hdr->len);
+			}
+
+			// Carry on after a short write; give up on the lines on an error so a full disk does not hang the ircd
+			iovec* next = iovecs;
+			while (count)
+			{
+				ssize_t rv = writev(fd, next, count);
+				if (rv < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					break;
+				}
+
+				while (count && (size_t)rv >= next->iov_len)
+				{
+					rv -= next->iov_len;
+					next++;
+					count--;
+				}
+				if (count)
+				{
+					next->iov_base = static_cast<char*>(next->iov_base) + rv;
+					next->iov_len -= rv;
+				}
+			}
+#else
+			const char* data = &ring[pos + sizeof(RecordHeader)];
+			size_t left = hdr->len;
+			while (left)
+			{
+				int rv = write(fd, data, left);
+				if (rv <= 0)
+					break;
+				data += rv;
+				left -= rv;
+			}
+			pos += sizeof(RecordHeader) + Align(hdr->len);
+#endif
+		}
+	}
+
+	/** Copy a line into the ring. The lock must be held, and there must be space for it.
+	 * @param fd The file to write it to
+	 * @param line The line
+	 */
+	void Put(int fd, const std::string& line)
+	{
+		size_t head = (tail + used) % ring.size();
+		size_t len = sizeof(RecordHeader) + Align(line.length());
+		if (ring.size() - head < len)
+		{
+			HeaderAt(head)->fd = -1;
+			HeaderAt(head)->len = ring.size() - head - sizeof(RecordHeader);
+			used += ring.size() - head;
+			head = 0;
+		}
+
+		HeaderAt(head)->fd = fd;
+		HeaderAt(head)->len = line.length();
+		memcpy(&ring[head + sizeof(RecordHeader)], line.data(), line.length());
+		used += len;
+	}
+
+	/** Get the number of bytes a line takes up in the ring if it was added now, including
+	 * the padding at the end of the ring if it does not fit there. The lock must be held.
+	 */
+	size_t Needed(const std::string& line)
+	{
+		size_t head = (tail + used) % ring.size();
+		size_t len = sizeof(RecordHeader) + Align(line.length());
+		if (ring.size() - head < len)
+			len += ring.size() - head;
+		return len;
+	}
+
+ public:
+	LogWriterThread(size_t size, bool blockwhenfull)
+		: ring(Align(size)), tail(0), used(0), block(blockwhenfull), dropped(0), busy(false), syncrequested(false)
+	{
+	}
+
+	/** Check whether a line is too long to ever fit in the ring
+	 * @param line The line
+	 * @return True if the line has to be written by the caller
+	 */
+	bool TooLong(const std::string& line) const
+	{
+		// Two headers: the line's own, and padding at the end of the ring
+		return (sizeof(RecordHeader) * 2 + Align(line.length()) > ring.size() / 2);
+	}
+
+	/** Queue a line for writing. If the ring is full, the line is dropped or this waits for the
+	 * writer thread, depending on <performance:logoverflow>.
+	 * @param fd The file to write it to
+	 * @param line The line, which must not be TooLong()
+	 */
+	void Write(int fd, const std::string& line)
+	{
+		LockQueue();
+		if (dropped)
+		{
+			time_t now = ServerInstance->Time();
+			std::string note(asctime(localtime(&now)), 24);
+			note.append(": ").append(ConvToStr(dropped)).append(" log lines were dropped because the log writer thread fell behind\n");
+			if (used + Needed(note) <= ring.size())
+			{
+				Put(fd, note);
+				dropped = 0;
+			}
+		}
+
+		while (used + Needed(line) > ring.size())
+		{
+			if (!block)
+			{
+				dropped++;
+				UnlockQueueWakeup();
+				return;
+			}
+			WaitForQueue();
+		}
+
+		Put(fd, line);
+		UnlockQueueWakeup();
+	}
+
+	/** Ask the writer thread to fsync the files it has written to
+	 */
+	void RequestSync()
+	{
+		LockQueue();
+		syncrequested = true;
+		UnlockQueueWakeup();
+	}
+
+	/** Wait for the writer thread to write all of the queued lines
+	 */
+	void Flush()
+	{
+		LockQueue();
+		while (used || busy)
+			WaitForQueue();
+		UnlockQueue();
+	}
+
+	/** Stop syncing a file, because it is about to be closed. Flush() must be called first.
+	 * @param fd The file
+	 */
+	void Forget(int fd)
+	{
+		LockQueue();
+		dirtyfds.erase(fd);
+		UnlockQueue();
+	}
+
+	void Run()
+	{
+		while (true)
+		{
+			LockQueue();
+			// Write everything that is left before exiting
+			while (!used && !syncrequested && !GetExitFlag())
+				WaitForQueue();
+			if (!used && !syncrequested)
+			{
+				UnlockQueue();
+				return;
+			}
+
+			// Only the main thread adds lines, and only past the end of this range
+			size_t start = tail;
+			size_t len = std::min(used, ring.size() - tail);
+			std::set<int> syncfds;
+			if (syncrequested)
+			{
+				syncfds.swap(dirtyfds);
+				syncrequested = false;
+			}
+			busy = true;
+			UnlockQueue();
+
+			std::set<int> written;
+			WriteRecords(start, len, written);
+			for (std::set<int>::const_iterator i = syncfds.begin(); i != syncfds.end(); ++i)
+			{
+#ifdef _WIN32
+				_commit(*i);
+#else
+				fsync(*i);
+#endif
+			}
+
+			LockQueue();
+			used -= len;
+			// Lines that fit go at the start of an empty ring instead of after padding
+			tail = (used ? (start + len) % ring.size() : 0);
+			busy = false;
+			dirtyfds.insert(written.begin(), written.end());
+			// Wakes the main thread if it is waiting in Write() or Flush(); it is never waiting when this thread is
+			UnlockQueueWakeup();
+		}
+	}
+};
+
+/** Asks the log writer thread to sync the log files to the disk */
+class LogSyncTimer : public Timer
+{
+	LogWriterThread* const writer;
+
+ public:
+	LogSyncTimer(unsigned int interval, LogWriterThread* thread)
+		: Timer(interval, ServerInstance->Time(), true), writer(thread)
+	{
+	}
+
+	bool Tick(time_t)
+	{
+		writer->RequestSync();
+		return true;
+	}
+};
+
 LogManager::LogManager()
+	: writer(NULL), synctimer(NULL)
 {
 	Logging = false;
 }
 
 LogManager::~LogManager()
 {
+	StopWriter();
+}
+
+void LogManager::StartWriter()
+{
+	ConfigTag* tag = ServerInstance->Config->ConfValue("performance");
+	long size = tag->getInt("logbuffer", 0);
+	if (size <= 0)
+		return;
+
+	// Enough for a burst of long lines
+	if (size < 65536)
+		size = 65536;
+
+	std::string overflow = tag->getString("logoverflow", "drop");
+	writer = new LogWriterThread(size, (overflow == "block"));
+	ServerInstance->Threads->Start(writer);
+
+	long interval = tag->getInt("logsync", 0);
+	if (interval > 0)
+	{
+		synctimer = new LogSyncTimer(interval, writer);
+		ServerInstance->Timers->AddTimer(synctimer);
+	}
+}
+
+void LogManager::StopWriter()
+{
+	if (!writer)
+		return;
+
+	delete synctimer;
+	synctimer = NULL;
+
+	// The thread writes everything it has before exiting
+	writer->join();
+	delete writer;
+	writer = NULL;
 }
 
 void LogManager::OpenFileLogs()
@@ -73,6 +429,7 @@ void LogManager::OpenFileLogs()
 	/* Skip rest of logfile opening if we are running -nolog. */
 	if (!ServerInstance->Config->cmdline.writelog)
 		return;
+	StartWriter();
 	std::map<std::string, FileWriter*> logmap;
 	ConfigTagList tags = ServerInstance->Config->ConfTags("log");
 	for(ConfigIter i = tags.first; i != tags.second; ++i)
@@ -139,6 +496,8 @@ void LogManager::CloseLogs()
 	if (ServerInstance->Config && ServerInstance->Config->cmdline.forcedebug)
 		return;
 
+	StopWriter();
+
 	LogStreams.clear();
 	GlobalLogStreams.clear();
 
@@ -315,7 +674,7 @@ void LogManager::Log(const std::string &type, LogLevel loglevel, const std::stri
 
 
 FileWriter::FileWriter(FILE* logfile)
-: log(logfile), writeops(0)
+: log(logfile), writeops(0), buffered(false)
 {
 }
 
@@ -326,10 +685,28 @@ void FileWriter::WriteLogLine(const std::string &line)
 // XXX: For now, just return. Don't throw an exception. It'd be nice to find out if this is happening, but I'm terrified of breaking so close to final release. -- w00t
 //		throw CoreException("FileWriter::WriteLogLine called with a closed logfile");
 
+	LogWriterThread* writer = ServerInstance->Logs->GetWriter();
+	if (writer && !writer->TooLong(line))
+	{
+		// Anything written before the thread was started has to go out first
+		if (buffered)
+		{
+			fflush(log);
+			buffered = false;
+		}
+		writer->Write(fileno(log), line);
+		return;
+	}
+
+	if (writer)
+		writer->Flush();
+
 	fputs(line.c_str(), log);
+	buffered = true;
 	if (++writeops % 20 == 0)
 	{
 		fflush(log);
+		buffered = false;
 	}
 }
 
@@ -337,6 +714,12 @@ FileWriter::~FileWriter()
 {
 	if (log)
 	{
+		LogWriterThread* writer = ServerInstance->Logs ? ServerInstance->Logs->GetWriter() : NULL;
+		if (writer)
+		{
+			writer->Flush();
+			writer->Forget(fileno(log));
+		}
 		fflush(log);
 		fclose(log);
 		log = NULL;
@@ -168,14 +168,16 @@ void		Module::OnGarbageCollect() { }
 ModResult	Module::OnSetConnectClass(LocalUser* user, ConnectClass* myclass) { return MOD_RES_PASSTHRU; }
 void 		Module::OnText(User*, void*, int, const std::string&, char, CUList&) { }
 void		Module::OnRunTestSuite() { }
+void		Module::OnNamesListFormat(User*, Channel*, unsigned int&) { }
 void		Module::OnNamesListItem(User*, Membership*, std::string&, std::string&) { }
 ModResult	Module::OnNumeric(User*, unsigned int, const std::string&) { return MOD_RES_PASSTHRU; }
 void		Module::OnHookIO(StreamSocket*, ListenSocket*) { }
 ModResult   Module::OnAcceptConnection(int, ListenSocket*, irc::sockets::sockaddrs*, irc::sockets::sockaddrs*) { return MOD_RES_PASSTHRU; }
 void		Module::OnSendWhoLine(User*, const std::vector<std::string>&, User*, std::string&) { }
 void		Module::OnSetUserIP(LocalUser*) { }
+void		Module::OnBufferFlushed(LocalUser*) { }
 
-ModuleManager::ModuleManager() : ModCount(0)
+ModuleManager::ModuleManager() : ModCount(0), ProfileHooks(false)
 {
 }
 
@@ -577,6 +579,65 @@ const std::vector<std::string> ModuleManager::GetAllModuleNames(int filter)
 	return retval;
 }
 
+/** Names of the hooks, in the order of enum Implementation */
+static const char* const HookNames[] = {
+	"", "OnUserConnect", "OnUserQuit", "OnUserDisconnect", "OnUserJoin", "OnUserPart", "OnRehash",
+	"OnSendSnotice", "OnUserPreJoin", "OnUserPreKick", "OnUserKick", "OnOper", "OnInfo", "OnWhois",
+	"OnUserPreInvite", "OnUserInvite", "OnUserPreMessage", "OnUserPreNick", "OnUserMessage",
+	"OnMode", "OnGetServerDescription", "OnSyncUser", "OnSyncChannel", "OnDecodeMetaData",
+	"OnAcceptConnection", "OnUserInit", "OnChangeHost", "OnChangeName", "OnAddLine", "OnDelLine",
+	"OnExpireLine", "OnUserPostNick", "OnPreMode", "On005Numeric", "OnKill", "OnRemoteKill",
+	"OnLoadModule", "OnUnloadModule", "OnBackgroundTimer", "OnPreCommand", "OnCheckReady",
+	"OnCheckInvite", "OnRawMode", "OnCheckKey", "OnCheckLimit", "OnCheckBan", "OnCheckChannelBan",
+	"OnExtBanCheck", "OnStats", "OnChangeLocalUserHost", "OnPreTopicChange", "OnPostTopicChange",
+	"OnEvent", "OnGlobalOper", "OnPostConnect", "OnChangeLocalUserGECOS", "OnUserRegister",
+	"OnChannelPreDelete", "OnChannelDelete", "OnPostOper", "OnSyncNetwork", "OnSetAway",
+	"OnPostCommand", "OnPostJoin", "OnWhoisLine", "OnBuildNeighborList", "OnGarbageCollect",
+	"OnSetConnectClass", "OnText", "OnPassCompare", "OnRunTestSuite", "OnNamesListItem",
+	"OnNumeric", "OnHookIO", "OnPreRehash", "OnModuleRehash", "OnSendWhoLine", "OnChangeIdent",
+	"OnSetUserIP", "OnNamesListFormat", "OnBufferFlushed"
+};
+
+void ModuleManager::ResetHookProfiles()
+{
+	for (std::map<std::string, Module*>::iterator i = Modules.begin(); i != Modules.end(); ++i)
+	{
+		for (int hook = I_BEGIN; hook != I_END; hook++)
+			i->second->profile[hook] = HookProfile();
+	}
+}
+
+const char* ModuleManager::GetHookName(Implementation hook)
+{
+	// Fails to compile if a hook is added to enum Implementation but not to HookNames
+	typedef char HookNamesComplete[(sizeof(HookNames) / sizeof(HookNames[0]) == I_END) ? 1 : -1];
+	(void) sizeof(HookNamesComplete);
+
+	if (hook <= I_BEGIN || hook >= I_END)
+		return "";
+	return HookNames[hook];
+}
+
+unsigned long long ModuleManager::GetHookClock()
+{
+#ifdef _WIN32
+	LARGE_INTEGER now, freq;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&freq);
+	return (now.QuadPart / freq.QuadPart) * 1000000000ULL + (now.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+	#ifdef HAS_CLOCK_GETTIME
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return now.tv_sec * 1000000000ULL + now.tv_nsec;
+	#else
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		return now.tv_sec * 1000000000ULL + now.tv_usec * 1000ULL;
+	#endif
+#endif
+}
+
 FileReader::FileReader(const std::string& filename)
 {
 	Load(filename);
@@ -33,18 +33,80 @@
 /* $LinkerFlags: pkgconflibs("sqlite3","/libsqlite3.so","-lsqlite3") */
 /* $NoPedantic */
 
+/* Queries are run by a worker thread, the same way as in m_mysql: the main thread puts
+ * them on a queue, the worker runs them one at a time and puts the results on a second
+ * queue, and then wakes up the main thread, which hands them to the modules that asked.
+ *
+ * Parameters are bound to prepared statements instead of being escaped into the query
+ * text. Each connection keeps its most recently used prepared statements, so a query
+ * that is run again with different parameters does not have to be compiled again.
+ */
+
 class SQLConn;
+class SQLite3Result;
+class DispatcherThread;
+
+struct QQueueItem
+{
+	SQLQuery* q;
+	std::string query;
+	ParamL params;
+	SQLConn* c;
+	QQueueItem(SQLQuery* Q, const std::string& S, const ParamL& P, SQLConn* C) : q(Q), query(S), params(P), c(C) {}
+};
+
+struct RQueueItem
+{
+	SQLQuery* q;
+	SQLite3Result* r;
+	RQueueItem(SQLQuery* Q, SQLite3Result* R) : q(Q), r(R) {}
+};
+
 typedef std::map<std::string, SQLConn*> ConnMap;
+typedef std::deque<QQueueItem> QueryQueue;
+typedef std::deque<RQueueItem> ResultQueue;
+
+class ModuleSQLite3 : public Module
+{
+ public:
+	DispatcherThread* Dispatcher;
+	QueryQueue qq;       // MUST HOLD MUTEX
+	ResultQueue rq;      // MUST HOLD MUTEX
+	ConnMap conns;       // main thread only
+
+	ModuleSQLite3();
+	void init() CXX11_OVERRIDE;
+	~ModuleSQLite3();
+	void OnRehash(User* user) CXX11_OVERRIDE;
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE;
+	Version GetVersion() CXX11_OVERRIDE;
+};
+
+class DispatcherThread : public SocketThread
+{
+ private:
+	ModuleSQLite3* const Parent;
+ public:
+	DispatcherThread(ModuleSQLite3* CreatorModule) : Parent(CreatorModule) { }
+	~DispatcherThread() { }
+	void Run();
+	void OnNotify();
+};
 
 class SQLite3Result : public SQLResult
 {
  public:
+	SQLerror err;
 	int currentrow;
 	int rows;
 	std::vector<std::string> columns;
 	std::vector<SQLEntries> fieldlists;
 
-	SQLite3Result() : currentrow(0), rows(0)
+	SQLite3Result() : err(SQL_NO_ERROR), currentrow(0), rows(0)
+	{
+	}
+
+	SQLite3Result(const SQLerror& e) : err(e), currentrow(0), rows(0)
 	{
 	}
 
@@ -76,181 +138,465 @@ class SQLite3Result : public SQLResult
 
 class SQLConn : public SQLProvider
 {
+	typedef std::list<std::pair<std::string, sqlite3_stmt*> > StatementList;
+
 	sqlite3* conn;
-	reference<ConfigTag> config;
+
+	/** Prepared statements, most recently used first. Only used by the dispatcher thread,
+	 * or by the main thread while it holds the lock.
+	 */
+	StatementList statements;
+
+	/** Position of each prepared statement in statements, by query */
+	std::map<std::string, StatementList::iterator> statementindex;
+
+	/** Maximum number of prepared statements to keep */
+	size_t maxstatements;
 
  public:
+	reference<ConfigTag> config;
+
+	/** Held by the dispatcher thread while it is running a query on this connection */
+	Mutex lock;
+
 	SQLConn(Module* Parent, ConfigTag* tag) : SQLProvider(Parent, "SQL/" + tag->getString("id")), config(tag)
 	{
+		Configure(tag);
 		std::string host = tag->getString("hostname");
 		if (sqlite3_open_v2(host.c_str(), &conn, SQLITE_OPEN_READWRITE, 0) != SQLITE_OK)
 		{
 			ServerInstance->Logs->Log("m_sqlite3", LOG_DEFAULT, "WARNING: Could not open DB with id: " + tag->getString("id"));
+			sqlite3_close(conn);
 			conn = NULL;
 		}
 	}
 
 	~SQLConn()
 	{
-		sqlite3_interrupt(conn);
+		for (StatementList::iterator i = statements.begin(); i != statements.end(); ++i)
+			sqlite3_finalize(i->second);
 		sqlite3_close(conn);
 	}
 
-	void Query(SQLQuery* query, const std::string& q)
+	/** Apply the settings that do not need the database to be opened again
+	 * @param tag The database tag of this connection
+	 */
+	void Configure(ConfigTag* tag)
+	{
+		lock.Lock();
+		config = tag;
+		// The statement being run is always in the cache
+		maxstatements = std::max(tag->getInt("cachesize", 32), 1L);
+		TrimStatements();
+		lock.Unlock();
+	}
+
+	/** Finalize the least recently used prepared statements over the limit */
+	void TrimStatements()
+	{
+		while (statements.size() > maxstatements)
+		{
+			statementindex.erase(statements.back().first);
+			sqlite3_finalize(statements.back().second);
+			statements.pop_back();
+		}
+	}
+
+	ModuleSQLite3* Parent()
 	{
-		SQLite3Result res;
-		sqlite3_stmt *stmt;
-		int err = sqlite3_prepare_v2(conn, q.c_str(), q.length(), &stmt, NULL);
-		if (err != SQLITE_OK)
+		return (ModuleSQLite3*)(Module*)creator;
+	}
+
+	/** Get the prepared statement for a query, compiling it if it is not in the cache
+	 * @return The statement, or NULL if the query could not be compiled
+	 */
+	sqlite3_stmt* Prepare(const std::string& q)
+	{
+		std::map<std::string, StatementList::iterator>::iterator cached = statementindex.find(q);
+		if (cached != statementindex.end())
 		{
-			SQLerror error(SQL_QSEND_FAIL, sqlite3_errmsg(conn));
-			query->OnError(error);
-			return;
+			statements.splice(statements.begin(), statements, cached->second);
+			return cached->second->second;
 		}
+
+		sqlite3_stmt* stmt;
+		if (sqlite3_prepare_v2(conn, q.c_str(), q.length(), &stmt, NULL) != SQLITE_OK)
+			return NULL;
+
+		statements.push_front(std::make_pair(q, stmt));
+		statementindex[q] = statements.begin();
+		TrimStatements();
+		return stmt;
+	}
+
+	SQLite3Result* DoBlockingQuery(const std::string& q, const ParamL& params)
+	{
+		if (!conn)
+			return new SQLite3Result(SQLerror(SQL_BAD_CONN));
+
+		sqlite3_stmt* stmt = Prepare(q);
+		if (!stmt)
+			return new SQLite3Result(SQLerror(SQL_QSEND_FAIL, sqlite3_errmsg(conn)));
+
+		for (unsigned int i = 0; i < params.size(); i++)
+			sqlite3_bind_text(stmt, i + 1, params[i].data(), params[i].length(), SQLITE_TRANSIENT);
+
+		SQLite3Result* res = new SQLite3Result;
 		int cols = sqlite3_column_count(stmt);
-		res.columns.resize(cols);
+		res->columns.resize(cols);
 		for(int i=0; i < cols; i++)
 		{
-			res.columns[i] = sqlite3_column_name(stmt, i);
+			res->columns[i] = sqlite3_column_name(stmt, i);
 		}
 		while (1)
 		{
-			err = sqlite3_step(stmt);
+			int err = sqlite3_step(stmt);
 			if (err == SQLITE_ROW)
 			{
 				// Add the row
-				res.fieldlists.resize(res.rows + 1);
-				res.fieldlists[res.rows].resize(cols);
+				res->fieldlists.resize(res->rows + 1);
+				res->fieldlists[res->rows].resize(cols);
 				for(int i=0; i < cols; i++)
 				{
 					const char* txt = (const char*)sqlite3_column_text(stmt, i);
 					if (txt)
-						res.fieldlists[res.rows][i] = SQLEntry(txt);
+						res->fieldlists[res->rows][i] = SQLEntry(txt);
 				}
-				res.rows++;
+				res->rows++;
 			}
 			else if (err == SQLITE_DONE)
 			{
-				query->OnResult(res);
 				break;
 			}
 			else
 			{
-				SQLerror error(SQL_QREPLY_FAIL, sqlite3_errmsg(conn));
-				query->OnError(error);
+				res->err = SQLerror(SQL_QREPLY_FAIL, sqlite3_errmsg(conn));
 				break;
 			}
 		}
-		sqlite3_finalize(stmt);
-	}
-
-	void submit(SQLQuery* query, const std::string& q)
-	{
-		Query(query, q);
-		delete query;
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+		return res;
 	}
 
-	void submit(SQLQuery* query, const std::string& q, const ParamL& p)
+	/** Turn a query with '?' or '$name' parameters into one for sqlite3_prepare_v2().
+	 *
+	 * Queries written for the other SQL modules put quotes around their parameters, as
+	 * those modules escape the parameters into the text of the query. A parameter that
+	 * fills a whole string literal ('$nick') becomes a plain '?', and one that is part of
+	 * a string literal ('%$nick%') becomes a concatenation ('%' || ? || '%').
+	 * @param q The query
+	 * @param mark The character that starts a parameter, '?' or '$'
+	 * @param list Parameters for '?', in order
+	 * @param map Parameters for '$name', by name
+	 * @param out The query with a '?' for each parameter
+	 * @param values The values to bind to the parameters in out, in order
+	 */
+	static void ParseQuery(const std::string& q, char mark, const ParamL* list, const ParamM* map, std::string& out, ParamL& values)
 	{
-		std::string res;
+		// Pieces of the string literal being read, and whether each is a parameter
+		std::vector<std::pair<std::string, bool> > pieces;
+		bool inliteral = false;
 		unsigned int param = 0;
-		for(std::string::size_type i = 0; i < q.length(); i++)
+
+		for (std::string::size_type i = 0; i < q.length(); i++)
 		{
-			if (q[i] != '?')
-				res.push_back(q[i]);
-			else
+			if (q[i] == mark)
+			{
+				std::string value;
+				if (list)
+				{
+					if (param < list->size())
+						value = (*list)[param++];
+				}
+				else
+				{
+					std::string field;
+					while (i + 1 < q.length() && isalnum(q[i + 1]))
+						field.push_back(q[++i]);
+
+					ParamM::const_iterator it = map->find(field);
+					if (it != map->end())
+						value = it->second;
+				}
+				values.push_back(value);
+
+				if (inliteral)
+					pieces.push_back(std::make_pair(std::string(), true));
+				else
+					out.push_back('?');
+			}
+			else if (!inliteral)
 			{
-				if (param < p.size())
+				if (q[i] == '\'')
 				{
-					char* escaped = sqlite3_mprintf("%q", p[param++].c_str());
-					res.append(escaped);
-					sqlite3_free(escaped);
+					inliteral = true;
+					pieces.clear();
+					pieces.push_back(std::make_pair(std::string(), false));
 				}
+				else
+					out.push_back(q[i]);
+			}
+			else if (q[i] == '\'' && (i + 1 == q.length() || q[i + 1] != '\''))
+			{
+				inliteral = false;
+				AppendLiteral(pieces, out);
+			}
+			else
+			{
+				// A doubled quote is a quote inside the literal; keep it as it is
+				if (pieces.back().second)
+					pieces.push_back(std::make_pair(std::string(), false));
+				pieces.back().first.push_back(q[i]);
+				if (q[i] == '\'')
+					pieces.back().first.push_back(q[++i]);
 			}
 		}
-		submit(query, res);
+
+		if (inliteral)
+			AppendLiteral(pieces, out);
 	}
 
-	void submit(SQLQuery* query, const std::string& q, const ParamM& p)
+	/** Write a string literal which may contain parameters, see ParseQuery() */
+	static void AppendLiteral(const std::vector<std::pair<std::string, bool> >& pieces, std::string& out)
 	{
-		std::string res;
-		for(std::string::size_type i = 0; i < q.length(); i++)
+		std::vector<std::string> terms;
+		bool hasparam = false;
+		for (std::vector<std::pair<std::string, bool> >::const_iterator i = pieces.begin(); i != pieces.end(); ++i)
 		{
-			if (q[i] != '$')
-				res.push_back(q[i]);
-			else
+			if (i->second)
 			{
-				std::string field;
-				i++;
-				while (i < q.length() && isalnum(q[i]))
-					field.push_back(q[i++]);
-				i--;
-
-				ParamM::const_iterator it = p.find(field);
-				if (it != p.end())
-				{
-					char* escaped = sqlite3_mprintf("%q", it->second.c_str());
-					res.append(escaped);
-					sqlite3_free(escaped);
-				}
+				terms.push_back("?");
+				hasparam = true;
+			}
+			else if (!i->first.empty())
+				terms.push_back("'" + i->first + "'");
+		}
+
+		if (!hasparam)
+			out.append("'" + (pieces.empty() ? std::string() : pieces.front().first) + "'");
+		else if (terms.size() == 1)
+			out.append(terms.front());
+		else
+		{
+			out.push_back('(');
+			for (std::vector<std::string>::const_iterator i = terms.begin(); i != terms.end(); ++i)
+			{
+				if (i != terms.begin())
+					out.append(" || ");
+				out.append(*i);
 			}
+			out.push_back(')');
 		}
-		submit(query, res);
+	}
+
+	/** Queue a query for the dispatcher thread
+	 * @param query The query to report the result to
+	 * @param q The query text, with a '?' for each value
+	 * @param values The values to bind
+	 */
+	void Enqueue(SQLQuery* query, const std::string& q, const ParamL& values)
+	{
+		Parent()->Dispatcher->LockQueue();
+		Parent()->qq.push_back(QQueueItem(query, q, values, this));
+		Parent()->Dispatcher->UnlockQueueWakeup();
+	}
+
+	void submit(SQLQuery* query, const std::string& q)
+	{
+		Enqueue(query, q, ParamL());
+	}
+
+	void submit(SQLQuery* query, const std::string& q, const ParamL& p)
+	{
+		std::string res;
+		ParamL values;
+		ParseQuery(q, '?', &p, NULL, res, values);
+		Enqueue(query, res, values);
+	}
+
+	void submit(SQLQuery* query, const std::string& q, const ParamM& p)
+	{
+		std::string res;
+		ParamL values;
+		ParseQuery(q, '$', NULL, &p, res, values);
+		Enqueue(query, res, values);
 	}
 };
 
-class ModuleSQLite3 : public Module
+ModuleSQLite3::ModuleSQLite3()
 {
-	ConnMap conns;
+	Dispatcher = NULL;
+}
 
- public:
-	void init() CXX11_OVERRIDE
-	{
-		ReadConf();
+void ModuleSQLite3::init()
+{
+	Dispatcher = new DispatcherThread(this);
+	ServerInstance->Threads->Start(Dispatcher);
 
-		Implementation eventlist[] = { I_OnRehash };
-		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+	Implementation eventlist[] = { I_OnRehash, I_OnUnloadModule };
+	ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+
+	OnRehash(NULL);
+}
+
+ModuleSQLite3::~ModuleSQLite3()
+{
+	if (Dispatcher)
+	{
+		Dispatcher->join();
+		Dispatcher->OnNotify();
+		delete Dispatcher;
 	}
+	for(ConnMap::iterator i = conns.begin(); i != conns.end(); i++)
+	{
+		delete i->second;
+	}
+}
 
-	~ModuleSQLite3()
+void ModuleSQLite3::OnRehash(User* user)
+{
+	ConnMap newconns;
+	ConfigTagList tags = ServerInstance->Config->ConfTags("database");
+	for(ConfigIter i = tags.first; i != tags.second; i++)
 	{
-		ClearConns();
+		if (i->second->getString("module", "sqlite") != "sqlite")
+			continue;
+		std::string id = i->second->getString("id");
+		ConnMap::iterator curr = conns.find(id);
+		if (curr == conns.end() || curr->second->config->getString("hostname") != i->second->getString("hostname"))
+		{
+			SQLConn* conn = new SQLConn(this, i->second);
+			newconns.insert(std::make_pair(id, conn));
+			ServerInstance->Modules->AddService(*conn);
+		}
+		else
+		{
+			curr->second->Configure(i->second);
+			newconns.insert(*curr);
+			conns.erase(curr);
+		}
 	}
 
-	void ClearConns()
+	// now clean up the deleted databases
+	Dispatcher->LockQueue();
+	SQLerror err(SQL_BAD_DBID);
+	for(ConnMap::iterator i = conns.begin(); i != conns.end(); i++)
 	{
-		for(ConnMap::iterator i = conns.begin(); i != conns.end(); i++)
+		ServerInstance->Modules->DelService(*i->second);
+		// it might be running a query on this database. Wait for that to complete
+		i->second->lock.Lock();
+		i->second->lock.Unlock();
+		// now remove all active queries to this DB
+		for (QueryQueue::iterator j = qq.begin(); j != qq.end(); )
 		{
-			SQLConn* conn = i->second;
-			ServerInstance->Modules->DelService(*conn);
-			delete conn;
+			if (j->c == i->second)
+			{
+				j->q->OnError(err);
+				delete j->q;
+				j = qq.erase(j);
+			}
+			else
+				++j;
 		}
-		conns.clear();
+		// finally, nuke the connection
+		delete i->second;
 	}
+	Dispatcher->UnlockQueue();
+	conns.swap(newconns);
+}
 
-	void ReadConf()
+void ModuleSQLite3::OnUnloadModule(Module* mod)
+{
+	SQLerror err(SQL_BAD_DBID);
+	Dispatcher->LockQueue();
+	unsigned int i = qq.size();
+	while (i > 0)
 	{
-		ClearConns();
-		ConfigTagList tags = ServerInstance->Config->ConfTags("database");
-		for(ConfigIter i = tags.first; i != tags.second; i++)
+		i--;
+		if (qq[i].q->creator == mod)
 		{
-			if (i->second->getString("module", "sqlite") != "sqlite")
-				continue;
-			SQLConn* conn = new SQLConn(this, i->second);
-			conns.insert(std::make_pair(i->second->getString("id"), conn));
-			ServerInstance->Modules->AddService(*conn);
+			if (i == 0)
+			{
+				// need to wait until the query is done
+				// (the result will be discarded)
+				qq[i].c->lock.Lock();
+				qq[i].c->lock.Unlock();
+			}
+			qq[i].q->OnError(err);
+			delete qq[i].q;
+			qq.erase(qq.begin() + i);
 		}
 	}
+	Dispatcher->UnlockQueue();
+	// clean up any result queue entries
+	Dispatcher->OnNotify();
+}
 
-	void OnRehash(User* user) CXX11_OVERRIDE
+Version ModuleSQLite3::GetVersion()
+{
+	return Version("sqlite3 provider", VF_VENDOR);
+}
+
+void DispatcherThread::Run()
+{
+	this->LockQueue();
+	while (!this->GetExitFlag())
 	{
-		ReadConf();
+		if (!Parent->qq.empty())
+		{
+			QQueueItem i = Parent->qq.front();
+			i.c->lock.Lock();
+			this->UnlockQueue();
+			SQLite3Result* res = i.c->DoBlockingQuery(i.query, i.params);
+			i.c->lock.Unlock();
+
+			/*
+			 * At this point, the main thread could be working on:
+			 *  Rehash - delete i.c out from under us. We don't care about that.
+			 *  UnloadModule - delete i.q and the qq item. Need to avoid reporting results.
+			 */
+
+			this->LockQueue();
+			if (!Parent->qq.empty() && Parent->qq.front().q == i.q)
+			{
+				Parent->qq.pop_front();
+				Parent->rq.push_back(RQueueItem(i.q, res));
+				NotifyParent();
+			}
+			else
+			{
+				// UnloadModule ate the query
+				delete res;
+			}
+		}
+		else
+		{
+			/* We know the queue is empty, we can safely hang this thread until
+			 * something happens
+			 */
+			this->WaitForQueue();
+		}
 	}
+	this->UnlockQueue();
+}
 
-	Version GetVersion() CXX11_OVERRIDE
+void DispatcherThread::OnNotify()
+{
+	// this could unlock during the dispatch, but OnResult isn't expected to take that long
+	this->LockQueue();
+	for(ResultQueue::iterator i = Parent->rq.begin(); i != Parent->rq.end(); i++)
 	{
-		return Version("sqlite3 provider", VF_VENDOR);
+		SQLite3Result* res = i->r;
+		if (res->err.id == SQL_NO_ERROR)
+			i->q->OnResult(*res);
+		else
+			i->q->OnError(res->err);
+		delete i->q;
+		delete i->r;
 	}
-};
+	Parent->rq.clear();
+	this->UnlockQueue();
+}
 
 MODULE_INIT(ModuleSQLite3)
@@ -164,6 +164,10 @@ class CommandStartTLS : public SplitCommand
 		{
 			if (!user->eh.GetIOHook())
 			{
+				/* An I/O thread reading this socket would take the handshake away from us,
+				 * so move it back to the main thread before the client is told to go ahead.
+				 */
+				ServerInstance->IOThreads->DetachSocket(&user->eh);
 				user->WriteNumeric(670, "%s :STARTTLS successful, go ahead with TLS handshake", user->nick.c_str());
 				/* We need to flush the write buffer prior to adding the IOHook,
 				 * otherwise we'll be sending this line inside the SSL session - which
@@ -33,8 +33,18 @@
 #include "inspircd.h"
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+# include <openssl/core_names.h>
+#endif
 #include "modules/ssl.h"
 
+#ifndef _WIN32
+# include <fcntl.h>
+# include <poll.h>
+#endif
+
 #ifdef _WIN32
 # pragma comment(lib, "libcrypto.lib")
 # pragma comment(lib, "libssl.lib")
@@ -58,8 +68,6 @@
 
 enum issl_status { ISSL_NONE, ISSL_HANDSHAKING, ISSL_OPEN };
 
-static bool SelfSigned = false;
-
 char* get_error()
 {
 	return ERR_error_string(ERR_get_error(), NULL);
@@ -67,6 +75,74 @@ char* get_error()
 
 static int error_callback(const char *str, size_t len, void *u);
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && !defined _WIN32
+/** Before 1.1.0, OpenSSL is only safe to use from more than one thread at a time if
+ * the application gives it locks and a way to tell threads apart. These are installed
+ * while there are handshake threads.
+ */
+class LockCallbacks
+{
+	static Mutex* locks;
+
+	static void OnLock(int mode, int n, const char* file, int line)
+	{
+		if (mode & CRYPTO_LOCK)
+			locks[n].Lock();
+		else
+			locks[n].Unlock();
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+	static void OnThreadId(CRYPTO_THREADID* id)
+	{
+		// errno is thread local, so its address is unique to each thread
+		CRYPTO_THREADID_set_pointer(id, &errno);
+	}
+#else
+	static unsigned long OnThreadId()
+	{
+		return (unsigned long)pthread_self();
+	}
+#endif
+
+ public:
+	/** Install the callbacks, unless someone else in the process already has */
+	static void Install()
+	{
+		if (locks || CRYPTO_get_locking_callback())
+			return;
+
+		locks = new Mutex[CRYPTO_num_locks()];
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+		CRYPTO_THREADID_set_callback(OnThreadId);
+#else
+		CRYPTO_set_id_callback(OnThreadId);
+#endif
+		CRYPTO_set_locking_callback(OnLock);
+	}
+
+	/** Remove the callbacks if they were installed by Install(); no other threads may be using OpenSSL */
+	static void Remove()
+	{
+		if (!locks)
+			return;
+
+		CRYPTO_set_locking_callback(NULL);
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+		CRYPTO_THREADID_set_callback(NULL);
+#else
+		CRYPTO_set_id_callback(NULL);
+#endif
+		delete[] locks;
+		locks = NULL;
+	}
+};
+
+Mutex* LockCallbacks::locks = NULL;
+#endif
+
+class HandshakeJob;
+
 /** Represents an SSL user's extra data
  */
 class issl_session
@@ -79,10 +155,14 @@ public:
 	bool outbound;
 	bool data_to_write;
 
+	/** The handshake job owning sess while the handshake runs in a thread, or NULL */
+	HandshakeJob* job;
+
 	issl_session()
 	{
 		outbound = false;
 		data_to_write = false;
+		job = NULL;
 	}
 };
 
@@ -92,14 +172,421 @@ static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
 	 * In the future if we want an option to not allow this,
 	 * we can just return preverify_ok here, and openssl
 	 * will boot off self-signed and invalid peer certs.
+	 *
+	 * Whether the certificate is self signed is taken from the verify
+	 * result when the handshake is done, as that is also kept in resumed
+	 * sessions, where this is never called.
 	 */
-	int ve = X509_STORE_CTX_get_error(ctx);
+	return 1;
+}
+
+/** The MAC of session tickets is set up through EVP_MAC from OpenSSL 3.0 on, as the HMAC functions are deprecated there */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX TicketMacCtx;
+
+static bool InitTicketMac(EVP_MAC_CTX* mctx, const unsigned char* key, size_t keylen)
+{
+	OSSL_PARAM params[2];
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0);
+	params[1] = OSSL_PARAM_construct_end();
+	return EVP_MAC_init(mctx, key, keylen, params) == 1;
+}
+#else
+typedef HMAC_CTX TicketMacCtx;
+
+static bool InitTicketMac(HMAC_CTX* hctx, const unsigned char* key, size_t keylen)
+{
+	return HMAC_Init_ex(hctx, key, keylen, EVP_sha256(), NULL) != 0;
+}
+#endif
+
+/** Keys used to encrypt and decrypt session tickets.
+ * A new key is made on every rehash. Tickets made with the key before it are
+ * still accepted, and replaced with a ticket under the new key, so a rehash
+ * does not send every returning client back to a full handshake.
+ */
+class TicketKeys
+{
+	struct Key
+	{
+		unsigned char name[16];
+		unsigned char aes[32];
+		unsigned char hmac[32];
+	};
+
+	/** Guards everything here; tickets may be handled in a handshake thread */
+	Mutex lock;
+
+	/** The current key, and the one from before the last rehash */
+	Key keys[2];
+
+	/** Number of valid entries in keys */
+	unsigned int count;
+
+	/** Number of tickets accepted */
+	unsigned long accepted;
+
+ public:
+	TicketKeys() : count(0), accepted(0) { }
 
-	SelfSigned = (ve == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT);
+	/** Make a new current key, keeping the old one for decryption only */
+	bool Rotate()
+	{
+		Key key;
+		if (RAND_bytes(key.name, sizeof(key.name)) != 1 || RAND_bytes(key.aes, sizeof(key.aes)) != 1 ||
+			RAND_bytes(key.hmac, sizeof(key.hmac)) != 1)
+			return false;
+
+		lock.Lock();
+		keys[1] = keys[0];
+		keys[0] = key;
+		count = std::min(count + 1, 2U);
+		lock.Unlock();
+		return true;
+	}
+
+	unsigned long GetAccepted()
+	{
+		lock.Lock();
+		unsigned long ret = accepted;
+		lock.Unlock();
+		return ret;
+	}
 
+	/** Called by OpenSSL to set up the encryption or decryption of a ticket
+	 * @return For decryption 0 to do a full handshake, 1 if the ticket is good,
+	 * and 2 if it is good but should be renewed; for encryption 1, or -1 on error
+	 */
+	int Process(unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* ectx, TicketMacCtx* mctx, int enc)
+	{
+		int ret = 0;
+		lock.Lock();
+		if (enc)
+		{
+			if (count && RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) == 1)
+			{
+				memcpy(name, keys[0].name, sizeof(keys[0].name));
+				EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, keys[0].aes, iv);
+				ret = (InitTicketMac(mctx, keys[0].hmac, sizeof(keys[0].hmac)) ? 1 : -1);
+			}
+			else
+				ret = -1;
+		}
+		else
+		{
+			for (unsigned int i = 0; i < count; i++)
+			{
+				if (memcmp(name, keys[i].name, sizeof(keys[i].name)))
+					continue;
+
+				if (!InitTicketMac(mctx, keys[i].hmac, sizeof(keys[i].hmac)))
+					break;
+				EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, keys[i].aes, iv);
+				accepted++;
+				ret = (i == 0 ? 1 : 2);
+				break;
+			}
+		}
+		lock.Unlock();
+		return ret;
+	}
+};
+
+static TicketKeys ticketkeys;
+
+static int OnTicketKey(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* ectx, TicketMacCtx* mctx, int enc)
+{
+	return ticketkeys.Process(name, iv, ectx, mctx, enc);
+}
+
+/** Sessions from outgoing (server link) connections, by remote address,
+ * so reconnecting to a server can resume the previous session.
+ */
+class ClientSessionCache
+{
+	/** Guards sessions; new sessions may arrive in a handshake thread */
+	Mutex lock;
+
+	std::map<std::string, SSL_SESSION*> sessions;
+
+	static std::string GetPeer(int fd)
+	{
+		irc::sockets::sockaddrs sa;
+		socklen_t len = sizeof(sa);
+		if (getpeername(fd, &sa.sa, &len))
+			return "";
+		return sa.str();
+	}
+
+ public:
+	~ClientSessionCache()
+	{
+		Clear();
+	}
+
+	/** Offer the last session with the same peer, if any, for resumption */
+	void Resume(SSL* sess, int fd)
+	{
+		std::string peer = GetPeer(fd);
+		lock.Lock();
+		std::map<std::string, SSL_SESSION*>::iterator i = sessions.find(peer);
+		if (i != sessions.end())
+			SSL_set_session(sess, i->second);
+		lock.Unlock();
+	}
+
+	/** Remember a new session; takes over the reference to it */
+	void Store(SSL* sess, SSL_SESSION* session)
+	{
+		std::string peer = GetPeer(SSL_get_fd(sess));
+		lock.Lock();
+		SSL_SESSION*& entry = sessions[peer];
+		if (entry)
+			SSL_SESSION_free(entry);
+		entry = session;
+		lock.Unlock();
+	}
+
+	void Clear()
+	{
+		lock.Lock();
+		for (std::map<std::string, SSL_SESSION*>::iterator i = sessions.begin(); i != sessions.end(); ++i)
+			SSL_SESSION_free(i->second);
+		sessions.clear();
+		lock.Unlock();
+	}
+};
+
+static ClientSessionCache clientsessions;
+
+static int OnNewClientSession(SSL* ssl, SSL_SESSION* session)
+{
+	clientsessions.Store(ssl, session);
 	return 1;
 }
 
+#ifndef _WIN32
+class ModuleSSLOpenSSL;
+
+/** A handshake being run by a HandshakeThread.
+ * While a job exists, the thread owns the SSL session; the main thread only
+ * touches the job with the lock held, to cancel it when the socket closes.
+ */
+class HandshakeJob
+{
+ public:
+	/** Held by the thread around each step of the handshake */
+	Mutex lock;
+
+	/** Set by the main thread if the socket was closed. Guarded by lock */
+	bool cancelled;
+
+	/** The session the handshake is for, sess is owned by the job until it is done */
+	issl_session* const session;
+	SSL* const sess;
+	const int fd;
+
+	/** The socket being hooked; only used by the main thread, and only if not cancelled */
+	StreamSocket* const sock;
+
+	/** poll() events the handshake is waiting for, 0 to try right away */
+	short events;
+
+	/** True if the handshake completed, false if it failed */
+	bool success;
+
+	HandshakeJob(issl_session* s, StreamSocket* user)
+		: cancelled(false), session(s), sess(s->sess), fd(user->GetFd()), sock(user), events(0), success(false)
+	{
+	}
+
+	/** Run the handshake as far as it will go without blocking
+	 * @return True if the handshake finished, either way
+	 */
+	bool Step()
+	{
+		int ret = session->outbound ? SSL_connect(sess) : SSL_accept(sess);
+		if (ret > 0)
+		{
+			success = true;
+			return true;
+		}
+
+		if (ret < 0)
+		{
+			int err = SSL_get_error(sess, ret);
+			if (err == SSL_ERROR_WANT_READ)
+			{
+				events = POLLIN;
+				return false;
+			}
+			if (err == SSL_ERROR_WANT_WRITE)
+			{
+				events = POLLOUT;
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+/** Runs SSL handshakes in a separate thread, so a burst of new SSL
+ * connections does not stall the main thread with key exchanges.
+ */
+class HandshakeThread : public SocketThread
+{
+	ModuleSSLOpenSSL* const mod;
+
+	/** Pipe used to wake the thread up from poll() when a job is added */
+	int wakeup[2];
+
+	/** New jobs from the main thread. Guarded by the queue lock */
+	std::vector<HandshakeJob*> incoming;
+
+	/** Finished jobs for the main thread. Guarded by the queue lock */
+	std::vector<HandshakeJob*> finished;
+
+	/** Jobs being worked on; only used by the thread */
+	std::vector<HandshakeJob*> active;
+
+ public:
+	HandshakeThread(ModuleSSLOpenSSL* Mod) : mod(Mod)
+	{
+		if (pipe(wakeup))
+			throw ModuleException("Could not create handshake thread wakeup pipe: " + std::string(strerror(errno)));
+		fcntl(wakeup[0], F_SETFL, O_NONBLOCK);
+		fcntl(wakeup[1], F_SETFL, O_NONBLOCK);
+	}
+
+	~HandshakeThread()
+	{
+		for (std::vector<HandshakeJob*>::iterator i = active.begin(); i != active.end(); ++i)
+		{
+			SSL_free((*i)->sess);
+			delete *i;
+		}
+		for (std::vector<HandshakeJob*>::iterator i = incoming.begin(); i != incoming.end(); ++i)
+		{
+			SSL_free((*i)->sess);
+			delete *i;
+		}
+		close(wakeup[0]);
+		close(wakeup[1]);
+	}
+
+	/** Hand a handshake to this thread. Called in the main thread. */
+	void AddJob(HandshakeJob* job)
+	{
+		LockQueue();
+		incoming.push_back(job);
+		UnlockQueue();
+		Wakeup();
+	}
+
+	void Wakeup()
+	{
+		char c = 0;
+		if (write(wakeup[1], &c, 1) < 0)
+		{
+			// The pipe is full, so the thread will wake up anyway
+		}
+	}
+
+	void SetExitFlag()
+	{
+		SocketThread::SetExitFlag();
+		Wakeup();
+	}
+
+	void Run()
+	{
+		std::vector<pollfd> fds;
+		std::vector<HandshakeJob*> done;
+
+		while (!GetExitFlag())
+		{
+			LockQueue();
+			active.insert(active.end(), incoming.begin(), incoming.end());
+			incoming.clear();
+			UnlockQueue();
+
+			bool ready = false;
+			fds.resize(active.size() + 1);
+			fds[0].fd = wakeup[0];
+			fds[0].events = POLLIN;
+			fds[0].revents = 0;
+			for (size_t i = 0; i < active.size(); i++)
+			{
+				fds[i + 1].fd = active[i]->fd;
+				fds[i + 1].events = active[i]->events;
+				fds[i + 1].revents = 0;
+				if (!active[i]->events)
+					ready = true;
+			}
+
+			if (poll(&fds[0], fds.size(), ready ? 0 : 1000) < 0)
+				continue;
+
+			if (fds[0].revents)
+			{
+				char buf[64];
+				while (read(wakeup[0], buf, sizeof(buf)) > 0);
+			}
+
+			for (size_t i = 0; i < active.size(); )
+			{
+				HandshakeJob* job = active[i];
+				bool finish = false;
+
+				job->lock.Lock();
+				if (job->cancelled)
+				{
+					// The socket is gone, and its fd may have been reused already
+					job->lock.Unlock();
+					SSL_free(job->sess);
+					delete job;
+					finish = true;
+				}
+				else if (!job->events || fds[i + 1].revents)
+				{
+					finish = job->Step();
+					job->lock.Unlock();
+					if (finish)
+						done.push_back(job);
+				}
+				else
+				{
+					job->lock.Unlock();
+				}
+
+				if (finish)
+				{
+					// Order does not matter, so fill the gap with the last job
+					active[i] = active.back();
+					active.pop_back();
+					fds[i + 1] = fds[active.size() + 1];
+				}
+				else
+				{
+					i++;
+				}
+			}
+
+			if (!done.empty())
+			{
+				LockQueue();
+				finished.insert(finished.end(), done.begin(), done.end());
+				UnlockQueue();
+				done.clear();
+				NotifyParent();
+			}
+		}
+	}
+
+	void OnNotify();
+};
+#endif
+
 class ModuleSSLOpenSSL : public Module
 {
 	issl_session* sessions;
@@ -111,6 +598,86 @@ class ModuleSSLOpenSSL : public Module
 	bool use_sha;
 
 	ServiceProvider iohook;
+
+	/** Completed handshakes, by [outbound][resumed] */
+	unsigned long handshakes[2][2];
+
+	/** Count a completed handshake for /STATS t */
+	void CountHandshake(issl_session* session)
+	{
+		handshakes[session->outbound ? 1 : 0][SSL_session_reused(session->sess) ? 1 : 0]++;
+	}
+
+	/** Apply the session cache and ticket settings, and start a new ticket key */
+	void ConfigureSessions()
+	{
+		ConfigTag* conf = ServerInstance->Config->ConfValue("openssl");
+		long cachesize = conf->getInt("sessioncache", 20480);
+		long timeout = conf->getInt("sessiontimeout", 300);
+
+		// Sessions are only resumed in the context they were made in; required because we ask for client certificates
+		SSL_CTX_set_session_id_context(ctx, reinterpret_cast<const unsigned char*>("inspircd"), 8);
+		if (cachesize > 0)
+		{
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+			SSL_CTX_sess_set_cache_size(ctx, cachesize);
+		}
+		else
+		{
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+		}
+		SSL_CTX_set_timeout(ctx, timeout);
+		SSL_CTX_set_timeout(clictx, timeout);
+
+		if (conf->getBool("tickets", true) && ticketkeys.Rotate())
+		{
+			SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, OnTicketKey);
+#else
+			SSL_CTX_set_tlsext_ticket_key_cb(ctx, OnTicketKey);
+#endif
+		}
+		else
+		{
+			SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+		}
+	}
+
+#ifndef _WIN32
+	/** Threads running handshakes, empty if handshakes are done in the main thread */
+	std::vector<HandshakeThread*> threads;
+
+	/** Index of the thread the next handshake goes to */
+	unsigned int nextthread;
+
+	/** Hand the handshake of a new session to one of the handshake threads */
+	void StartHandshake(StreamSocket* user, issl_session* session)
+	{
+		session->status = ISSL_HANDSHAKING;
+		session->job = new HandshakeJob(session, user);
+
+		// The thread does all the I/O until the handshake is done
+		ServerInstance->SE->ChangeEventMask(user, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+
+		threads[nextthread]->AddJob(session->job);
+		nextthread = (nextthread + 1) % threads.size();
+	}
+
+	void StopThreads()
+	{
+		for (std::vector<HandshakeThread*>::iterator i = threads.begin(); i != threads.end(); ++i)
+			(*i)->SetExitFlag();
+		for (std::vector<HandshakeThread*>::iterator i = threads.begin(); i != threads.end(); ++i)
+		{
+			(*i)->join();
+			// Pick up anything finished after the last notification
+			(*i)->OnNotify();
+			delete *i;
+		}
+		threads.clear();
+	}
+#endif
  public:
 
 	ModuleSSLOpenSSL() : iohook(this, "ssl/openssl", SERVICE_IOHOOK)
@@ -132,13 +699,36 @@ class ModuleSSLOpenSSL : public Module
 
 		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE, OnVerify);
 		SSL_CTX_set_verify(clictx, SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE, OnVerify);
+
+		// Sessions of outgoing connections are kept in our own cache, by address
+		SSL_CTX_set_session_cache_mode(clictx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(clictx, OnNewClientSession);
+
+		memset(handshakes, 0, sizeof(handshakes));
 	}
 
 	void init() CXX11_OVERRIDE
 	{
 		// Needs the flag as it ignores a plain /rehash
 		OnModuleRehash(NULL,"ssl");
-		Implementation eventlist[] = { I_On005Numeric, I_OnRehash, I_OnModuleRehash, I_OnHookIO, I_OnUserConnect };
+
+#ifndef _WIN32
+		// Only read on load, the threads can't be changed with live sessions in them
+		nextthread = 0;
+		unsigned int count = ServerInstance->Config->ConfValue("openssl")->getInt("handshakethreads");
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		if (count)
+			LockCallbacks::Install();
+#endif
+		for (unsigned int i = 0; i < count && i < 64; i++)
+		{
+			HandshakeThread* thread = new HandshakeThread(this);
+			ServerInstance->Threads->Start(thread);
+			threads.push_back(thread);
+		}
+#endif
+
+		Implementation eventlist[] = { I_On005Numeric, I_OnRehash, I_OnModuleRehash, I_OnHookIO, I_OnUserConnect, I_OnStats };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 		ServerInstance->Modules->AddService(iohook);
 	}
@@ -154,6 +744,8 @@ class ModuleSSLOpenSSL : public Module
 
 	void OnRehash(User* user) CXX11_OVERRIDE
 	{
+		ConfigureSessions();
+
 		sslports.clear();
 
 		ConfigTag* Conf = ServerInstance->Config->ConfValue("openssl");
@@ -275,16 +867,39 @@ class ModuleSSLOpenSSL : public Module
 
 	~ModuleSSLOpenSSL()
 	{
+#ifndef _WIN32
+		StopThreads();
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		LockCallbacks::Remove();
+#endif
+#endif
 		SSL_CTX_free(ctx);
 		SSL_CTX_free(clictx);
+		clientsessions.Clear();
 		delete[] sessions;
 	}
 
+	ModResult OnStats(char symbol, User* user, string_list &results) CXX11_OVERRIDE
+	{
+		if (symbol != 't')
+			return MOD_RES_PASSTHRU;
+
+		const std::string prefix = ServerInstance->Config->ServerName + " 304 " + user->nick + " :SSLSTATS ";
+		results.push_back(prefix + "Inbound handshakes: " + ConvToStr(handshakes[0][0]) + " full, " + ConvToStr(handshakes[0][1]) +
+			" resumed (" + ConvToStr(ticketkeys.GetAccepted()) + " tickets accepted)");
+		results.push_back(prefix + "Outbound handshakes: " + ConvToStr(handshakes[1][0]) + " full, " + ConvToStr(handshakes[1][1]) + " resumed");
+		results.push_back(prefix + "Session cache: " + ConvToStr(SSL_CTX_sess_number(ctx)) + " entries, " + ConvToStr(SSL_CTX_sess_hits(ctx)) +
+			" hits, " + ConvToStr(SSL_CTX_sess_misses(ctx)) + " misses, " + ConvToStr(SSL_CTX_sess_timeouts(ctx)) + " timeouts, " +
+			ConvToStr(SSL_CTX_sess_cache_full(ctx)) + " evicted when full");
+
+		return MOD_RES_PASSTHRU;
+	}
+
 	void OnUserConnect(LocalUser* user) CXX11_OVERRIDE
 	{
 		if (user->eh.GetIOHook() == this)
 		{
-			if (sessions[user->eh.GetFd()].sess)
+			if (sessions[user->eh.GetFd()].sess && !sessions[user->eh.GetFd()].job)
 			{
 				if (!sessions[user->eh.GetFd()].cert->fingerprint.empty())
 					user->WriteNotice("*** You are connected using SSL cipher '" + std::string(SSL_get_cipher(sessions[user->eh.GetFd()].sess)) +
@@ -346,8 +961,16 @@ class ModuleSSLOpenSSL : public Module
 			ServerInstance->Logs->Log("m_ssl_openssl", LOG_DEBUG, "BUG: Can't set fd with SSL_set_fd: %d", fd);
 			return;
 		}
+		SSL_set_app_data(session->sess, session);
 
- 		Handshake(user, session);
+#ifndef _WIN32
+		if (!threads.empty())
+		{
+			StartHandshake(user, session);
+			return;
+		}
+#endif
+		Handshake(user, session);
 	}
 
 	void OnStreamSocketConnect(StreamSocket* user) CXX11_OVERRIDE
@@ -371,7 +994,16 @@ class ModuleSSLOpenSSL : public Module
 			ServerInstance->Logs->Log("m_ssl_openssl", LOG_DEBUG, "BUG: Can't set fd with SSL_set_fd: %d", fd);
 			return;
 		}
+		SSL_set_app_data(session->sess, session);
+		clientsessions.Resume(session->sess, fd);
 
+#ifndef _WIN32
+		if (!threads.empty())
+		{
+			StartHandshake(user, session);
+			return;
+		}
+#endif
 		Handshake(user, session);
 	}
 
@@ -400,6 +1032,10 @@ class ModuleSSLOpenSSL : public Module
 			return -1;
 		}
 
+		// A handshake thread is working on this session, it will restart reading when done
+		if (session->job)
+			return 0;
+
 		if (session->status == ISSL_HANDSHAKING)
 		{
 			// The handshake isn't finished and it wants to read, try to finish it.
@@ -473,6 +1109,10 @@ class ModuleSSLOpenSSL : public Module
 
 		session->data_to_write = true;
 
+		// The sendq is flushed once the handshake thread is done with the session
+		if (session->job)
+			return 0;
+
 		if (session->status == ISSL_HANDSHAKING)
 		{
 			if (!Handshake(user, session))
@@ -564,6 +1204,7 @@ class ModuleSSLOpenSSL : public Module
 		{
 			// Handshake complete.
 			VerifyCertificate(session, user);
+			CountHandshake(session);
 
 			session->status = ISSL_OPEN;
 
@@ -580,8 +1221,24 @@ class ModuleSSLOpenSSL : public Module
 		return true;
 	}
 
+#ifndef _WIN32
+	/** Called in the main thread when a handshake thread has finished a handshake */
+	void HandshakeDone(HandshakeJob* job);
+#endif
+
 	void CloseSession(issl_session* session)
 	{
+#ifndef _WIN32
+		if (session->job)
+		{
+			// The session belongs to a handshake thread, which frees it once it sees this
+			session->job->lock.Lock();
+			session->job->cancelled = true;
+			session->job->lock.Unlock();
+			session->job = NULL;
+		}
+		else
+#endif
 		if (session->sess)
 		{
 			SSL_shutdown(session->sess);
@@ -613,9 +1270,10 @@ class ModuleSSLOpenSSL : public Module
 			return;
 		}
 
-		certinfo->invalid = (SSL_get_verify_result(session->sess) != X509_V_OK);
+		long verifyresult = SSL_get_verify_result(session->sess);
+		certinfo->invalid = (verifyresult != X509_V_OK);
 
-		if (SelfSigned)
+		if (verifyresult == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT)
 		{
 			certinfo->unknownsigner = false;
 			certinfo->trusted = true;
@@ -647,6 +1305,54 @@ class ModuleSSLOpenSSL : public Module
 	}
 };
 
+#ifndef _WIN32
+void ModuleSSLOpenSSL::HandshakeDone(HandshakeJob* job)
+{
+	job->lock.Lock();
+	bool cancelled = job->cancelled;
+	job->lock.Unlock();
+
+	if (cancelled)
+	{
+		// The socket was closed after the thread finished the handshake
+		SSL_free(job->sess);
+		delete job;
+		return;
+	}
+
+	issl_session* session = job->session;
+	StreamSocket* user = job->sock;
+	bool success = job->success;
+	session->job = NULL;
+	delete job;
+
+	if (success)
+	{
+		VerifyCertificate(session, user);
+		CountHandshake(session);
+		session->status = ISSL_OPEN;
+		ServerInstance->SE->ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE | FD_ADD_TRIAL_WRITE);
+	}
+	else
+	{
+		CloseSession(session);
+		user->SetError("SSL handshake failed");
+		user->OnError(I_ERR_OTHER);
+	}
+}
+
+void HandshakeThread::OnNotify()
+{
+	std::vector<HandshakeJob*> jobs;
+	LockQueue();
+	jobs.swap(finished);
+	UnlockQueue();
+
+	for (std::vector<HandshakeJob*>::iterator i = jobs.begin(); i != jobs.end(); ++i)
+		mod->HandshakeDone(*i);
+}
+#endif
+
 static int error_callback(const char *str, size_t len, void *u)
 {
 	ServerInstance->Logs->Log("m_ssl_openssl", LOG_DEFAULT, "SSL error: " + std::string(str, len - 1));
@@ -0,0 +1,168 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2014 InspIRCd Development Team
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "modules/compress.h"
+#include <zlib.h>
+
+/* $ModDesc: Provides zlib compression for server links */
+/* $ModConfig: <ziplink level="6">
+ *  Compression level from 1 (fastest) to 9 (smallest), used for links
+ *  that are set up after the level is changed */
+/* $ModDep: modules/compress.h */
+/* $CompileFlags: pkgconfincludes("zlib","/zlib.h","") */
+/* $LinkerFlags: pkgconflibs("zlib","/libz.so","-lz") */
+
+#ifdef _WIN32
+# pragma comment(lib, "zlib.lib")
+#endif
+
+/** Size of the buffer zlib writes its output into, before it is appended to the caller's string */
+static const size_t ZIPLINK_BUFSIZE = 16384;
+
+class ZlibCompressor : public Compressor
+{
+	z_stream stream;
+
+ public:
+	ZlibCompressor(int level)
+	{
+		memset(&stream, 0, sizeof(stream));
+		if (deflateInit(&stream, level) != Z_OK)
+			throw ModuleException("deflateInit failed: " + std::string(stream.msg ? stream.msg : "out of memory"));
+	}
+
+	~ZlibCompressor()
+	{
+		deflateEnd(&stream);
+	}
+
+	void Compress(const std::string& in, std::string& out, bool flush) CXX11_OVERRIDE
+	{
+		char buffer[ZIPLINK_BUFSIZE];
+		stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+		stream.avail_in = in.length();
+
+		/* Without a flush, zlib only writes out what it has to; with Z_SYNC_FLUSH it keeps
+		 * going until everything is written and the output ends on a byte boundary, which
+		 * is when it leaves some of the output buffer unused.
+		 */
+		do
+		{
+			stream.next_out = reinterpret_cast<Bytef*>(buffer);
+			stream.avail_out = sizeof(buffer);
+			deflate(&stream, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+			out.append(buffer, sizeof(buffer) - stream.avail_out);
+		} while (stream.avail_in || !stream.avail_out);
+	}
+};
+
+class ZlibDecompressor : public Decompressor
+{
+	z_stream stream;
+	bool failed;
+
+ public:
+	ZlibDecompressor() : failed(false)
+	{
+		memset(&stream, 0, sizeof(stream));
+		if (inflateInit(&stream) != Z_OK)
+			throw ModuleException("inflateInit failed: " + std::string(stream.msg ? stream.msg : "out of memory"));
+	}
+
+	~ZlibDecompressor()
+	{
+		inflateEnd(&stream);
+	}
+
+	bool Decompress(const std::string& in, std::string& out) CXX11_OVERRIDE
+	{
+		if (failed)
+			return false;
+
+		char buffer[ZIPLINK_BUFSIZE];
+		stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+		stream.avail_in = in.length();
+
+		do
+		{
+			stream.next_out = reinterpret_cast<Bytef*>(buffer);
+			stream.avail_out = sizeof(buffer);
+			int ret = inflate(&stream, Z_SYNC_FLUSH);
+			if (ret != Z_OK && ret != Z_BUF_ERROR)
+			{
+				// The other side never ends the stream, so Z_STREAM_END is an error as well
+				failed = true;
+				return false;
+			}
+			out.append(buffer, sizeof(buffer) - stream.avail_out);
+		} while (stream.avail_in || !stream.avail_out);
+		return true;
+	}
+};
+
+class ZlibProvider : public CompressProvider
+{
+ public:
+	int level;
+
+	ZlibProvider(Module* mod) : CompressProvider(mod, "zlib"), level(Z_DEFAULT_COMPRESSION) { }
+
+	Compressor* CreateCompressor() CXX11_OVERRIDE
+	{
+		return new ZlibCompressor(level);
+	}
+
+	Decompressor* CreateDecompressor() CXX11_OVERRIDE
+	{
+		return new ZlibDecompressor;
+	}
+};
+
+class ModuleZipLink : public Module
+{
+	ZlibProvider zlib;
+
+ public:
+	ModuleZipLink() : zlib(this)
+	{
+		ServerInstance->Modules->AddService(zlib);
+		Implementation eventlist[] = { I_OnRehash };
+		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+		OnRehash(NULL);
+	}
+
+	void OnRehash(User* user) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("ziplink");
+		zlib.level = tag->getInt("level", 6);
+		if (zlib.level < 1 || zlib.level > 9)
+		{
+			ServerInstance->SNO->WriteToSnoMask('a', "WARNING: <ziplink:level> must be between 1 and 9, using 6");
+			zlib.level = 6;
+		}
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Provides zlib compression for server links", VF_VENDOR);
+	}
+};
+
+MODULE_INIT(ModuleZipLink)
@@ -61,7 +61,7 @@ class ModuleAuditorium : public Module
 
 		Implementation eventlist[] = {
 			I_OnUserJoin, I_OnUserPart, I_OnUserKick,
-			I_OnBuildNeighborList, I_OnNamesListItem, I_OnSendWhoLine,
+			I_OnBuildNeighborList, I_OnNamesListFormat, I_OnNamesListItem, I_OnSendWhoLine,
 			I_OnRehash };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 	}
@@ -108,6 +108,12 @@ class ModuleAuditorium : public Module
 		return false;
 	}
 
+	void OnNamesListFormat(User* issuer, Channel* chan, unsigned int& format) CXX11_OVERRIDE
+	{
+		if (chan->IsModeSet(&aum))
+			format |= NAMES_FILTER;
+	}
+
 	void OnNamesListItem(User* issuer, Membership* memb, std::string &prefixes, std::string &nick) CXX11_OVERRIDE
 	{
 		// Some module already hid this from being displayed, don't bother
@@ -129,11 +135,11 @@ class ModuleAuditorium : public Module
 		if (IsVisible(memb))
 			return;
 
-		const UserMembList* users = memb->chan->GetUsers();
-		for(UserMembCIter i = users->begin(); i != users->end(); i++)
+		const LocalMembList& users = memb->chan->GetLocalUsers();
+		for (LocalMembCIter i = users.begin(); i != users.end(); ++i)
 		{
-			if (IS_LOCAL(i->first) && !CanSee(i->first, memb))
-				excepts.insert(i->first);
+			if (!CanSee(i->user, memb))
+				excepts.insert(i->user);
 		}
 	}
 
@@ -164,11 +170,11 @@ class ModuleAuditorium : public Module
 			// this channel should not be considered when listing my neighbors
 			include.erase(c);
 			// however, that might hide me from ops that can see me...
-			const UserMembList* users = c->GetUsers();
-			for(UserMembCIter j = users->begin(); j != users->end(); j++)
+			const LocalMembList& users = c->GetLocalUsers();
+			for (LocalMembCIter j = users.begin(); j != users.end(); ++j)
 			{
-				if (IS_LOCAL(j->first) && CanSee(j->first, memb))
-					exception[j->first] = true;
+				if (CanSee(j->user, memb))
+					exception[j->user] = true;
 			}
 		}
 	}
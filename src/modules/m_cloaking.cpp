@@ -25,6 +25,7 @@
 
 #include "inspircd.h"
 #include "modules/hash.h"
+#include "listmode.h"
 
 /* $ModDesc: Provides masking of user hostnames */
 
@@ -132,6 +133,15 @@ class CommandCloak : public Command
 	CmdResult Handle(const std::vector<std::string> &parameters, User *user);
 };
 
+/** Whether the unused cloak of a channel member matched the bans on the channel */
+struct CloakBanCache
+{
+	/** Serial of the channel's ban index when the cloak was matched against it */
+	unsigned long serial;
+	/** True if the cloak matched one of the bans */
+	bool banned;
+};
+
 class ModuleCloaking : public Module
 {
  public:
@@ -143,8 +153,10 @@ class ModuleCloaking : public Module
 	std::string key;
 	const char* xtab[4];
 	dynamic_reference<HashProvider> Hash;
+	ModeReference ban;
+	SimpleExtItem<CloakBanCache> bancache;
 
-	ModuleCloaking() : cu(this), mode(MODE_OPAQUE), ck(this), Hash(this, "hash/md5")
+	ModuleCloaking() : cu(this), mode(MODE_OPAQUE), ck(this), Hash(this, "hash/md5"), ban(this, "ban"), bancache("cloak_bancache", this)
 	{
 	}
 
@@ -155,8 +167,9 @@ class ModuleCloaking : public Module
 		ServerInstance->Modules->AddService(cu);
 		ServerInstance->Modules->AddService(ck);
 		ServerInstance->Modules->AddService(cu.ext);
+		ServerInstance->Modules->AddService(bancache);
 
-		Implementation eventlist[] = { I_OnRehash, I_OnCheckBan, I_OnUserConnect, I_OnChangeHost };
+		Implementation eventlist[] = { I_OnRehash, I_OnCheckBan, I_OnCheckChannelBan, I_OnExtBanCheck, I_OnUserConnect, I_OnChangeHost };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 	}
 
@@ -284,28 +297,100 @@ class ModuleCloaking : public Module
 		return rv;
 	}
 
-	ModResult OnCheckBan(User* user, Channel* chan, const std::string& mask) CXX11_OVERRIDE
+	/** Get the cloak of a user who has one but is not using it
+	 * @param user The user to check
+	 * @return The user's nick!ident@cloak, or an empty string
+	 */
+	std::string GetUnusedCloakMask(User* user)
+	{
+		std::string* cloak = GetUnusedCloak(user);
+		if (cloak)
+			return user->nick + "!" + user->ident + "@" + *cloak;
+		return "";
+	}
+
+	/** Get the cloak of a local user who is not using it
+	 * @param user The user to check
+	 * @return The user's cloak, or NULL if the user has none or is using it
+	 */
+	std::string* GetUnusedCloak(User* user)
 	{
 		LocalUser* lu = IS_LOCAL(user);
 		if (!lu)
-			return MOD_RES_PASSTHRU;
+			return NULL;
 
 		OnUserConnect(lu);
 		std::string* cloak = cu.ext.get(user);
 		/* Check if they have a cloaked host, but are not using it */
 		if (cloak && *cloak != user->dhost)
+			return cloak;
+		return NULL;
+	}
+
+	ModResult OnCheckBan(User* user, Channel* chan, const std::string& mask) CXX11_OVERRIDE
+	{
+		const std::string cloakMask = GetUnusedCloakMask(user);
+		if (!cloakMask.empty() && InspIRCd::Match(cloakMask, mask))
+			return MOD_RES_DENY;
+		return MOD_RES_PASSTHRU;
+	}
+
+	/** The core only calls OnCheckBan for the extbans on a channel's ban list,
+	 * so the other bans are looked up in the channel's ban index with the cloak here.
+	 */
+	ModResult CheckChannelBans(User* user, Channel* chan)
+	{
+		if (!ban)
+			return MOD_RES_PASSTHRU;
+
+		const BanIndex* bans = static_cast<ListModeBase*>(*ban)->GetIndex(chan);
+		if (!bans)
+			return MOD_RES_PASSTHRU;
+
+		/* This runs before the core matches the ban list, which resets Membership::banserial
+		 * when the user's nick, ident or host changes, and sets it again after matching.
+		 * So if it is still the serial the cloak was last matched at, neither the user nor
+		 * the bans have changed since, and the cached result is still good.
+		 */
+		Membership* memb = chan->GetUser(user);
+		if (memb && memb->banserial == bans->GetSerial())
 		{
-			const std::string cloakMask = user->nick + "!" + user->ident + "@" + *cloak;
-			if (InspIRCd::Match(cloakMask, mask))
-				return MOD_RES_DENY;
+			CloakBanCache* cache = bancache.get(memb);
+			if (cache && cache->serial == memb->banserial)
+				return (cache->banned ? MOD_RES_DENY : MOD_RES_PASSTHRU);
 		}
-		return MOD_RES_PASSTHRU;
+
+		std::string* cloak = GetUnusedCloak(user);
+		if (!cloak)
+			return MOD_RES_PASSTHRU;
+
+		bool banned = bans->MatchesHost(user->nick + "!" + user->ident, *cloak);
+		if (memb)
+		{
+			CloakBanCache* cache = new CloakBanCache;
+			cache->serial = bans->GetSerial();
+			cache->banned = banned;
+			bancache.set(memb, cache);
+		}
+		return (banned ? MOD_RES_DENY : MOD_RES_PASSTHRU);
+	}
+
+	ModResult OnCheckChannelBan(User* user, Channel* chan) CXX11_OVERRIDE
+	{
+		return CheckChannelBans(user, chan);
+	}
+
+	ModResult OnExtBanCheck(User* user, Channel* chan, char type) CXX11_OVERRIDE
+	{
+		return CheckChannelBans(user, chan);
 	}
 
 	void Prioritize()
 	{
 		/* Needs to be after m_banexception etc. */
 		ServerInstance->Modules->SetPriority(this, I_OnCheckBan, PRIORITY_LAST);
+		ServerInstance->Modules->SetPriority(this, I_OnCheckChannelBan, PRIORITY_LAST);
+		ServerInstance->Modules->SetPriority(this, I_OnExtBanCheck, PRIORITY_LAST);
 	}
 
 	// this unsets umode +x on every host change. If we are actually doing a +x
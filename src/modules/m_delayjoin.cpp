@@ -50,10 +50,11 @@ class ModuleDelayJoin : public Module
 	{
 		ServerInstance->Modules->AddService(djm);
 		ServerInstance->Modules->AddService(unjoined);
-		Implementation eventlist[] = { I_OnUserJoin, I_OnUserPart, I_OnUserKick, I_OnBuildNeighborList, I_OnNamesListItem, I_OnText, I_OnRawMode };
+		Implementation eventlist[] = { I_OnUserJoin, I_OnUserPart, I_OnUserKick, I_OnBuildNeighborList, I_OnNamesListFormat, I_OnNamesListItem, I_OnText, I_OnRawMode };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 	}
 	Version GetVersion() CXX11_OVERRIDE;
+	void OnNamesListFormat(User* issuer, Channel* chan, unsigned int& format) CXX11_OVERRIDE;
 	void OnNamesListItem(User* issuer, Membership*, std::string &prefixes, std::string &nick) CXX11_OVERRIDE;
 	void OnUserJoin(Membership*, bool, bool, CUList&) CXX11_OVERRIDE;
 	void CleanUser(User* user);
@@ -89,6 +90,13 @@ Version ModuleDelayJoin::GetVersion()
 	return Version("Allows for delay-join channels (+D) where users don't appear to join until they speak", VF_VENDOR);
 }
 
+void ModuleDelayJoin::OnNamesListFormat(User* issuer, Channel* chan, unsigned int& format)
+{
+	/* Hidden users have to be taken out of the list */
+	if (chan->IsModeSet('D'))
+		format |= NAMES_FILTER;
+}
+
 void ModuleDelayJoin::OnNamesListItem(User* issuer, Membership* memb, std::string &prefixes, std::string &nick)
 {
 	/* don't prevent the user from seeing themself */
@@ -102,12 +110,12 @@ void ModuleDelayJoin::OnNamesListItem(User* issuer, Membership* memb, std::strin
 
 static void populate(CUList& except, Membership* memb)
 {
-	const UserMembList* users = memb->chan->GetUsers();
-	for(UserMembCIter i = users->begin(); i != users->end(); i++)
+	const LocalMembList& users = memb->chan->GetLocalUsers();
+	for (LocalMembCIter i = users.begin(); i != users.end(); ++i)
 	{
-		if (i->first == memb->user || !IS_LOCAL(i->first))
+		if (i->user == memb->user)
 			continue;
-		except.insert(i->first);
+		except.insert(i->user);
 	}
 }
 
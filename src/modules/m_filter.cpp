@@ -23,6 +23,7 @@
 #include "inspircd.h"
 #include "xline.h"
 #include "modules/regex.h"
+#include <iostream>
 
 /* $ModDesc: Text (spam) filtering */
 
@@ -137,6 +138,308 @@ class FilterResult
 	}
 };
 
+/** Finds which of a set of strings occur in a text in a single pass over the text,
+ * using the Aho-Corasick algorithm. The strings and the text are folded with a case
+ * mapping, so a string is found if it occurs in the text in any case.
+ */
+class LiteralMatcher
+{
+	struct Node
+	{
+		/* Children of the node, by character */
+		std::vector<std::pair<unsigned char, unsigned int> > next;
+		/* The node for the longest proper suffix of this node's string that is also in the trie */
+		unsigned int fail;
+		/* This node if strings end here, otherwise the next node on the fail chain where strings end, or 0 */
+		unsigned int dict;
+		/* The ids of the strings that end here */
+		std::vector<unsigned int> ids;
+
+		Node() : fail(0), dict(0) { }
+	};
+
+	std::vector<Node> nodes;
+
+	/** Transitions from the root, which is where the search spends most of its time */
+	unsigned int rootnext[256];
+
+	/** The case mapping the strings were folded with */
+	const unsigned char* map;
+
+	unsigned int Child(unsigned int node, unsigned char c) const
+	{
+		if (!node)
+			return rootnext[c];
+
+		const std::vector<std::pair<unsigned char, unsigned int> >& next = nodes[node].next;
+		for (std::vector<std::pair<unsigned char, unsigned int> >::const_iterator i = next.begin(); i != next.end(); ++i)
+		{
+			if (i->first == c)
+				return i->second;
+		}
+		return 0;
+	}
+
+ public:
+	LiteralMatcher() : map(NULL)
+	{
+		Clear(national_case_insensitive_map);
+	}
+
+	/** Remove all strings
+	 * @param casemap The case mapping to fold strings and texts with
+	 */
+	void Clear(const unsigned char* casemap)
+	{
+		map = casemap;
+		nodes.assign(1, Node());
+		memset(rootnext, 0, sizeof(rootnext));
+	}
+
+	/** Add a string; Compile() has to be called before the next Find()
+	 * @param str The string, which must not be empty
+	 * @param id Identifies the string to Find()
+	 */
+	void Add(const std::string& str, unsigned int id)
+	{
+		unsigned int node = 0;
+		for (std::string::const_iterator i = str.begin(); i != str.end(); ++i)
+		{
+			unsigned char c = map[static_cast<unsigned char>(*i)];
+			unsigned int child = Child(node, c);
+			if (!child)
+			{
+				child = nodes.size();
+				nodes.push_back(Node());
+				if (node)
+					nodes[node].next.push_back(std::make_pair(c, child));
+				else
+					rootnext[c] = child;
+			}
+			node = child;
+		}
+		nodes[node].ids.push_back(id);
+		nodes[node].dict = node;
+	}
+
+	/** Link the nodes of the trie to each other after strings were added */
+	void Compile()
+	{
+		// Breadth first, so that the fail node of a node is always done before the node itself
+		std::deque<unsigned int> queue;
+		for (unsigned int c = 0; c < 256; ++c)
+		{
+			if (rootnext[c])
+				queue.push_back(rootnext[c]);
+		}
+
+		while (!queue.empty())
+		{
+			unsigned int node = queue.front();
+			queue.pop_front();
+
+			for (std::vector<std::pair<unsigned char, unsigned int> >::const_iterator i = nodes[node].next.begin(); i != nodes[node].next.end(); ++i)
+			{
+				unsigned int fail = nodes[node].fail;
+				while (fail && !Child(fail, i->first))
+					fail = nodes[fail].fail;
+
+				Node& child = nodes[i->second];
+				child.fail = Child(fail, i->first);
+				if (!child.dict)
+					child.dict = nodes[child.fail].dict;
+				queue.push_back(i->second);
+			}
+		}
+	}
+
+	/** Find the strings that occur in a text
+	 * @param text The text to search
+	 * @param found For every string found, the element at its id is set to stamp
+	 * @param stamp The value to set
+	 */
+	void Find(const std::string& text, std::vector<unsigned long>& found, unsigned long stamp) const
+	{
+		unsigned int node = 0;
+		for (std::string::const_iterator i = text.begin(); i != text.end(); ++i)
+		{
+			unsigned char c = map[static_cast<unsigned char>(*i)];
+			unsigned int child;
+			while (!(child = Child(node, c)) && node)
+				node = nodes[node].fail;
+			node = child;
+
+			for (unsigned int out = nodes[node].dict; out; out = nodes[nodes[out].fail].dict)
+			{
+				for (std::vector<unsigned int>::const_iterator id = nodes[out].ids.begin(); id != nodes[out].ids.end(); ++id)
+					found[*id] = stamp;
+			}
+		}
+	}
+
+	const unsigned char* GetCaseMap() const { return map; }
+};
+
+/** Get the longest string that every text a glob pattern matches has to contain.
+ * Anything between two wildcards has to appear as it is.
+ */
+static std::string GetGlobLiteral(const std::string& pattern)
+{
+	std::string best;
+	irc::sepstream sep(pattern, '*');
+	std::string token;
+	while (sep.GetToken(token))
+	{
+		irc::sepstream parts(token, '?');
+		std::string part;
+		while (parts.GetToken(part))
+		{
+			if (part.length() > best.length())
+				best = part;
+		}
+	}
+	return best;
+}
+
+/** Get the longest string that every text a regular expression matches has to contain,
+ * or an empty string if none can be found. This only has to understand enough of the
+ * syntax of the regex engines to never return a string that is not required: it gives
+ * up on alternatives at the top level, on escapes it does not know, on anything
+ * that changes how the rest of the pattern is read, and on classes with a backslash in
+ * them, as only some engines treat it as an escape there. It skips over groups, other
+ * classes and optional characters. Escaped groups, alternatives and intervals are treated
+ * the same as unescaped ones, so that this is also safe for POSIX basic regexes.
+ */
+static std::string GetRegexLiteral(const std::string& pattern)
+{
+	// Inline options, such as (?x), and quoted sections
+	if (pattern.find("(?") != std::string::npos || pattern.find("\\Q") != std::string::npos)
+		return "";
+
+	std::string best;
+	std::string run;
+	unsigned int depth = 0;
+
+	for (std::string::size_type pos = 0; pos < pattern.length(); ++pos)
+	{
+		char c = pattern[pos];
+		bool escaped = false;
+		if (c == '\\')
+		{
+			if (++pos == pattern.length())
+				return "";
+			c = pattern[pos];
+			escaped = true;
+
+			if (isalnum(c))
+			{
+				// Character types and assertions end a run; other escapes may be followed by more of themselves
+				if (!strchr("dDwWsSbBAzZGntrfveR", c))
+					return "";
+				c = 0;
+			}
+			else if (strchr("<>`'", c))
+			{
+				// Word and buffer boundaries in GNU regexes
+				c = 0;
+			}
+		}
+
+		if (c == '[' && !escaped)
+		{
+			// Skip the class, which may contain a ] right after the [ or [^, and [:name:] items
+			std::string::size_type end = pos + 1;
+			if (end < pattern.length() && pattern[end] == '^')
+				end++;
+			if (end < pattern.length() && pattern[end] == ']')
+				end++;
+			while (end < pattern.length() && pattern[end] != ']')
+			{
+				// PCRE and ECMAScript allow a ] in a class to be escaped, POSIX does not
+				if (pattern[end] == '\\')
+					return "";
+				if (pattern[end] == '[' && end + 1 < pattern.length() && strchr(":.=", pattern[end + 1]))
+				{
+					end = pattern.find(std::string(1, pattern[end + 1]) + "]", end + 2);
+					if (end == std::string::npos)
+						return "";
+					end++;
+				}
+				end++;
+			}
+			if (end >= pattern.length())
+				return "";
+			pos = end;
+			c = 0;
+		}
+		else if (c == '(')
+		{
+			depth++;
+			c = 0;
+		}
+		else if (c == ')')
+		{
+			if (depth)
+				depth--;
+			c = 0;
+		}
+		else if (depth)
+		{
+			continue;
+		}
+		else if (c == '|')
+		{
+			return "";
+		}
+		else if (c == '*' || c == '?' || c == '{')
+		{
+			// The character before this is optional
+			if (!run.empty())
+				run.erase(run.length() - 1);
+			if (c == '{')
+			{
+				std::string::size_type end = pattern.find('}', pos);
+				if (end == std::string::npos)
+					return "";
+				pos = end;
+			}
+			c = 0;
+		}
+		else if (c == '+')
+		{
+			// The character before this is required, but may be followed by more of itself
+			if (run.length() > best.length())
+				best = run;
+			run.clear();
+			continue;
+		}
+		else if ((c == '.' || c == '^' || c == '$') && !escaped)
+		{
+			c = 0;
+		}
+		else if (c < 0x20 || c > 0x7E)
+		{
+			// Non-ASCII characters may be part of a multibyte character the engine treats as one
+			c = 0;
+		}
+
+		if (c)
+		{
+			run.push_back(c);
+		}
+		else
+		{
+			if (run.length() > best.length())
+				best = run;
+			run.clear();
+		}
+	}
+
+	if (run.length() > best.length())
+		best = run;
+	return best;
+}
+
 class CommandFilter : public Command
 {
  public:
@@ -159,6 +462,16 @@ class ImplFilter : public FilterResult
  public:
 	Regex* regex;
 
+	/* A string every text the filter matches contains, folded for LiteralMatcher; empty if there is none */
+	std::string literal;
+
+	/* Number of texts the literal was found in */
+	unsigned long literal_hits;
+
+	/* Number of texts the regex was run on, and the number it matched */
+	unsigned long regex_runs;
+	unsigned long regex_matches;
+
 	ImplFilter(ModuleFilter* mymodule, const std::string &rea, FilterAction act, long glinetime, const std::string &pat, const std::string &flgs);
 };
 
@@ -169,6 +482,23 @@ class ModuleFilter : public Module
 	RegexFactory* factory;
 	void FreeFilters();
 
+	/* The literals of the filters, by position in filters; rebuilt before use when prefilter_dirty is set */
+	LiteralMatcher prefilter;
+	bool prefilter_dirty;
+
+	/* Filters whose literal was found in the text and in the text without colors, if the
+	 * element for the filter is set to the current value of prefilter_stamp
+	 */
+	std::vector<unsigned long> found_in_text;
+	std::vector<unsigned long> found_in_stripped;
+	unsigned long prefilter_stamp;
+
+	/* Number of texts checked, and the number of regexes not run because their literal was missing */
+	unsigned long stats_checks;
+	unsigned long stats_skipped;
+
+	void BuildPrefilter();
+
  public:
 	CommandFilter filtcommand;
 	dynamic_reference<RegexFactory> RegexEngine;
@@ -194,6 +524,7 @@ class ModuleFilter : public Module
 	ModResult OnStats(char symbol, User* user, string_list &results) CXX11_OVERRIDE;
 	ModResult OnPreCommand(std::string &command, std::vector<std::string> &parameters, LocalUser *user, bool validated, const std::string &original_line) CXX11_OVERRIDE;
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE;
+	void OnRunTestSuite() CXX11_OVERRIDE;
 	bool AppliesToMe(User* user, FilterResult* filter, int flags);
 	void ReadFilters();
 	static bool StringToFilterAction(const std::string& str, FilterAction& fa);
@@ -296,14 +627,15 @@ bool ModuleFilter::AppliesToMe(User* user, FilterResult* filter, int iflags)
 }
 
 ModuleFilter::ModuleFilter()
-	: initing(true), filtcommand(this), RegexEngine(this, "regex")
+	: initing(true), prefilter_dirty(true), prefilter_stamp(0), stats_checks(0), stats_skipped(0)
+	, filtcommand(this), RegexEngine(this, "regex")
 {
 }
 
 void ModuleFilter::init()
 {
 	ServerInstance->Modules->AddService(filtcommand);
-	Implementation eventlist[] = { I_OnPreCommand, I_OnStats, I_OnSyncNetwork, I_OnDecodeMetaData, I_OnUserPreMessage, I_OnRehash, I_OnUnloadModule };
+	Implementation eventlist[] = { I_OnPreCommand, I_OnStats, I_OnSyncNetwork, I_OnDecodeMetaData, I_OnUserPreMessage, I_OnRehash, I_OnUnloadModule, I_OnRunTestSuite };
 	ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 	OnRehash(NULL);
 }
@@ -320,6 +652,22 @@ void ModuleFilter::FreeFilters()
 		delete i->regex;
 
 	filters.clear();
+	prefilter_dirty = true;
+}
+
+void ModuleFilter::BuildPrefilter()
+{
+	prefilter.Clear(national_case_insensitive_map);
+	for (std::vector<ImplFilter>::const_iterator i = filters.begin(); i != filters.end(); ++i)
+	{
+		if (!i->literal.empty())
+			prefilter.Add(i->literal, i - filters.begin());
+	}
+	prefilter.Compile();
+
+	found_in_text.assign(filters.size(), 0);
+	found_in_stripped.assign(filters.size(), 0);
+	prefilter_dirty = false;
 }
 
 ModResult ModuleFilter::OnUserPreMessage(User* user, void* dest, int target_type, std::string& text, char status, CUList& exempt_list, MessageType msgtype)
@@ -568,11 +916,16 @@ void ModuleFilter::OnDecodeMetaData(Extensible* target, const std::string &extna
 }
 
 ImplFilter::ImplFilter(ModuleFilter* mymodule, const std::string &rea, FilterAction act, long glinetime, const std::string &pat, const std::string &flgs)
-		: FilterResult(pat, rea, act, glinetime, flgs)
+		: FilterResult(pat, rea, act, glinetime, flgs), literal_hits(0), regex_runs(0), regex_matches(0)
 {
 	if (!mymodule->RegexEngine)
 		throw ModuleException("Regex module implementing '"+mymodule->RegexEngine.GetProvider()+"' is not loaded!");
 	regex = mymodule->RegexEngine->Create(pat);
+
+	if (mymodule->RegexEngine->name == "regex/glob")
+		literal = GetGlobLiteral(pat);
+	else
+		literal = GetRegexLiteral(pat);
 }
 
 FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int flgs)
@@ -580,6 +933,17 @@ FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int
 	static std::string stripped_text;
 	stripped_text.clear();
 
+	if (prefilter_dirty || prefilter.GetCaseMap() != national_case_insensitive_map)
+		BuildPrefilter();
+
+	/* The literals are looked for in the text the first time a filter that has one applies,
+	 * and in the text without colors the first time such a filter strips colors.
+	 */
+	prefilter_stamp++;
+	bool searched_text = false;
+	bool searched_stripped = false;
+	stats_checks++;
+
 	for (std::vector<ImplFilter>::iterator index = filters.begin(); index != filters.end(); index++)
 	{
 		FilterResult* filter = dynamic_cast<FilterResult*>(&(*index));
@@ -594,10 +958,42 @@ FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int
 			InspIRCd::StripColor(stripped_text);
 		}
 
+		if (!index->literal.empty())
+		{
+			bool found;
+			if (filter->flag_strip_color)
+			{
+				if (!searched_stripped)
+				{
+					prefilter.Find(stripped_text, found_in_stripped, prefilter_stamp);
+					searched_stripped = true;
+				}
+				found = (found_in_stripped[index - filters.begin()] == prefilter_stamp);
+			}
+			else
+			{
+				if (!searched_text)
+				{
+					prefilter.Find(text, found_in_text, prefilter_stamp);
+					searched_text = true;
+				}
+				found = (found_in_text[index - filters.begin()] == prefilter_stamp);
+			}
+
+			if (!found)
+			{
+				stats_skipped++;
+				continue;
+			}
+			index->literal_hits++;
+		}
+
 		//ServerInstance->Logs->Log("m_filter", LOG_DEBUG, "Match '%s' against '%s'", text.c_str(), index->freeform.c_str());
+		index->regex_runs++;
 		if (index->regex->Matches(filter->flag_strip_color ? stripped_text : text))
 		{
 			//ServerInstance->Logs->Log("m_filter", LOG_DEBUG, "MATCH");
+			index->regex_matches++;
 			return &*index;
 		}
 		//ServerInstance->Logs->Log("m_filter", LOG_DEBUG, "NO MATCH");
@@ -613,6 +1009,7 @@ bool ModuleFilter::DeleteFilter(const std::string &freeform)
 		{
 			delete i->regex;
 			filters.erase(i);
+			prefilter_dirty = true;
 			return true;
 		}
 	}
@@ -632,6 +1029,7 @@ std::pair<bool, std::string> ModuleFilter::AddFilter(const std::string &freeform
 	try
 	{
 		filters.push_back(ImplFilter(this, reason, type, duration, freeform, flgs));
+		prefilter_dirty = true;
 	}
 	catch (ModuleException &e)
 	{
@@ -695,6 +1093,7 @@ void ModuleFilter::ReadFilters()
 		try
 		{
 			filters.push_back(ImplFilter(this, reason, fa, gline_time, pattern, flgs));
+			prefilter_dirty = true;
 			ServerInstance->Logs->Log("m_filter", LOG_DEFAULT, "Regular expression %s loaded.", pattern.c_str());
 		}
 		catch (ModuleException &e)
@@ -717,6 +1116,26 @@ ModResult ModuleFilter::OnStats(char symbol, User* user, string_list &results)
 			results.push_back(ServerInstance->Config->ServerName+" 223 "+user->nick+" :EXEMPT "+(*i));
 		}
 	}
+	else if (symbol == 'F')
+	{
+		unsigned long literals = 0;
+		for (std::vector<ImplFilter>::iterator i = filters.begin(); i != filters.end(); i++)
+		{
+			if (i->literal.empty())
+			{
+				results.push_back(ServerInstance->Config->ServerName+" 223 "+user->nick+" :FILTERSTATS Filter \""+i->freeform+"\" has no literal, ran "+
+					ConvToStr(i->regex_runs)+" times and matched "+ConvToStr(i->regex_matches));
+				continue;
+			}
+
+			literals++;
+			results.push_back(ServerInstance->Config->ServerName+" 223 "+user->nick+" :FILTERSTATS Filter \""+i->freeform+"\" literal \""+i->literal+"\" had "+
+				ConvToStr(i->literal_hits)+" hits, ran "+ConvToStr(i->regex_runs)+" times and matched "+ConvToStr(i->regex_matches));
+		}
+
+		results.push_back(ServerInstance->Config->ServerName+" 223 "+user->nick+" :FILTERSTATS "+ConvToStr(literals)+" of "+ConvToStr(filters.size())+" filters have a literal");
+		results.push_back(ServerInstance->Config->ServerName+" 223 "+user->nick+" :FILTERSTATS Checked "+ConvToStr(stats_checks)+" texts, skipped "+ConvToStr(stats_skipped)+" regexes");
+	}
 	return MOD_RES_PASSTHRU;
 }
 
@@ -734,4 +1153,26 @@ void ModuleFilter::OnUnloadModule(Module* mod)
 	}
 }
 
+/* Test that the literal found in regex x is y */
+#define LITERALTEST(x, y) std::cout << "GetRegexLiteral(\"" << x << "\") == \"" << y << "\" " << (GetRegexLiteral(x) == y ? "SUCCESS!\n" : "FAILURE\n")
+
+void ModuleFilter::OnRunTestSuite()
+{
+	std::cout << "\n\nFilter literal tests\n\n";
+
+	LITERALTEST("buy cheap", "buy cheap");
+	LITERALTEST("buy\\s+cheap", "cheap");
+	LITERALTEST("free *money", "money");
+	LITERALTEST("ab*cd", "cd");
+	LITERALTEST("x{2,3}yz", "yz");
+	LITERALTEST("(spam|ham)burger", "burger");
+	LITERALTEST("spam|ham", "");
+	LITERALTEST("(?i)spam", "");
+	LITERALTEST("[]x]yz", "yz");
+	LITERALTEST("[^]x]yz", "yz");
+	LITERALTEST("[[:alpha:]]+spam", "spam");
+	LITERALTEST("[\\]x]yz", "");
+	LITERALTEST("a[\\d]bc", "");
+}
+
 MODULE_INIT(ModuleFilter)
@@ -143,14 +143,26 @@ class ModuleHttpStats : public Module
 					}
 				}
 
-				data << "</xlines><modulelist>";
+				data << "</xlines><modulelist hookprofiling=\"" << (ServerInstance->Modules->ProfileHooks ? "yes" : "no") << "\">";
 				std::vector<std::string> module_names = ServerInstance->Modules->GetAllModuleNames(0);
 
 				for (std::vector<std::string>::iterator i = module_names.begin(); i != module_names.end(); ++i)
 				{
 					Module* m = ServerInstance->Modules->Find(i->c_str());
 					Version v = m->GetVersion();
-					data << "<module><name>" << *i << "</name><description>" << Sanitize(v.description) << "</description></module>";
+					data << "<module><name>" << *i << "</name><description>" << Sanitize(v.description) << "</description>";
+
+					// Time spent in each hook, in microseconds; only collected while <performance:hookprofiling> is on
+					data << "<hooks>";
+					for (int hook = I_BEGIN + 1; hook != I_END; hook++)
+					{
+						const HookProfile& prof = m->profile[hook];
+						if (!prof.calls)
+							continue;
+						data << "<hook><name>" << ModuleManager::GetHookName((Implementation)hook) << "</name><calls>" << prof.calls
+							<< "</calls><total>" << prof.total / 1000 << "</total><max>" << prof.max / 1000 << "</max></hook>";
+					}
+					data << "</hooks></module>";
 				}
 				data << "</modulelist><channellist>";
 
@@ -52,8 +52,8 @@ class ModuleIRCv3 : public Module
 		std::set<User*> already_sent;
 		for (UCListIter i = chans.begin(); i != chans.end(); ++i)
 		{
-			const UserMembList* userlist = (*i)->GetUsers();
-			for (UserMembList::const_iterator m = userlist->begin(); m != userlist->end(); ++m)
+			const LocalMembList& userlist = (*i)->GetLocalUsers();
+			for (LocalMembCIter m = userlist.begin(); m != userlist.end(); ++m)
 			{
 				/*
 				 * Send the line if the channel member in question meets all of the following criteria:
@@ -64,8 +64,8 @@ class ModuleIRCv3 : public Module
 				 * - we haven't sent the line to the member yet
 				 *
 				 */
-				LocalUser* member = IS_LOCAL(m->first);
-				if ((member) && (member != user) && (ext.get(member)) && (exceptions.find(member) == exceptions.end()) && (already_sent.insert(member).second))
+				LocalUser* member = m->user;
+				if ((member != user) && (ext.get(member)) && (exceptions.find(member) == exceptions.end()) && (already_sent.insert(member).second))
 					member->Write(line);
 			}
 		}
@@ -143,12 +143,12 @@ class ModuleIRCv3 : public Module
 		std::string line;
 		std::string mode;
 
-		const UserMembList* userlist = memb->chan->GetUsers();
-		for (UserMembCIter it = userlist->begin(); it != userlist->end(); ++it)
+		const LocalMembList& userlist = memb->chan->GetLocalUsers();
+		for (LocalMembCIter it = userlist.begin(); it != userlist.end(); ++it)
 		{
-			// Send the extended join line if the current member is local, has the extended-join cap and isn't excepted
-			User* member = IS_LOCAL(it->first);
-			if ((member) && (cap_extendedjoin.ext.get(member)) && (excepts.find(member) == excepts.end()))
+			// Send the extended join line if the current member has the extended-join cap and isn't excepted
+			LocalUser* member = it->user;
+			if ((cap_extendedjoin.ext.get(member)) && (excepts.find(member) == excepts.end()))
 			{
 				// Construct the lines we're going to send if we haven't constructed them already
 				if (line.empty())
@@ -190,7 +190,7 @@ class ModuleIRCv3 : public Module
 					member->Write(mode);
 
 				// Prevent the core from sending the JOIN and MODE to this user
-				excepts.insert(it->first);
+				excepts.insert(member);
 			}
 		}
 	}
@@ -217,12 +217,12 @@ class ModuleIRCv3 : public Module
 
 		std::string line = ":" + memb->user->GetFullHost() + " AWAY :" + memb->user->awaymsg;
 
-		const UserMembList* userlist = memb->chan->GetUsers();
-		for (UserMembCIter it = userlist->begin(); it != userlist->end(); ++it)
+		const LocalMembList& userlist = memb->chan->GetLocalUsers();
+		for (LocalMembCIter it = userlist.begin(); it != userlist.end(); ++it)
 		{
-			// Send the away notify line if the current member is local, has the away-notify cap and isn't excepted
-			User* member = IS_LOCAL(it->first);
-			if ((member) && (cap_awaynotify.ext.get(member)) && (last_excepts.find(member) == last_excepts.end()))
+			// Send the away notify line if the current member has the away-notify cap and isn't excepted
+			LocalUser* member = it->user;
+			if ((cap_awaynotify.ext.get(member)) && (last_excepts.find(member) == last_excepts.end()))
 			{
 				member->Write(line);
 			}
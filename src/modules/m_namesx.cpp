@@ -35,7 +35,7 @@ class ModuleNamesX : public Module
 
 	void init() CXX11_OVERRIDE
 	{
-		Implementation eventlist[] = { I_OnPreCommand, I_OnNamesListItem, I_On005Numeric, I_OnEvent, I_OnSendWhoLine };
+		Implementation eventlist[] = { I_OnPreCommand, I_OnNamesListFormat, I_On005Numeric, I_OnEvent, I_OnSendWhoLine };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 	}
 
@@ -67,16 +67,10 @@ class ModuleNamesX : public Module
 		return MOD_RES_PASSTHRU;
 	}
 
-	void OnNamesListItem(User* issuer, Membership* memb, std::string &prefixes, std::string &nick) CXX11_OVERRIDE
+	void OnNamesListFormat(User* issuer, Channel* chan, unsigned int& format) CXX11_OVERRIDE
 	{
-		if (!cap.ext.get(issuer))
-			return;
-
-		/* Some module hid this from being displayed, dont bother */
-		if (nick.empty())
-			return;
-
-		prefixes = memb->chan->GetAllPrefixChars(memb->user);
+		if (cap.ext.get(issuer))
+			format |= NAMES_MULTIPREFIX;
 	}
 
 	void OnSendWhoLine(User* source, const std::vector<std::string>& params, User* user, std::string& line) CXX11_OVERRIDE
@@ -261,10 +261,19 @@ class ModuleNationalChars : public Module
 			charset.insert(0, "../locales/");
 		unsigned char * tables[8] = { m_additional, m_additionalMB, m_additionalUp, m_lower, m_upper, m_additionalUtf8, m_additionalUtf8range, m_additionalUtf8interval };
 		loadtables(charset, tables, 8, 5);
+		RefoldHashes();
 		forcequit = tag->getBool("forcequit");
 		CheckForceQuit("National character set changed");
 	}
 
+	/** The stored hashes of nicks and channel names depend on the case mapping */
+	void RefoldHashes()
+	{
+		ServerInstance->Users->clientlist->refold();
+		ServerInstance->chanlist->refold();
+		ServerInstance->Users->Index.Refold();
+	}
+
 	void CheckForceQuit(const char * message)
 	{
 		if (!forcequit)
@@ -283,6 +292,7 @@ class ModuleNationalChars : public Module
 	{
 		ServerInstance->IsNick = rememberer;
 		national_case_insensitive_map = lowermap_rememberer;
+		RefoldHashes();
 		CheckForceQuit("National characters module unloaded");
 	}
 
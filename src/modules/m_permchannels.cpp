@@ -188,6 +188,7 @@ public:
 				iter++;
 				FOREACH_MOD(I_OnChannelDelete, OnChannelDelete(c));
 				ServerInstance->chanlist->erase(at);
+				ServerInstance->ChannelSizes.Remove(c);
 				ServerInstance->GlobalCulls.AddItem(c);
 			}
 			else
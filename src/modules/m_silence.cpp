@@ -329,16 +329,13 @@ class ModuleSilence : public Module
 	void OnBuildExemptList(MessageType message_type, Channel* chan, User* sender, char status, CUList &exempt_list, const std::string &text)
 	{
 		int public_silence = (message_type == MSG_PRIVMSG ? SILENCE_CHANNEL : SILENCE_CNOTICE);
-		const UserMembList *ulist = chan->GetUsers();
+		const LocalMembList& ulist = chan->GetLocalUsers();
 
-		for (UserMembCIter i = ulist->begin(); i != ulist->end(); i++)
+		for (LocalMembCIter i = ulist.begin(); i != ulist.end(); ++i)
 		{
-			if (IS_LOCAL(i->first))
+			if (MatchPattern(i->user, sender, public_silence) == MOD_RES_DENY)
 			{
-				if (MatchPattern(i->first, sender, public_silence) == MOD_RES_DENY)
-				{
-					exempt_list.insert(i->first);
-				}
+				exempt_list.insert(i->user);
 			}
 		}
 	}
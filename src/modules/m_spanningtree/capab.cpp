@@ -136,6 +136,17 @@ void TreeSocket::SendCapabilities(int phase)
 	if (proto_version == 1202)
 		extra.append(" PROTOCOL="+ConvToStr(ProtocolVersion));
 
+	/* Compression methods we can receive; each side picks one from the other side's list */
+	std::string compress;
+	std::pair<std::multimap<std::string, ServiceProvider*>::iterator, std::multimap<std::string, ServiceProvider*>::iterator> methods =
+		ServerInstance->Modules->DataProviders.equal_range("compress");
+	for (std::multimap<std::string, ServiceProvider*>::iterator i = methods.first; i != methods.second; ++i)
+	{
+		compress.append(compress.empty() ? " COMPRESS=" : ",");
+		compress.append(i->second->name.substr(9));
+	}
+	extra.append(compress);
+
 	this->WriteLine("CAPAB CAPABILITIES " /* Preprocessor does this one. */
 			":NICKMAX="+ConvToStr(ServerInstance->Config->Limits.NickMax)+
 			" CHANMAX="+ConvToStr(ServerInstance->Config->Limits.ChanMax)+
@@ -315,6 +326,7 @@ bool TreeSocket::Capab(const parameterlist &params)
 			if (!this->GetTheirChallenge().empty() && (this->LinkState == CONNECTING))
 			{
 				this->SendCapabilities(2);
+				this->StartCompression(capab->link);
 				this->WriteLine("SERVER "+ServerInstance->Config->ServerName+" "+this->MakePass(capab->link->SendPass, capab->theirchallenge)+" 0 "+ServerInstance->Config->GetSID()+" :"+ServerInstance->Config->ServerDesc);
 			}
 		}
@@ -324,6 +336,7 @@ bool TreeSocket::Capab(const parameterlist &params)
 			if (this->LinkState == CONNECTING)
 			{
 				this->SendCapabilities(2);
+				this->StartCompression(capab->link);
 				this->WriteLine("SERVER "+ServerInstance->Config->ServerName+" "+capab->link->SendPass+" 0 "+ServerInstance->Config->GetSID()+" :"+ServerInstance->Config->ServerDesc);
 			}
 		}
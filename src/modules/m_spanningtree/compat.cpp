@@ -33,6 +33,8 @@ void TreeSocket::WriteLine(std::string line)
 			ServerInstance->Logs->Log("m_spanningtree", LOG_DEFAULT, "Sending line without server prefix!");
 			line = ":" + ServerInstance->Config->GetSID() + " " + line;
 		}
+		if (burst)
+			SendAheadOfBurst(line);
 		if (proto_version != ProtocolVersion)
 		{
 			std::string::size_type a = line.find(' ');
@@ -158,8 +160,8 @@ void TreeSocket::WriteLine(std::string line)
 	}
 
 	ServerInstance->Logs->Log("m_spanningtree", LOG_RAWIO, "S[%d] O %s", this->GetFd(), line.c_str());
-	this->WriteData(line);
-	this->WriteData(newline);
+	line.append(newline);
+	this->WriteStream(line);
 }
 
 namespace
@@ -194,7 +196,7 @@ bool TreeSocket::PreProcessOldProtocolMessage(User*& who, std::string& cmd, std:
 		{
 			// If it's a PING with 1 parameter, reply with a PONG now, if it's a PONG with 1 parameter (weird), do nothing
 			if (cmd[1] == 'I')
-				this->WriteData(":" + ServerInstance->Config->GetSID() + " PONG " + params[0] + newline);
+				this->WriteStream(":" + ServerInstance->Config->GetSID() + " PONG " + params[0] + newline);
 
 			// Don't process this message further
 			return false;
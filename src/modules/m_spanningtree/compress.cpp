@@ -0,0 +1,141 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2014 InspIRCd Development Team
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+#include "main.h"
+#include "utils.h"
+#include "link.h"
+#include "treesocket.h"
+
+/* Link compression sits between the protocol and the socket's IOHook, so that it
+ * works on top of SSL: lines are compressed before the IOHook encrypts them, and
+ * decompressed after it has decrypted them. Each side decides on its own whether to
+ * compress what it sends; it sends "COMPRESS <method>" in plain text, and everything
+ * after that line is one compressed stream.
+ */
+
+void TreeSocket::WriteStream(const std::string& data)
+{
+	if (!deflater)
+	{
+		this->WriteData(data);
+		return;
+	}
+
+	std::string out;
+	deflater->Compress(data, out, false);
+	if (!out.empty())
+		this->WriteData(out);
+
+	if (!deflatepending)
+	{
+		// Make sure DoWrite() is called to flush the deflater, even if nothing reached the sendq yet
+		deflatepending = true;
+		ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+	}
+}
+
+void TreeSocket::StartCompression(Link* link)
+{
+	if (link->Compress.empty() || deflater)
+		return;
+
+	std::map<std::string, std::string>::iterator n = capab->CapKeys.find("COMPRESS");
+	bool supported = false;
+	if (n != capab->CapKeys.end())
+	{
+		irc::commasepstream methods(n->second);
+		std::string method;
+		while (!supported && methods.GetToken(method))
+			supported = (method == link->Compress);
+	}
+
+	if (!supported)
+	{
+		ServerInstance->SNO->WriteToSnoMask('l', "Not compressing the link to \2%s\2: the remote server does not support '%s'",
+			linkID.c_str(), link->Compress.c_str());
+		return;
+	}
+
+	CompressProvider* prov = ServerInstance->Modules->FindDataService<CompressProvider>("compress/" + link->Compress);
+	if (!prov)
+	{
+		ServerInstance->SNO->WriteToSnoMask('l', "Not compressing the link to \2%s\2: compression method '%s' is not loaded",
+			linkID.c_str(), link->Compress.c_str());
+		return;
+	}
+
+	this->WriteLine("COMPRESS " + link->Compress);
+	deflater = prov->CreateCompressor();
+	deflatemod = prov->creator;
+}
+
+void TreeSocket::Compress(parameterlist& params)
+{
+	if (params.empty() || inflater)
+	{
+		this->SendError("Invalid COMPRESS");
+		return;
+	}
+
+	CompressProvider* prov = ServerInstance->Modules->FindDataService<CompressProvider>("compress/" + params[0]);
+	if (!prov)
+	{
+		this->SendError("Compression method not supported: " + params[0]);
+		return;
+	}
+
+	inflater = prov->CreateDecompressor();
+	inflatemod = prov->creator;
+
+	// Anything after this line in the recvq came in compressed
+	this->Inflate(recvq.length() - getRecvQSize());
+}
+
+bool TreeSocket::Inflate(size_t start)
+{
+	if (start >= recvq.length())
+		return true;
+
+	std::string plain;
+	if (!inflater->Decompress(recvq.substr(start), plain))
+	{
+		this->SendError("Compressed data from the remote server is corrupt");
+		return false;
+	}
+	recvq.replace(start, std::string::npos, plain);
+	return true;
+}
+
+void TreeSocket::DropCompression(Module* mod)
+{
+	if ((!deflater || deflatemod != mod) && (!inflater || inflatemod != mod))
+		return;
+
+	this->SendError("Compression module unloaded");
+	this->Close();
+
+	// The streams have to go before the module they came from is unloaded
+	delete deflater;
+	delete inflater;
+	deflater = NULL;
+	inflater = NULL;
+	deflatepending = false;
+}
@@ -53,6 +53,7 @@ void ModuleSpanningTree::init()
 {
 	Utils = new SpanningTreeUtilities(this);
 	commands = new SpanningTreeCommands(this);
+	ServerInstance->Modules->AddService(Utils->ChannelRoutes);
 	ServerInstance->Modules->AddService(commands->rconnect);
 	ServerInstance->Modules->AddService(commands->rsquit);
 	ServerInstance->Modules->AddService(commands->svsjoin);
@@ -558,6 +559,8 @@ void ModuleSpanningTree::OnUserJoin(Membership* memb, bool sync, bool created_by
 			Utils->DoOneToMany(memb->user->uuid, "IJOIN", params);
 		}
 	}
+	else
+		Utils->AddChannelRoute(memb);
 }
 
 void ModuleSpanningTree::OnChangeHost(User* user, const std::string &newhost)
@@ -601,6 +604,8 @@ void ModuleSpanningTree::OnUserPart(Membership* memb, std::string &partmessage,
 			params.push_back(":"+partmessage);
 		Utils->DoOneToMany(memb->user->uuid,"PART",params);
 	}
+	else
+		Utils->DelChannelRoute(memb);
 }
 
 void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const std::string &oper_message)
@@ -618,6 +623,11 @@ void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const
 		params.push_back(":"+reason);
 		Utils->DoOneToMany(user->uuid,"QUIT",params);
 	}
+	else if (!IS_LOCAL(user))
+	{
+		for (UCListIter i = user->chans.begin(); i != user->chans.end(); ++i)
+			Utils->DelChannelRoute((*i)->GetUser(user));
+	}
 
 	// Regardless, We need to modify the user Counts..
 	TreeServer* SourceServer = Utils->FindServer(user->server);
@@ -653,6 +663,9 @@ void ModuleSpanningTree::OnUserPostNick(User* user, const std::string &oldnick)
 
 void ModuleSpanningTree::OnUserKick(User* source, Membership* memb, const std::string &reason, CUList& excepts)
 {
+	if (!IS_LOCAL(memb->user))
+		Utils->DelChannelRoute(memb);
+
 	parameterlist params;
 	params.push_back(memb->chan->name);
 	params.push_back(memb->user->uuid);
@@ -746,7 +759,14 @@ void ModuleSpanningTree::OnUnloadModule(Module* mod)
 			sock->SendError("SSL module unloaded");
 			sock->Close();
 		}
+		else if (sock)
+		{
+			sock->DropCompression(mod);
+		}
 	}
+
+	for (std::map<TreeSocket*, std::pair<std::string, int> >::iterator i = Utils->timeoutlist.begin(); i != Utils->timeoutlist.end(); ++i)
+		i->first->DropCompression(mod);
 }
 
 // note: the protocol does not allow direct umode +o except
@@ -45,16 +45,154 @@ void TreeSocket::DoBurst(TreeServer* s)
 	this->WriteLine(":" + ServerInstance->Config->GetSID() + " VERSION :"+ServerInstance->GetVersionString());
 	/* Send server tree */
 	this->SendServers(Utils->TreeRoot, s);
-	/* Send users and their oper status */
-	this->SendUsers();
 
+	/* Users, channels and X-lines follow as the link keeps up with them.
+	 * Only users which have finished registering are sent; the rest are
+	 * introduced to the server when they do. Channels created from here on
+	 * are sent the usual way.
+	 */
+	burst = new BurstState;
+	burst->phase = BurstState::BURST_USERS;
+	burst->xlinetype = 0;
+	burst->start = ServerInstance->Time();
+	for (user_hash::iterator u = ServerInstance->Users->clientlist->begin(); u != ServerInstance->Users->clientlist->end(); ++u)
+	{
+		if (u->second->registered == REG_ALL)
+			burst->users.insert(u->second->uuid);
+	}
 	for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); ++i)
-		SyncChannel(i->second);
+		burst->chans.insert(i->second->name);
+
+	this->ContinueBurst();
+}
+
+void TreeSocket::ContinueBurst()
+{
+	while (burst && getSendQSize() < BURST_SENDQ_HIGH)
+	{
+		if (LinkState != CONNECTED || !getError().empty())
+		{
+			delete burst;
+			burst = NULL;
+			return;
+		}
+
+		switch (burst->phase)
+		{
+			case BurstState::BURST_USERS:
+				if (burst->users.empty())
+					burst->phase = BurstState::BURST_CHANNELS;
+				else
+					SendUserAhead(*burst->users.begin());
+			break;
+			case BurstState::BURST_CHANNELS:
+				if (burst->chans.empty())
+				{
+					burst->phase = BurstState::BURST_XLINES;
+					burst->xlinetypes = ServerInstance->XLines->GetAllTypes();
+				}
+				else
+				{
+					Channel* c = ServerInstance->FindChan(*burst->chans.begin());
+					burst->chans.erase(burst->chans.begin());
+					if (c)
+						SyncChannel(c);
+				}
+			break;
+			case BurstState::BURST_XLINES:
+				if (!SendNextXLine())
+					FinishBurst();
+			break;
+		}
+	}
+}
+
+void TreeSocket::SendUserAhead(const std::string& uuid)
+{
+	if (!burst->users.erase(uuid))
+		return;
+
+	User* u = ServerInstance->FindUUID(uuid);
+	if (u && !u->quitting)
+		SendUser(u);
+}
+
+void TreeSocket::SendAheadOfBurst(const std::string& line)
+{
+	if (burst->users.empty() && burst->chans.empty())
+		return;
+
+	// :<source> <command> <target> ...
+	std::string::size_type a = line.find(' ');
+	std::string::size_type b = (a == std::string::npos) ? a : line.find(' ', a + 1);
+	if (b == std::string::npos)
+		return;
+
+	if (!burst->users.empty())
+	{
+		SendUserAhead(line.substr(1, a - 1));
+
+		// The members of a channel are given as <modes>,<uuid> after its modes
+		if (line.compare(a + 1, b - a - 1, "FJOIN") == 0)
+		{
+			std::string::size_type members = line.find(" :", b);
+			if (members != std::string::npos)
+			{
+				irc::spacesepstream list(line.substr(members + 2));
+				std::string item;
+				while (list.GetToken(item))
+					SendUserAhead(item.substr(item.find(',') + 1));
+			}
+		}
+	}
+
+	if (!burst->chans.empty() && line.compare(b + 1, 1, "#") == 0)
+	{
+		// Sending the channel sends the users in it that have not been sent either
+		std::set<std::string>::iterator i = burst->chans.find(line.substr(b + 1, line.find(' ', b + 1) - b - 1));
+		if (i == burst->chans.end())
+			return;
+
+		Channel* c = ServerInstance->FindChan(*i);
+		burst->chans.erase(i);
+		if (c)
+			SyncChannel(c);
+	}
+}
 
-	this->SendXLines();
+void TreeSocket::FinishBurst()
+{
 	FOREACH_MOD(I_OnSyncNetwork,OnSyncNetwork(Utils->Creator,(void*)this));
 	this->WriteLine(":" + ServerInstance->Config->GetSID() + " ENDBURST");
-	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \2"+ s->GetName()+"\2.");
+	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \2%s\2 (%lu secs).", MyRoot->GetName().c_str(),
+		(unsigned long)(ServerInstance->Time() - burst->start));
+	delete burst;
+	burst = NULL;
+}
+
+void TreeSocket::DoWrite()
+{
+	if (deflatepending)
+	{
+		std::string data;
+		deflater->Compress(std::string(), data, true);
+		deflatepending = false;
+		this->WriteData(data);
+	}
+
+	this->BufferedSocket::DoWrite();
+	if (!burst)
+		return;
+
+	if (getSendQSize() < BURST_SENDQ_LOW)
+		ContinueBurst();
+
+	/* Come back as soon as the socket can take more, rather than when something
+	 * else wakes up the main loop; only one chunk of the burst is sent per loop
+	 * so that clients are still served while it is in progress.
+	 */
+	if (burst && getError().empty())
+		ServerInstance->SE->ChangeEventMask(this, FD_WANT_POLL_WRITE);
 }
 
 /** Recursively send the server tree.
@@ -116,41 +254,42 @@ void TreeSocket::SendFJoins(Channel* c)
 	static_cast<ListModeBase*>(*ban)->DoSyncChannel(c, Utils->Creator, this);
 }
 
-/** Send all XLines we know about */
-void TreeSocket::SendXLines()
+/** Send the next burstable X-line after the last one sent */
+bool TreeSocket::SendNextXLine()
 {
 	char data[MAXBUF];
 
-	std::vector<std::string> types = ServerInstance->XLines->GetAllTypes();
-
-	for (std::vector<std::string>::const_iterator it = types.begin(); it != types.end(); ++it)
+	while (burst->xlinetype < burst->xlinetypes.size())
 	{
-		/* Expired lines are removed in XLineManager::GetAll() */
-		XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
-
-		/* lookup cannot be NULL in this case but a check won't hurt */
+		/* Lines can be added and removed between calls, so find the next one by mask */
+		XLineLookup* lookup = ServerInstance->XLines->GetAll(burst->xlinetypes[burst->xlinetype]);
+		LookupIter i;
 		if (lookup)
+			i = burst->lastxline.empty() ? lookup->begin() : lookup->upper_bound(burst->lastxline);
+
+		/* Is it burstable? this is better than an explicit check for type 'K'.
+		 * We skip the type as NONE of the items in this group are worth iterating.
+		 */
+		if (!lookup || i == lookup->end() || !i->second->IsBurstable())
 		{
-			for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
-			{
-				/* Is it burstable? this is better than an explicit check for type 'K'.
-				 * We break the loop as NONE of the items in this group are worth iterating.
-				 */
-				if (!i->second->IsBurstable())
-					break;
-
-				snprintf(data, MAXBUF, ":%s ADDLINE %s %s %s %lu %lu :%s",
-						ServerInstance->Config->GetSID().c_str(),
-						it->c_str(),
-						i->second->Displayable().c_str(),
-						i->second->source.c_str(),
-						(unsigned long)i->second->set_time,
-						(unsigned long)i->second->duration,
-						i->second->reason.c_str());
-				this->WriteLine(data);
-			}
+			burst->xlinetype++;
+			burst->lastxline.clear();
+			continue;
 		}
+
+		snprintf(data, MAXBUF, ":%s ADDLINE %s %s %s %lu %lu :%s",
+				ServerInstance->Config->GetSID().c_str(),
+				burst->xlinetypes[burst->xlinetype].c_str(),
+				i->second->Displayable().c_str(),
+				i->second->source.c_str(),
+				(unsigned long)i->second->set_time,
+				(unsigned long)i->second->duration,
+				i->second->reason.c_str());
+		this->WriteLine(data);
+		burst->lastxline = i->first;
+		return true;
 	}
+	return false;
 }
 
 /** Send channel topic, modes and metadata */
@@ -179,53 +318,45 @@ void TreeSocket::SyncChannel(Channel* chan)
 	FOREACH_MOD(I_OnSyncChannel,OnSyncChannel(chan, Utils->Creator, this));
 }
 
-/** send all users and their oper state/modes */
-void TreeSocket::SendUsers()
+/** Send a user and their oper state/modes */
+void TreeSocket::SendUser(User* u)
 {
 	char data[MAXBUF];
-	std::string dataline;
-	for (user_hash::iterator u = ServerInstance->Users->clientlist->begin(); u != ServerInstance->Users->clientlist->end(); u++)
+	TreeServer* theirserver = Utils->FindServer(u->server);
+	if (theirserver)
 	{
-		if (u->second->registered == REG_ALL)
+		snprintf(data,MAXBUF,":%s UID %s %lu %s %s %s %s %s %lu +%s :%s",
+				theirserver->GetID().c_str(),	/* Prefix: SID */
+				u->uuid.c_str(),	/* 0: UUID */
+				(unsigned long)u->age,	/* 1: TS */
+				u->nick.c_str(),	/* 2: Nick */
+				u->host.c_str(),	/* 3: Displayed Host */
+				u->dhost.c_str(),	/* 4: Real host */
+				u->ident.c_str(),	/* 5: Ident */
+				u->GetIPString().c_str(),	/* 6: IP string */
+				(unsigned long)u->signon, /* 7: Signon time for WHOWAS */
+				u->FormatModes(true),	/* 8...n: Modes and params */
+				u->fullname.c_str());	/* size-1: GECOS */
+		this->WriteLine(data);
+		if (u->IsOper())
 		{
-			TreeServer* theirserver = Utils->FindServer(u->second->server);
-			if (theirserver)
-			{
-				snprintf(data,MAXBUF,":%s UID %s %lu %s %s %s %s %s %lu +%s :%s",
-						theirserver->GetID().c_str(),	/* Prefix: SID */
-						u->second->uuid.c_str(),	/* 0: UUID */
-						(unsigned long)u->second->age,	/* 1: TS */
-						u->second->nick.c_str(),	/* 2: Nick */
-						u->second->host.c_str(),	/* 3: Displayed Host */
-						u->second->dhost.c_str(),	/* 4: Real host */
-						u->second->ident.c_str(),	/* 5: Ident */
-						u->second->GetIPString().c_str(),	/* 6: IP string */
-						(unsigned long)u->second->signon, /* 7: Signon time for WHOWAS */
-						u->second->FormatModes(true),	/* 8...n: Modes and params */
-						u->second->fullname.c_str());	/* size-1: GECOS */
-				this->WriteLine(data);
-				if (u->second->IsOper())
-				{
-					snprintf(data,MAXBUF,":%s OPERTYPE :%s", u->second->uuid.c_str(), u->second->oper->name.c_str());
-					this->WriteLine(data);
-				}
-				if (u->second->IsAway())
-				{
-					snprintf(data,MAXBUF,":%s AWAY %ld :%s", u->second->uuid.c_str(), (long)u->second->awaytime, u->second->awaymsg.c_str());
-					this->WriteLine(data);
-				}
-			}
-
-			for(Extensible::ExtensibleStore::const_iterator i = u->second->GetExtList().begin(); i != u->second->GetExtList().end(); i++)
-			{
-				ExtensionItem* item = i->first;
-				std::string value = item->serialize(FORMAT_NETWORK, u->second, i->second);
-				if (!value.empty())
-					Utils->Creator->ProtoSendMetaData(this, u->second, item->name, value);
-			}
-
-			FOREACH_MOD(I_OnSyncUser,OnSyncUser(u->second,Utils->Creator,this));
+			snprintf(data,MAXBUF,":%s OPERTYPE :%s", u->uuid.c_str(), u->oper->name.c_str());
+			this->WriteLine(data);
+		}
+		if (u->IsAway())
+		{
+			snprintf(data,MAXBUF,":%s AWAY %ld :%s", u->uuid.c_str(), (long)u->awaytime, u->awaymsg.c_str());
+			this->WriteLine(data);
 		}
 	}
-}
 
+	for(Extensible::ExtensibleStore::const_iterator i = u->GetExtList().begin(); i != u->GetExtList().end(); i++)
+	{
+		ExtensionItem* item = i->first;
+		std::string value = item->serialize(FORMAT_NETWORK, u, i->second);
+		if (!value.empty())
+			Utils->Creator->ProtoSendMetaData(this, u, item->name, value);
+	}
+
+	FOREACH_MOD(I_OnSyncUser,OnSyncUser(u,Utils->Creator,this));
+}
@@ -249,6 +249,7 @@ bool TreeSocket::Inbound_Server(parameterlist &params)
 
 		// Send our details: Our server name and description and hopcount of 0,
 		// along with the sendpass from this block.
+		this->StartCompression(x);
 		this->WriteLine("SERVER "+ServerInstance->Config->ServerName+" "+this->MakePass(x->SendPass, this->GetTheirChallenge())+" 0 "+ServerInstance->Config->GetSID()+" :"+ServerInstance->Config->ServerDesc);
 
 		// move to the next state, we are now waiting for THEM.
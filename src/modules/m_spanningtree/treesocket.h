@@ -23,6 +23,7 @@
 #pragma once
 
 #include "inspircd.h"
+#include "modules/compress.h"
 
 #include "utils.h"
 
@@ -83,6 +84,35 @@ struct CapabData
 	bool hidden;
 };
 
+/** Progress of a netburst being sent to a server. The burst is sent a bit at a time
+ * whenever the sendq of the link runs low, see TreeSocket::ContinueBurst().
+ *
+ * Users and channels are sent by name, from lists taken when the burst starts; ones
+ * that are gone by the time they come up are skipped, and ones that were created after
+ * the lists were taken are introduced to the server the usual way. Anything else sent to
+ * the server while the burst is in progress is still sent right away, but a user that is
+ * its source or a channel that is its target is sent ahead of its turn first, see
+ * TreeSocket::SendAheadOfBurst(), so that the server does not drop it.
+ */
+struct BurstState
+{
+	enum Phase { BURST_USERS, BURST_CHANNELS, BURST_XLINES };
+
+	/** Part of the burst being sent */
+	Phase phase;
+	/** UUIDs of the users still to be sent */
+	std::set<std::string> users;
+	/** Names of the channels still to be sent */
+	std::set<std::string> chans;
+	/** X-line types, and the index of the type being sent */
+	std::vector<std::string> xlinetypes;
+	size_t xlinetype;
+	/** Last X-line sent of the current type, or empty if none have been sent yet */
+	irc::string lastxline;
+	/** Time the burst started */
+	time_t start;
+};
+
 /** Every SERVER connection inbound or outbound is represented by an object of
  * type TreeSocket. During setup, the object can be found in Utils->timeoutlist;
  * after setup, MyRoot will have been created as a child of Utils->TreeRoot
@@ -93,16 +123,34 @@ class TreeSocket : public BufferedSocket
 	std::string linkID;			/* Description for this link */
 	ServerState LinkState;			/* Link state */
 	CapabData* capab;			/* Link setup data (held until burst is sent) */
+	BurstState* burst;			/* Netburst in progress, or NULL */
+	Compressor* deflater;			/* Compresses what we send, or NULL */
+	Decompressor* inflater;			/* Decompresses what we receive, or NULL */
+	reference<Module> deflatemod;		/* Module providing the deflater */
+	reference<Module> inflatemod;		/* Module providing the inflater */
+	bool deflatepending;			/* Data was given to the deflater since it was last flushed */
+	size_t inflated;			/* Bytes at the start of the recvq that are already decompressed */
 	TreeServer* MyRoot;			/* The server we are talking to */
 	time_t NextPing;			/* Time when we are due to ping this server */
 	bool LastPingWasGood;			/* Responded to last ping we sent? */
 	int proto_version;			/* Remote protocol version */
 	bool ConnectionFailureShown; /* Set to true if a connection failure message was shown */
 
+	/** Size of the sendq up to which more of a netburst is queued */
+	static const size_t BURST_SENDQ_HIGH = 512 * 1024;
+	/** Size the sendq has to drop below before more of a netburst is queued */
+	static const size_t BURST_SENDQ_LOW = 128 * 1024;
+
 	/** Checks if the given servername and sid are both free
 	 */
 	bool CheckDuplicate(const std::string& servername, const std::string& sid);
 
+	/** Decompress the end of the recvq in place
+	 * @param start Offset of the first compressed byte
+	 * @return False if the data was corrupt, in which case the link is closed
+	 */
+	bool Inflate(size_t start);
+
  public:
 	time_t age;
 
@@ -218,22 +266,50 @@ class TreeSocket : public BufferedSocket
 	 */
 	void SendFJoins(Channel* c);
 
-	/** Send G, Q, Z and E lines */
-	void SendXLines();
+	/** Send the next G, Q, Z or E line of the burst
+	 * @return False if there are no more lines to send
+	 */
+	bool SendNextXLine();
 
 	/** Send all known information about a channel */
 	void SyncChannel(Channel* chan);
 
-	/** send all users and their oper state/modes */
-	void SendUsers();
+	/** Send a user and their oper state/modes */
+	void SendUser(User* u);
+
+	/** Send a user now if the burst has not sent them yet
+	 * @param uuid The UUID of the user
+	 */
+	void SendUserAhead(const std::string& uuid);
+
+	/** Send the user that is the source of a line, the users an FJOIN adds, and
+	 * the channel that is the target of a line, if the burst has not sent them yet
+	 * @param line The line about to be sent
+	 */
+	void SendAheadOfBurst(const std::string& line);
 
 	/** This function is called when we want to send a netburst to a local
 	 * server. There is a set order we must do this, because for example
 	 * users require their servers to exist, and channels require their
 	 * users to exist. You get the idea.
+	 * Only the server tree is sent right away, the rest of the burst is
+	 * sent by ContinueBurst() as the link keeps up with it.
 	 */
 	void DoBurst(TreeServer* s);
 
+	/** Send more of the netburst, until the sendq reaches BURST_SENDQ_HIGH
+	 * or the burst is complete
+	 */
+	void ContinueBurst();
+
+	/** Send the end of the netburst */
+	void FinishBurst();
+
+	/** Flush the deflater, write out the sendq, and send more of the netburst
+	 * if one is in progress and the sendq has dropped below BURST_SENDQ_LOW
+	 */
+	void DoWrite() CXX11_OVERRIDE;
+
 	/** This function is called when we receive data from a remote
 	 * server.
 	 */
@@ -243,6 +319,27 @@ class TreeSocket : public BufferedSocket
 	 */
 	void WriteLine(std::string line);
 
+	/** Send data down the socket, compressing it if compression was started.
+	 * Compressed data is flushed by DoWrite(), so that all lines sent in one
+	 * go through the main loop are compressed together.
+	 */
+	void WriteStream(const std::string& data);
+
+	/** Start compressing the data we send, if the link block asks for it and the
+	 * remote server supports the method. Everything sent after this is compressed.
+	 */
+	void StartCompression(Link* link);
+
+	/** Handle COMPRESS, which tells us the remote server compresses everything it
+	 * sends after it
+	 */
+	void Compress(parameterlist& params);
+
+	/** Close the link if its compression is provided by the given module, which is
+	 * being unloaded
+	 */
+	void DropCompression(Module* mod);
+
 	/** Handle ERROR command */
 	void Error(parameterlist &params);
 
@@ -43,6 +43,11 @@ TreeSocket::TreeSocket(SpanningTreeUtilities* Util, Link* link, Autoconnect* mya
 	capab->link = link;
 	capab->ac = myac;
 	capab->capab_phase = 0;
+	burst = NULL;
+	deflater = NULL;
+	inflater = NULL;
+	deflatepending = false;
+	inflated = 0;
 	MyRoot = NULL;
 	proto_version = 0;
 	ConnectionFailureShown = false;
@@ -71,6 +76,11 @@ TreeSocket::TreeSocket(SpanningTreeUtilities* Util, int newfd, ListenSocket* via
 {
 	capab = new CapabData;
 	capab->capab_phase = 0;
+	burst = NULL;
+	deflater = NULL;
+	inflater = NULL;
+	deflatepending = false;
+	inflated = 0;
 	MyRoot = NULL;
 	age = ServerInstance->Time();
 	LinkState = WAIT_AUTH_1;
@@ -112,6 +122,9 @@ TreeSocket::~TreeSocket()
 {
 	if (capab)
 		delete capab;
+	delete burst;
+	delete deflater;
+	delete inflater;
 }
 
 /** When an outbound connection finishes connecting, we receive
@@ -225,6 +238,12 @@ void TreeSocket::Squit(TreeServer* Current, const std::string &reason)
 void TreeSocket::OnDataReady()
 {
 	Utils->Creator->loopCall = true;
+	if (inflater && !Inflate(inflated))
+	{
+		Utils->Creator->loopCall = false;
+		return;
+	}
+
 	std::string line;
 	while (GetNextLine(line))
 	{
@@ -240,7 +259,9 @@ void TreeSocket::OnDataReady()
 		if (!getError().empty())
 			break;
 	}
-	if (LinkState != CONNECTED && recvq.length() > 4096)
+	// Whatever is left is part of a line and gets more data appended to it on the next read
+	inflated = getRecvQSize();
+	if (LinkState != CONNECTED && getRecvQSize() > 4096)
 		SendError("RecvQ overrun (line too long)");
 	Utils->Creator->loopCall = false;
 }
@@ -87,6 +87,15 @@ void TreeSocket::ProcessLine(std::string &line)
 	if (command.empty())
 		return;
 
+	/* Compression is started by each side before it sends its SERVER, so this
+	 * can turn up in any state up to the end of the negotiation.
+	 */
+	if ((command == "COMPRESS") && (prefix.empty()) && (this->LinkState != CONNECTED) && (this->LinkState != DYING))
+	{
+		this->Compress(params);
+		return;
+	}
+
 	switch (this->LinkState)
 	{
 		case WAIT_AUTH_1:
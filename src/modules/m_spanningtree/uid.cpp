@@ -138,6 +138,7 @@ CmdResult CommandUID::Handle(const parameterlist &params, User* serversrc)
 	_new->SetClientIP(params[6].c_str());
 
 	ServerInstance->Users->AddGlobalClone(_new);
+	ServerInstance->Users->Index.Add(_new);
 	remoteserver->UserCount++;
 
 	bool dosend = true;
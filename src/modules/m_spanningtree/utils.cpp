@@ -127,7 +127,7 @@ TreeServer* SpanningTreeUtilities::FindServerID(const std::string &id)
 }
 
 SpanningTreeUtilities::SpanningTreeUtilities(ModuleSpanningTree* C)
-	: RefreshTimer(this), Creator(C)
+	: RefreshTimer(this), Creator(C), ChannelRoutes("spanningtree_routes", C)
 {
 	ServerInstance->Timers->AddTimer(&RefreshTimer);
 	ServerInstance->Logs->Log("m_spanningtree", LOG_DEBUG, "***** Using SID for hash: %s *****", ServerInstance->Config->GetSID().c_str());
@@ -166,6 +166,10 @@ SpanningTreeUtilities::~SpanningTreeUtilities()
 /* returns a list of DIRECT servernames for a specific channel */
 void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeServerList &list, char status, const CUList &exempt_list)
 {
+	ChannelRouteMap* routes = ChannelRoutes.get(c);
+	if (!routes)
+		return;
+
 	unsigned int minrank = 0;
 	if (status)
 	{
@@ -174,24 +178,63 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeServerLis
 			minrank = mh->GetPrefixRank();
 	}
 
-	const UserMembList *ulist = c->GetUsers();
-
-	for (UserMembCIter i = ulist->begin(); i != ulist->end(); i++)
+	for (ChannelRouteMap::const_iterator i = routes->begin(); i != routes->end(); ++i)
 	{
-		if (IS_LOCAL(i->first))
-			continue;
-
-		if (minrank && i->second->getRank() < minrank)
+		if (!minrank && exempt_list.empty())
+		{
+			list.insert(i->first);
 			continue;
+		}
 
-		if (exempt_list.find(i->first) == exempt_list.end())
+		// Only send it down this route if someone behind it is meant to get it
+		for (std::set<Membership*>::const_iterator j = i->second.begin(); j != i->second.end(); ++j)
 		{
-			TreeServer* best = this->BestRouteTo(i->first->server);
-			if (best)
-				list.insert(best);
+			Membership* memb = *j;
+			if (minrank && memb->getRank() < minrank)
+				continue;
+
+			if (exempt_list.find(memb->user) == exempt_list.end())
+			{
+				list.insert(i->first);
+				break;
+			}
 		}
 	}
-	return;
+}
+
+void SpanningTreeUtilities::AddChannelRoute(Membership* memb)
+{
+	TreeServer* route = this->BestRouteTo(memb->user->server);
+	if (!route)
+		return;
+
+	ChannelRouteMap* routes = ChannelRoutes.get(memb->chan);
+	if (!routes)
+	{
+		routes = new ChannelRouteMap;
+		ChannelRoutes.set(memb->chan, routes);
+	}
+	(*routes)[route].insert(memb);
+}
+
+void SpanningTreeUtilities::DelChannelRoute(Membership* memb)
+{
+	ChannelRouteMap* routes = ChannelRoutes.get(memb->chan);
+	if (!routes)
+		return;
+
+	TreeServer* route = this->BestRouteTo(memb->user->server);
+	ChannelRouteMap::iterator i = routes->find(route);
+	if (i == routes->end())
+		return;
+
+	i->second.erase(memb);
+	if (i->second.empty())
+	{
+		routes->erase(i);
+		if (routes->empty())
+			ChannelRoutes.unset(memb->chan);
+	}
 }
 
 std::string SpanningTreeUtilities::ConstructLine(const std::string& prefix, const std::string& command, const parameterlist& params)
@@ -339,6 +382,7 @@ void SpanningTreeUtilities::ReadConfiguration()
 		L->HiddenFromStats = tag->getBool("statshidden");
 		L->Timeout = tag->getInt("timeout", 30);
 		L->Hook = tag->getString("ssl");
+		L->Compress = tag->getString("compress");
 		L->Bind = tag->getString("bind");
 		L->Hidden = tag->getBool("hidden");
 
@@ -36,10 +36,15 @@ class SpanningTreeUtilities;
 /* This hash_map holds the hash equivalent of the server
  * tree, used for rapid linear lookups.
  */
-typedef TR1NS::unordered_map<std::string, TreeServer*, irc::insensitive, irc::StrHashComp> server_hash;
+typedef irc::hash_map<TreeServer*> server_hash;
 
 typedef std::set<TreeServer*> TreeServerList;
 
+/** Remote members of a channel, by the route to their server. This lets a channel message
+ * be sent down every route that has members behind it without looking at each member.
+ */
+typedef std::map<TreeServer*, std::set<Membership*> > ChannelRouteMap;
+
 /** Contains helper functions and variables for this module,
  * and keeps them out of the global namespace
  */
@@ -115,6 +120,11 @@ class SpanningTreeUtilities : public classbase
 	 */
 	int PingFreq;
 
+	/** Remote members of each channel by route, kept up to date by AddChannelRoute()
+	 * and DelChannelRoute() as remote users join and leave channels
+	 */
+	SimpleExtItem<ChannelRouteMap> ChannelRoutes;
+
 	/** Initialise utility class
 	 */
 	SpanningTreeUtilities(ModuleSpanningTree* Creator);
@@ -149,6 +159,14 @@ class SpanningTreeUtilities : public classbase
 	 */
 	void GetListOfServersForChannel(Channel* c, TreeServerList &list, char status, const CUList &exempt_list);
 
+	/** Add a remote member to the routes of its channel
+	 */
+	void AddChannelRoute(Membership* memb);
+
+	/** Remove a remote member from the routes of its channel
+	 */
+	void DelChannelRoute(Membership* memb);
+
 	/** Find a server by name
 	 */
 	TreeServer* FindServer(const std::string &ServerName);
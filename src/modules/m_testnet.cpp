@@ -164,6 +164,7 @@ static void checkall(Module* noimpl)
 	CHK(OnText);
 	CHK(OnPassCompare);
 	CHK(OnRunTestSuite);
+	CHK(OnNamesListFormat);
 	CHK(OnNamesListItem);
 	CHK(OnNumeric);
 	CHK(OnHookIO);
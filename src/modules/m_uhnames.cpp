@@ -35,7 +35,7 @@ class ModuleUHNames : public Module
 
 	void init() CXX11_OVERRIDE
 	{
-		Implementation eventlist[] = { I_OnEvent, I_OnPreCommand, I_OnNamesListItem, I_On005Numeric };
+		Implementation eventlist[] = { I_OnEvent, I_OnPreCommand, I_OnNamesListFormat, I_On005Numeric };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 	}
 
@@ -67,15 +67,10 @@ class ModuleUHNames : public Module
 		return MOD_RES_PASSTHRU;
 	}
 
-	void OnNamesListItem(User* issuer, Membership* memb, std::string &prefixes, std::string &nick) CXX11_OVERRIDE
+	void OnNamesListFormat(User* issuer, Channel* chan, unsigned int& format) CXX11_OVERRIDE
 	{
-		if (!cap.ext.get(issuer))
-			return;
-
-		if (nick.empty())
-			return;
-
-		nick = memb->user->GetFullHost();
+		if (cap.ext.get(issuer))
+			format |= NAMES_UHNAMES;
 	}
 
 	void OnEvent(Event& ev) CXX11_OVERRIDE
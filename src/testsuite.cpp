@@ -64,6 +64,7 @@ TestSuite::TestSuite()
 		std::cout << "(6) Comma sepstream tests\n";
 		std::cout << "(7) Space sepstream tests\n";
 		std::cout << "(8) UID generation tests\n";
+		std::cout << "(9) Nick hash table tests and benchmarks\n";
 
 		std::cout << std::endl << "(X) Exit test suite\n";
 
@@ -107,6 +108,9 @@ TestSuite::TestSuite()
 			case '8':
 				std::cout << (DoGenerateUIDTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
 				break;
+			case '9':
+				std::cout << (DoHashMapTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
 			case 'X':
 				return;
 				break;
@@ -391,6 +395,124 @@ bool TestSuite::DoGenerateUIDTests()
 	return true;
 }
 
+/** The hash table user_hash and chan_hash used to be */
+typedef TR1NS::unordered_map<std::string, User*, irc::insensitive, irc::StrHashComp> old_user_hash;
+
+/** Time one step of a hash table benchmark */
+class HashBenchTimer
+{
+	const char* const name;
+	const clock_t start;
+
+ public:
+	HashBenchTimer(const char* Name) : name(Name), start(clock()) { }
+	~HashBenchTimer()
+	{
+		std::cout << "  " << name << ": " << (clock() - start) * 1000 / CLOCKS_PER_SEC << " ms\n";
+	}
+};
+
+/** Run the same inserts, lookups and removals against a hash table, and count the lookups that succeed
+ * @param keys The keys to add, all different
+ * @param lookups Keys to look up, including keys that are not in the table
+ * @return The number of successful lookups, then the number of entries left at the end
+ */
+template<typename Map>
+static std::pair<size_t, size_t> HashMapBenchmark(const std::vector<std::string>& keys, const std::vector<std::string>& lookups)
+{
+	Map map;
+	size_t found = 0;
+	{
+		HashBenchTimer t("insert");
+		for (size_t i = 0; i < keys.size(); i++)
+			map[keys[i]] = reinterpret_cast<User*>(i + 1);
+	}
+	{
+		HashBenchTimer t("find");
+		for (size_t i = 0; i < lookups.size(); i++)
+		{
+			typename Map::const_iterator it = map.find(lookups[i]);
+			if (it != map.end() && it->second)
+				found++;
+		}
+	}
+	{
+		// A nick change is a removal and an insert
+		HashBenchTimer t("erase and insert");
+		for (size_t i = 0; i < keys.size(); i += 2)
+		{
+			map.erase(keys[i]);
+			map[keys[i] + "_"] = reinterpret_cast<User*>(i + 1);
+		}
+	}
+	{
+		HashBenchTimer t("iterate");
+		for (typename Map::const_iterator it = map.begin(); it != map.end(); ++it)
+			if (!it->second)
+				found = 0;
+	}
+	return std::make_pair(found, map.size());
+}
+
+bool TestSuite::DoHashMapTests()
+{
+	std::cout << "\n\nNick hash table tests\n\n";
+
+	irc::hash_map<User*> map;
+	map["Brain"] = reinterpret_cast<User*>(1);
+	map["[w00t]"] = reinterpret_cast<User*>(2);
+	if (map.find("brain") == map.end() || map.find("{W00T}") == map.end() || map.find("brian") != map.end())
+	{
+		std::cout << "HASHMAP: Case insensitive lookup failed" << std::endl;
+		return false;
+	}
+	if (map.insert(std::make_pair("BRAIN", reinterpret_cast<User*>(3))).second || map["brain"] != reinterpret_cast<User*>(1))
+	{
+		std::cout << "HASHMAP: Inserted a key which was already there" << std::endl;
+		return false;
+	}
+	for (unsigned int i = 0; i < 1000; i++)
+		map[ConvToStr(i)] = reinterpret_cast<User*>(i + 10);
+	for (unsigned int i = 0; i < 1000; i += 2)
+		map.erase(ConvToStr(i));
+	size_t seen = 0;
+	for (irc::hash_map<User*>::iterator i = map.begin(); i != map.end(); ++i)
+		seen++;
+	if (map.size() != 502 || seen != 502 || map.find("998") != map.end() || map["999"] != reinterpret_cast<User*>(1009))
+	{
+		std::cout << "HASHMAP: Wrong contents after erasing keys, " << map.size() << " entries" << std::endl;
+		return false;
+	}
+
+	const size_t sizes[] = { 100000, 1000000 };
+	for (unsigned int n = 0; n < sizeof(sizes) / sizeof(*sizes); n++)
+	{
+		// Nick-like keys, and lookups of each key in the case it was added in, in another case, and of a key that is not there
+		std::vector<std::string> keys;
+		std::vector<std::string> lookups;
+		for (size_t i = 0; i < sizes[n]; i++)
+		{
+			keys.push_back("Guest[" + ConvToStr(i * 7919 % sizes[n]) + "]");
+			lookups.push_back(keys.back());
+			lookups.push_back("guest{" + ConvToStr(i * 7919 % sizes[n]) + "}");
+			lookups.push_back("Nobody" + ConvToStr(i));
+		}
+
+		std::cout << "\n" << sizes[n] << " entries, " << lookups.size() << " lookups\nstd::unordered_map:\n";
+		std::pair<size_t, size_t> oldresult = HashMapBenchmark<old_user_hash>(keys, lookups);
+		std::cout << "irc::hash_map:\n";
+		std::pair<size_t, size_t> newresult = HashMapBenchmark<irc::hash_map<User*> >(keys, lookups);
+
+		if (oldresult != newresult || newresult.first != sizes[n] * 2)
+		{
+			std::cout << "HASHMAP: Tables disagree: found " << oldresult.first << " and " << newresult.first << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
 TestSuite::~TestSuite()
 {
 	std::cout << "\n\n*** END OF TEST SUITE ***\n";
@@ -38,15 +38,49 @@ Timer::~Timer()
 	ServerInstance->Timers->DelTimer(this);
 }
 
+TimerManager::TimerManager()
+	: lasttick(0), nexttimer(NULL)
+{
+	for (unsigned int i = 0; i < WHEEL_SIZE; i++)
+		wheel[i] = NULL;
+}
+
 void TimerManager::TickTimers(time_t TIME)
 {
-	for (TimerMap::iterator i = Timers.begin(); i != Timers.end(); )
+	if (TIME <= lasttick)
+	{
+		// No time has passed, or the clock went backwards; timers that are now
+		// in the future will simply wait
+		lasttick = TIME;
+		return;
+	}
+
+	time_t from = lasttick + 1;
+	lasttick = TIME;
+
+	if (TIME - from >= (time_t)WHEEL_SIZE)
+	{
+		// More than a whole turn of the wheel has passed, every slot is due
+		for (unsigned int slot = 0; slot < WHEEL_SIZE; slot++)
+			TickSlot(slot, TIME);
+		return;
+	}
+
+	for (time_t when = from; when <= TIME; when++)
+		TickSlot(when & (WHEEL_SIZE - 1), TIME);
+}
+
+void TimerManager::TickSlot(unsigned int slot, time_t TIME)
+{
+	for (Timer* t = wheel[slot]; t; t = nexttimer)
 	{
-		Timer* t = i->second;
+		nexttimer = t->next;
+
+		// Belongs to a later turn of the wheel
 		if (t->GetTrigger() > TIME)
-			break;
+			continue;
 
-		Timers.erase(i++);
+		DelTimer(t);
 
 		if (!t->Tick(TIME))
 			delete t;
@@ -56,23 +90,36 @@ void TimerManager::TickTimers(time_t TIME)
 			AddTimer(t);
 		}
 	}
+	nexttimer = NULL;
 }
 
 void TimerManager::DelTimer(Timer* t)
 {
-	std::pair<TimerMap::iterator, TimerMap::iterator> itpair = Timers.equal_range(t->GetTrigger());
+	if (!t->pprev)
+		return;
 
-	for (TimerMap::iterator i = itpair.first; i != itpair.second; ++i)
-	{
-		if (i->second == t)
-		{
-			Timers.erase(i);
-			break;
-		}
-	}
+	if (nexttimer == t)
+		nexttimer = t->next;
+
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+
+	t->next = NULL;
+	t->pprev = NULL;
 }
 
 void TimerManager::AddTimer(Timer* t)
 {
-	Timers.insert(std::make_pair(t->GetTrigger(), t));
+	DelTimer(t);
+
+	// A timer that is already due goes in the slot that is ticked next
+	time_t when = std::max(t->GetTrigger(), lasttick + 1);
+
+	Timer*& head = wheel[when & (WHEEL_SIZE - 1)];
+	t->next = head;
+	if (head)
+		head->pprev = &t->next;
+	head = t;
+	t->pprev = &head;
 }
@@ -0,0 +1,178 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2014 InspIRCd Development Team
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+static std::string NickKey(const std::string& nick)
+{
+	std::string key(nick);
+	for (std::string::iterator i = key.begin(); i != key.end(); ++i)
+		*i = national_case_insensitive_map[(unsigned char)*i];
+	return key;
+}
+
+static std::string HostKey(const std::string& host)
+{
+	std::string key(host.rbegin(), host.rend());
+	for (std::string::iterator i = key.begin(); i != key.end(); ++i)
+		*i = ascii_case_insensitive_map[(unsigned char)*i];
+	return key;
+}
+
+static std::string IPKey(int family, const unsigned char* bits)
+{
+	if (family == AF_INET)
+		return std::string(1, '4').append(reinterpret_cast<const char*>(bits), 4);
+	if (family == AF_INET6)
+		return std::string(1, '6').append(reinterpret_cast<const char*>(bits), 16);
+	return "";
+}
+
+static std::string IPKey(const irc::sockets::sockaddrs& sa)
+{
+	if (sa.sa.sa_family == AF_INET)
+		return IPKey(AF_INET, reinterpret_cast<const unsigned char*>(&sa.in4.sin_addr));
+	return IPKey(sa.sa.sa_family, sa.in6.sin6_addr.s6_addr);
+}
+
+UserIndex::KeySet::iterator UserIndex::Field::Add(User* user, const std::string& key)
+{
+	for (std::string::const_iterator i = key.begin(); i != key.end(); ++i)
+		chars[(unsigned char)*i]++;
+	return keys.insert(std::make_pair(key, user)).first;
+}
+
+void UserIndex::Field::Remove(KeySet::iterator entry)
+{
+	for (std::string::const_iterator i = entry->first.begin(); i != entry->first.end(); ++i)
+		chars[(unsigned char)*i]--;
+	keys.erase(entry);
+}
+
+void UserIndex::Field::Update(KeySet::iterator& entry, const std::string& key)
+{
+	if (entry->first == key)
+		return;
+
+	User* user = entry->second;
+	Remove(entry);
+	entry = Add(user, key);
+}
+
+void UserIndex::Field::FindPrefix(const std::string& prefix, std::vector<User*>& out) const
+{
+	for (KeySet::const_iterator i = keys.lower_bound(std::make_pair(prefix, (User*)NULL)); i != keys.end(); ++i)
+	{
+		if (i->first.compare(0, prefix.length(), prefix))
+			break;
+		out.push_back(i->second);
+	}
+}
+
+bool UserIndex::Field::CanMatch(const std::string& mask) const
+{
+	for (std::string::const_iterator i = mask.begin(); i != mask.end(); ++i)
+	{
+		if (*i != '*' && *i != '?' && !chars[(unsigned char)*i])
+			return false;
+	}
+	return true;
+}
+
+void UserIndex::Add(User* user)
+{
+	Entries& entries = users[user];
+	entries.nick = nicks.Add(user, NickKey(user->nick));
+	entries.host = hosts.Add(user, HostKey(user->host));
+	entries.dhost = dhosts.Add(user, HostKey(user->dhost));
+	entries.ip = ips.Add(user, IPKey(user->client_sa));
+	servers[user->server]++;
+}
+
+void UserIndex::Remove(User* user)
+{
+	EntryMap::iterator it = users.find(user);
+	if (it == users.end())
+		return;
+
+	nicks.Remove(it->second.nick);
+	hosts.Remove(it->second.host);
+	dhosts.Remove(it->second.dhost);
+	ips.Remove(it->second.ip);
+	users.erase(it);
+
+	std::map<std::string, unsigned int>::iterator server = servers.find(user->server);
+	if (server != servers.end() && !--server->second)
+		servers.erase(server);
+}
+
+void UserIndex::Update(User* user)
+{
+	EntryMap::iterator it = users.find(user);
+	if (it == users.end())
+		return;
+
+	nicks.Update(it->second.nick, NickKey(user->nick));
+	hosts.Update(it->second.host, HostKey(user->host));
+	dhosts.Update(it->second.dhost, HostKey(user->dhost));
+	ips.Update(it->second.ip, IPKey(user->client_sa));
+}
+
+void UserIndex::Refold()
+{
+	for (EntryMap::iterator i = users.begin(); i != users.end(); ++i)
+		nicks.Update(i->second.nick, NickKey(i->first->nick));
+}
+
+bool UserIndex::FindNick(const std::string& mask, std::vector<User*>& out) const
+{
+	std::string key = NickKey(mask);
+	std::string::size_type wildcard = key.find_first_of("*?");
+	if (wildcard != 0)
+		nicks.FindPrefix(key.substr(0, wildcard), out);
+	else if (nicks.CanMatch(key))
+		return false;
+	return true;
+}
+
+bool UserIndex::FindHost(const Field& field, const std::string& mask, std::vector<User*>& out)
+{
+	std::string key = HostKey(mask);
+	std::string::size_type wildcard = key.find_first_of("*?");
+	if (wildcard != 0)
+		field.FindPrefix(key.substr(0, wildcard), out);
+	else if (field.CanMatch(key))
+		return false;
+	return true;
+}
+
+void UserIndex::FindIP(const irc::sockets::cidr_mask& range, std::vector<User*>& out) const
+{
+	std::string low = IPKey(range.type, range.bits);
+	if (low.empty())
+		return;
+
+	// The highest address in the range has all of the bits after the prefix set
+	std::string high = low;
+	for (size_t bit = range.length; bit < (high.length() - 1) * 8; bit++)
+		high[1 + bit / 8] |= (0x80 >> (bit % 8));
+
+	for (KeySet::const_iterator i = ips.keys.lower_bound(std::make_pair(low, (User*)NULL)); i != ips.keys.end() && i->first <= high; ++i)
+		out.push_back(i->second);
+}
@@ -72,6 +72,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 
 	ServerInstance->Users->AddLocalClone(New);
 	ServerInstance->Users->AddGlobalClone(New);
+	this->Index.Add(New);
 
 	New->localuseriter = this->local_users.insert(local_users.end(), New);
 
@@ -133,11 +134,17 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 		}
 	}
 
-	if (!ServerInstance->SE->AddFd(eh, FD_WANT_FAST_READ | FD_WANT_EDGE_WRITE))
+	/* Plain sockets are read by an I/O thread if there are any, the socket engine then only handles writes */
+	bool threaded = (!eh->GetIOHook() && ServerInstance->IOThreads->IsEnabled());
+	if (!ServerInstance->SE->AddFd(eh, (threaded ? FD_WANT_NO_READ : FD_WANT_FAST_READ) | FD_WANT_EDGE_WRITE))
 	{
 		ServerInstance->Logs->Log("USERS", LOG_DEBUG, "Internal error on new connection");
 		this->QuitUser(New, "Internal error handling connection");
 	}
+	else if (threaded && !ServerInstance->IOThreads->AddSocket(eh))
+	{
+		ServerInstance->SE->ChangeEventMask(eh, FD_WANT_FAST_READ);
+	}
 
 	if (ServerInstance->Config->RawLog)
 		New->WriteNotice("*** Raw I/O logging is enabled on this server. All messages, passwords, and commands are being recorded.");
@@ -163,6 +170,10 @@ void UserManager::QuitUser(User *user, const std::string &quitreason, const char
 		return;
 	}
 
+	// Quitting users are left out of NAMES replies from here on
+	for (UCListIter i = user->chans.begin(); i != user->chans.end(); ++i)
+		(*i)->RemoveNamesListEntry((*i)->GetUser(user));
+
 	user->quitting = true;
 
 	ServerInstance->Logs->Log("USERS", LOG_DEBUG, "QuitUser: %s=%s '%s'", user->uuid.c_str(), user->nick.c_str(), quitreason.c_str());
@@ -219,6 +230,8 @@ void UserManager::QuitUser(User *user, const std::string &quitreason, const char
 		}
 	}
 
+	this->Index.Remove(user);
+
 	user_hash::iterator iter = this->clientlist->find(user->nick);
 
 	if (iter != this->clientlist->end())
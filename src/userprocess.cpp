@@ -28,75 +28,110 @@
 #include "socketengine.h"
 #include "command_parse.h"
 
-/**
- * This function is called once a second from the mainloop.
- * It is intended to do background checking on all the user structs, e.g.
- * stuff like ping checks, registration timeouts, etc.
- */
-void InspIRCd::DoBackgroundUserStuff()
+UserPingTimer::UserPingTimer(LocalUser* me)
+	: Timer(0, ServerInstance->Time()), user(me)
+{
+}
+
+void UserPingTimer::Reset()
+{
+	// The deadline has passed once Time() > nping
+	SetTrigger(user->nping + 1);
+	ServerInstance->Timers->AddTimer(this);
+}
+
+bool UserPingTimer::Tick(time_t now)
+{
+	if (user->quitting)
+		return true;
+
+	if (now <= user->nping)
+	{
+		// The user was active since this timer was set, so the deadline moved
+		Reset();
+		return true;
+	}
+
+	// This user didn't answer the last ping, remove them
+	if (!user->lastping)
+	{
+		time_t time = now - (user->nping - user->MyClass->GetPingTime());
+		const std::string message = "Ping timeout: " + ConvToStr(time) + (time == 1 ? " seconds" : " second");
+		user->lastping = 1;
+		user->nping = now + user->MyClass->GetPingTime();
+		ServerInstance->Users->QuitUser(user, message);
+		return true;
+	}
+
+	user->Write("PING :%s", ServerInstance->Config->ServerName.c_str());
+	user->lastping = 0;
+	user->nping = now + user->MyClass->GetPingTime();
+	Reset();
+	return true;
+}
+
+UserRegistrationTimer::UserRegistrationTimer(LocalUser* me)
+	: Timer(1, ServerInstance->Time()), user(me)
+{
+	ServerInstance->Timers->AddTimer(this);
+}
+
+bool UserRegistrationTimer::Tick(time_t now)
 {
-	/*
-	 * loop over all local users..
-	 */
-	LocalUserList::reverse_iterator count2 = this->Users->local_users.rbegin();
-	while (count2 != this->Users->local_users.rend())
+	if (user->quitting || user->registered == REG_ALL)
+		return true;
+
+	if (user->registered == REG_NICKUSER && ServerInstance->AllModulesReportReady(user))
 	{
-		LocalUser *curr = *count2;
-		count2++;
-
-		if (curr->quitting)
-			continue;
-
-		if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
-		{
-			unsigned int rate = curr->MyClass->GetCommandRate();
-			if (curr->CommandFloodPenalty > rate)
-				curr->CommandFloodPenalty -= rate;
-			else
-				curr->CommandFloodPenalty = 0;
-			curr->eh.OnDataReady();
-		}
-
-		switch (curr->registered)
-		{
-			case REG_ALL:
-				if (Time() > curr->nping)
-				{
-					// This user didn't answer the last ping, remove them
-					if (!curr->lastping)
-					{
-						time_t time = this->Time() - (curr->nping - curr->MyClass->GetPingTime());
-						const std::string message = "Ping timeout: " + ConvToStr(time) + (time == 1 ? " seconds" : " second");
-						curr->lastping = 1;
-						curr->nping = Time() + curr->MyClass->GetPingTime();
-						this->Users->QuitUser(curr, message);
-						continue;
-					}
-
-					curr->Write("PING :%s",this->Config->ServerName.c_str());
-					curr->lastping = 0;
-					curr->nping = Time()  +curr->MyClass->GetPingTime();
-				}
-				break;
-			case REG_NICKUSER:
-				if (AllModulesReportReady(curr))
-				{
-					/* User has sent NICK/USER, modules are okay, DNS finished. */
-					curr->FullConnect();
-					continue;
-				}
-				break;
-		}
-
-		if (curr->registered != REG_ALL && (Time() > (curr->age + curr->MyClass->GetRegTimeout())))
-		{
-			/*
-			 * registration timeout -- didnt send USER/NICK/HOST
-			 * in the time specified in their connection class.
-			 */
-			this->Users->QuitUser(curr, "Registration timeout");
-			continue;
-		}
+		/* User has sent NICK/USER, modules are okay, DNS finished. */
+		user->FullConnect();
+		return true;
 	}
+
+	if (now > (user->age + user->MyClass->GetRegTimeout()))
+	{
+		/*
+		 * registration timeout -- didnt send USER/NICK/HOST
+		 * in the time specified in their connection class.
+		 */
+		ServerInstance->Users->QuitUser(user, "Registration timeout");
+		return true;
+	}
+
+	// Check again in a second
+	SetTrigger(now + 1);
+	ServerInstance->Timers->AddTimer(this);
+	return true;
+}
+
+UserFakeLagTimer::UserFakeLagTimer(LocalUser* me)
+	: Timer(1, ServerInstance->Time()), user(me)
+{
+}
+
+void UserFakeLagTimer::Start()
+{
+	if (IsScheduled())
+		return;
+
+	SetTrigger(ServerInstance->Time() + 1);
+	ServerInstance->Timers->AddTimer(this);
 }
 
+bool UserFakeLagTimer::Tick(time_t)
+{
+	if (user->quitting)
+		return true;
+
+	unsigned int rate = user->MyClass->GetCommandRate();
+	if (user->CommandFloodPenalty > rate)
+		user->CommandFloodPenalty -= rate;
+	else
+		user->CommandFloodPenalty = 0;
+	user->eh.OnDataReady();
+
+	// Keep going while there is a penalty left to drain, or a sendq holding up the recvq
+	if (!user->quitting && (user->CommandFloodPenalty || user->eh.getSendQSize()))
+		Start();
+	return true;
+}
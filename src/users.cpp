@@ -197,7 +197,7 @@ LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::so
 	: User(ServerInstance->UIDGen.GetUID(), ServerInstance->Config->ServerName, USERTYPE_LOCAL), eh(this),
 	localuseriter(ServerInstance->Users->local_users.end()),
 	bytes_in(0), bytes_out(0), cmds_in(0), cmds_out(0), nping(0), CommandFloodPenalty(0),
-	already_sent(0)
+	pingtimer(this), regtimer(this), fakelagtimer(this), already_sent(0)
 {
 	exempt = quitting_sendq = false;
 	idle_lastmsg = 0;
@@ -411,11 +411,11 @@ void UserIOHandler::OnDataReady()
 	if (user->quitting)
 		return;
 
-	if (recvq.length() > user->MyClass->GetRecvqMax() && !user->HasPrivPermission("users/flood/increased-buffers"))
+	if (getRecvQSize() > user->MyClass->GetRecvqMax() && !user->HasPrivPermission("users/flood/increased-buffers"))
 	{
 		ServerInstance->Users->QuitUser(user, "RecvQ exceeded");
 		ServerInstance->SNO->WriteToSnoMask('a', "User %s RecvQ of %lu exceeds connect class maximum of %lu",
-			user->nick.c_str(), (unsigned long)recvq.length(), user->MyClass->GetRecvqMax());
+			user->nick.c_str(), (unsigned long)getRecvQSize(), user->MyClass->GetRecvqMax());
 		return;
 	}
 	unsigned long sendqmax = ULONG_MAX;
@@ -425,32 +425,34 @@ void UserIOHandler::OnDataReady()
 	if (!user->HasPrivPermission("users/flood/no-fakelag"))
 		penaltymax = user->MyClass->GetPenaltyThreshold() * 1000;
 
+	// The same buffer is reused for every line, so parsing a burst of lines
+	// does not allocate per line
+	std::string line;
+	line.reserve(MAXBUF);
 	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
 	{
-		std::string line;
-		line.reserve(MAXBUF);
-		std::string::size_type qpos = 0;
-		while (qpos < recvq.length())
+		if (!GetNextLine(line))
 		{
-			char c = recvq[qpos++];
-			switch (c)
-			{
-			case '\0':
-				c = ' ';
-				break;
-			case '\r':
+			// the recvq ran out before we found a newline
+			if (user->CommandFloodPenalty)
+				user->fakelagtimer.Start();
+			return;
+		}
+
+		const std::string::size_type qpos = line.length() + 1;
+
+		// Strip CRs, turn NULs into spaces and crop the line, all in place
+		std::string::size_type len = 0;
+		for (std::string::size_type i = 0; i < line.length() && len < MAXBUF - 2; i++)
+		{
+			char c = line[i];
+			if (c == '\r')
 				continue;
-			case '\n':
-				goto eol_found;
-			}
-			if (line.length() < MAXBUF - 2)
-				line.push_back(c);
+			if (c == '\0')
+				c = ' ';
+			line[len++] = c;
 		}
-		// if we got here, the recvq ran out before we found a newline
-		return;
-eol_found:
-		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq = recvq.substr(qpos);
+		line.resize(len);
 
 		// TODO should this be moved to when it was inserted in recvq?
 		ServerInstance->stats->statsRecv += qpos;
@@ -463,13 +465,20 @@ eol_found:
 	}
 	if (user->CommandFloodPenalty >= penaltymax && !user->MyClass->fakelag)
 		ServerInstance->Users->QuitUser(user, "Excess Flood");
+	else
+		user->fakelagtimer.Start();
 }
 
 void UserIOHandler::AddWriteBuf(const std::string &data)
+{
+	AddWriteBuf(reference<SendBuffer>(new SendBuffer(data)));
+}
+
+void UserIOHandler::AddWriteBuf(const reference<SendBuffer>& data)
 {
 	if (user->quitting_sendq)
 		return;
-	if (!user->quitting && getSendQSize() + data.length() > user->MyClass->GetSendqHardMax() &&
+	if (!user->quitting && getSendQSize() + data->data.length() > user->MyClass->GetSendqHardMax() &&
 		!user->HasPrivPermission("users/flood/increased-buffers"))
 	{
 		user->quitting_sendq = true;
@@ -483,11 +492,38 @@ void UserIOHandler::AddWriteBuf(const std::string &data)
 	WriteData(data);
 }
 
+void UserIOHandler::DoWrite()
+{
+	StreamSocket::DoWrite();
+
+	if (flushwatermark && getSendQSize() <= flushwatermark && getError().empty() && !user->quitting)
+	{
+		flushwatermark = 0;
+		FOREACH_MOD(I_OnBufferFlushed, OnBufferFlushed(user));
+	}
+}
+
 void UserIOHandler::OnError(BufferedSocketError)
 {
 	ServerInstance->Users->QuitUser(user, getError());
 }
 
+void UserIOHandler::Close()
+{
+	// The I/O thread must let go of the fd before it is closed
+	if (iothread)
+		ServerInstance->IOThreads->DelSocket(this);
+	StreamSocket::Close();
+}
+
+void UserIOHandler::ReadFromThread(const std::string& data)
+{
+	// A fakelagged user may never run out of complete lines, so GetNextLine() would never discard them
+	DiscardReadLines();
+	recvq.append(data);
+	OnDataReady();
+}
+
 CullResult User::cull()
 {
 	if (!quitting)
@@ -765,6 +801,7 @@ void LocalUser::FullConnect()
 	FOREACH_MOD(I_OnUserConnect,OnUserConnect(this));
 
 	this->registered = REG_ALL;
+	pingtimer.Reset();
 
 	FOREACH_MOD(I_OnPostConnect,OnPostConnect(this));
 
@@ -783,6 +820,18 @@ void User::InvalidateCache()
 	cached_hostip.clear();
 	cached_makehost.clear();
 	cached_fullrealhost.clear();
+	InvalidateBanCache();
+	ServerInstance->Users->Index.Update(this);
+}
+
+void User::InvalidateBanCache()
+{
+	for (UCListIter i = chans.begin(); i != chans.end(); ++i)
+	{
+		Membership* memb = (*i)->GetUser(this);
+		if (memb)
+			memb->banserial = 0;
+	}
 }
 
 bool User::ChangeNick(const std::string& newnick, bool force)
@@ -887,9 +936,13 @@ bool User::ChangeNick(const std::string& newnick, bool force)
 	if (this->registered == REG_ALL)
 		this->WriteCommon("NICK %s",newnick.c_str());
 	std::string oldnick = nick;
+	for (UCListIter i = chans.begin(); i != chans.end(); ++i)
+		(*i)->RemoveNamesListEntry((*i)->GetUser(this));
 	nick = newnick;
 
 	InvalidateCache();
+	for (UCListIter i = chans.begin(); i != chans.end(); ++i)
+		(*i)->AddNamesListEntry((*i)->GetUser(this));
 	ServerInstance->Users->clientlist->erase(oldnick);
 	(*(ServerInstance->Users->clientlist))[newnick] = this;
 
@@ -944,14 +997,19 @@ bool User::SetClientIP(const char* sip, bool recheck_eline)
 {
 	cachedip.clear();
 	cached_hostip.clear();
-	return irc::sockets::aptosa(sip, 0, client_sa);
+	InvalidateBanCache();
+	bool valid = irc::sockets::aptosa(sip, 0, client_sa);
+	ServerInstance->Users->Index.Update(this);
+	return valid;
 }
 
 void User::SetClientIP(const irc::sockets::sockaddrs& sa, bool recheck_eline)
 {
 	cachedip.clear();
 	cached_hostip.clear();
+	InvalidateBanCache();
 	memcpy(&client_sa, &sa, sizeof(irc::sockets::sockaddrs));
+	ServerInstance->Users->Index.Update(this);
 }
 
 bool LocalUser::SetClientIP(const char* sip, bool recheck_eline)
@@ -987,26 +1045,36 @@ void User::Write(const char *text, ...)
 {
 }
 
+reference<SendBuffer> LocalUser::MakeLine(const std::string& text)
+{
+	if (text.length() > MAXBUF - 2)
+	{
+		// this should happen rarely or never. Crop the string at 512.
+		return new SendBuffer(text.substr(0, MAXBUF - 2) + wide_newline);
+	}
+	return new SendBuffer(text + wide_newline);
+}
+
 void LocalUser::Write(const std::string& text)
 {
 	if (!ServerInstance->SE->BoundsCheckFd(&eh))
 		return;
 
-	if (text.length() > MAXBUF - 2)
-	{
-		// this should happen rarely or never. Crop the string at 512 and try again.
-		std::string try_again = text.substr(0, MAXBUF - 2);
-		Write(try_again);
+	this->Write(MakeLine(text));
+}
+
+void LocalUser::Write(const reference<SendBuffer>& line)
+{
+	if (!ServerInstance->SE->BoundsCheckFd(&eh))
 		return;
-	}
 
-	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %s", uuid.c_str(), text.c_str());
+	const std::string& data = line->data;
+	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int)data.length() - 2, data.c_str());
 
-	eh.AddWriteBuf(text);
-	eh.AddWriteBuf(wide_newline);
+	eh.AddWriteBuf(line);
 
-	ServerInstance->stats->statsSent += text.length() + 2;
-	this->bytes_out += text.length() + 2;
+	ServerInstance->stats->statsSent += data.length();
+	this->bytes_out += data.length();
 	this->cmds_out++;
 }
 
@@ -1120,6 +1188,7 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 
 	LocalUser::already_sent_id++;
 
+	const reference<SendBuffer> buf = LocalUser::MakeLine(line);
 	UserChanList include_c(chans);
 	std::map<User*,bool> exceptions;
 
@@ -1134,20 +1203,20 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 		{
 			u->already_sent = LocalUser::already_sent_id;
 			if (i->second)
-				u->Write(line);
+				u->Write(buf);
 		}
 	}
 	for (UCListIter v = include_c.begin(); v != include_c.end(); ++v)
 	{
 		Channel* c = *v;
-		const UserMembList* ulist = c->GetUsers();
-		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
+		const LocalMembList& ulist = c->GetLocalUsers();
+		for (LocalMembCIter i = ulist.begin(); i != ulist.end(); ++i)
 		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if (u && !u->quitting && u->already_sent != LocalUser::already_sent_id)
+			LocalUser* u = i->user;
+			if (!u->quitting && u->already_sent != LocalUser::already_sent_id)
 			{
 				u->already_sent = LocalUser::already_sent_id;
-				u->Write(line);
+				u->Write(buf);
 			}
 		}
 	}
@@ -1160,8 +1229,8 @@ void User::WriteCommonQuit(const std::string &normal_text, const std::string &op
 
 	already_sent_t uniq_id = ++LocalUser::already_sent_id;
 
-	const std::string normalMessage = ":" + this->GetFullHost() + " QUIT :" + normal_text;
-	const std::string operMessage = ":" + this->GetFullHost() + " QUIT :" + oper_text;
+	const reference<SendBuffer> normalMessage = LocalUser::MakeLine(":" + this->GetFullHost() + " QUIT :" + normal_text);
+	const reference<SendBuffer> operMessage = LocalUser::MakeLine(":" + this->GetFullHost() + " QUIT :" + oper_text);
 
 	UserChanList include_c(chans);
 	std::map<User*,bool> exceptions;
@@ -1180,11 +1249,11 @@ void User::WriteCommonQuit(const std::string &normal_text, const std::string &op
 	}
 	for (UCListIter v = include_c.begin(); v != include_c.end(); ++v)
 	{
-		const UserMembList* ulist = (*v)->GetUsers();
-		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
+		const LocalMembList& ulist = (*v)->GetLocalUsers();
+		for (LocalMembCIter i = ulist.begin(); i != ulist.end(); ++i)
 		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if (u && !u->quitting && (u->already_sent != uniq_id))
+			LocalUser* u = i->user;
+			if (!u->quitting && (u->already_sent != uniq_id))
 			{
 				u->already_sent = uniq_id;
 				u->Write(u->IsOper() ? operMessage : normalMessage);
@@ -1330,11 +1399,11 @@ void User::DoHostCycle(const std::string &quitline)
 				modeline.append(" ").append(nick);
 		}
 
-		const UserMembList *ulist = c->GetUsers();
-		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
+		const LocalMembList& ulist = c->GetLocalUsers();
+		for (LocalMembCIter i = ulist.begin(); i != ulist.end(); ++i)
 		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if (u == NULL || u == this)
+			LocalUser* u = i->user;
+			if (u == this)
 				continue;
 			if (u->already_sent == silent_id)
 				continue;
@@ -1368,10 +1437,15 @@ bool User::ChangeDisplayedHost(const char* shost)
 
 	std::string quitstr = ":" + GetFullHost() + " QUIT :Changing host";
 
+	for (UCListIter i = chans.begin(); i != chans.end(); ++i)
+		(*i)->RemoveNamesListEntry((*i)->GetUser(this));
+
 	/* Fix by Om: User::dhost is 65 long, this was truncating some long hosts */
 	this->dhost.assign(shost, 0, 64);
 
 	this->InvalidateCache();
+	for (UCListIter i = chans.begin(); i != chans.end(); ++i)
+		(*i)->AddNamesListEntry((*i)->GetUser(this));
 
 	this->DoHostCycle(quitstr);
 
@@ -1390,9 +1464,14 @@ bool User::ChangeIdent(const char* newident)
 
 	std::string quitstr = ":" + GetFullHost() + " QUIT :Changing ident";
 
+	for (UCListIter i = chans.begin(); i != chans.end(); ++i)
+		(*i)->RemoveNamesListEntry((*i)->GetUser(this));
+
 	this->ident.assign(newident, 0, ServerInstance->Config->Limits.IdentMax);
 
 	this->InvalidateCache();
+	for (UCListIter i = chans.begin(); i != chans.end(); ++i)
+		(*i)->AddNamesListEntry((*i)->GetUser(this));
 
 	this->DoHostCycle(quitstr);
 
@@ -1440,9 +1519,16 @@ void LocalUser::SetClass(const std::string &explicit_name)
 	}
 	else
 	{
-		for (ClassVector::iterator i = ServerInstance->Config->Classes.begin(); i != ServerInstance->Config->Classes.end(); i++)
+		/* Every class is still offered to modules, but only the classes the index returns
+		 * can match this user by host, so the rest are skipped without matching their masks.
+		 */
+		std::vector<size_t> candidates;
+		ServerInstance->Config->ClassIndex.Find(this, candidates);
+		std::vector<size_t>::const_iterator candidate = candidates.begin();
+
+		for (size_t i = 0; i < ServerInstance->Config->Classes.size(); ++i)
 		{
-			ConnectClass* c = *i;
+			ConnectClass* c = ServerInstance->Config->Classes[i];
 			ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "Checking %s", c->GetName().c_str());
 
 			ModResult MOD_RESULT;
@@ -1459,6 +1545,14 @@ void LocalUser::SetClass(const std::string &explicit_name)
 			if (c->type == CC_NAMED)
 				continue;
 
+			while (candidate != candidates.end() && *candidate < i)
+				++candidate;
+			if (candidate == candidates.end() || *candidate != i)
+			{
+				ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "No host match (for %s)", c->GetHost().c_str());
+				continue;
+			}
+
 			bool regdone = (registered != REG_NONE);
 			if (c->config->getBool("registered", regdone) != regdone)
 				continue;
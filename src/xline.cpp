@@ -104,6 +104,20 @@ class ZLineFactory : public XLineFactory
 };
 
 
+/** Expires X-lines when they are due, see XLineManager::ExpireLines()
+ */
+class XLineExpiryTimer : public Timer
+{
+ public:
+	XLineExpiryTimer() : Timer(0, ServerInstance->Time()) { }
+
+	bool Tick(time_t TIME)
+	{
+		ServerInstance->XLines->ExpireLines(TIME);
+		return true;
+	}
+};
+
 /*
  * This is now version 3 of the XLine subsystem, let's see if we can get it as nice and
  * efficient as we can this time so we can close this file and never ever touch it again ..
@@ -126,9 +140,9 @@ class ZLineFactory : public XLineFactory
  *  All lines are (as in v1) stored together -- no seperation of perm and non-perm. They are stored in
  *  a map of maps (first map is line type, second map is for quick lookup on add/delete/etc).
  *
- *  Expiry is *no longer* performed on a timer, and no longer uses a sorted list of any variety. This
- *  is now done by only checking for expiry when a line is accessed, meaning that expiry is no longer
- *  a resource intensive problem.
+ *  Expiry is done by a single timer, which fires when the first line in a list of timed lines sorted
+ *  by expiry time is due to expire. Lines never have to be checked for expiry when they are accessed,
+ *  and expire on time even if nothing ever looks at them.
  *
  *  Application no longer tries to apply every single line on every single user - instead, now only lines
  *  added since the previous application are applied. This keeps S2S ADDLINE during burst nice and fast,
@@ -184,21 +198,6 @@ XLineLookup* XLineManager::GetAll(const std::string &type)
 	if (n == lookup_lines.end())
 		return NULL;
 
-	LookupIter safei;
-	const time_t current = ServerInstance->Time();
-
-	/* Expire any dead ones, before sending */
-	for (LookupIter x = n->second.begin(); x != n->second.end(); )
-	{
-		safei = x;
-		safei++;
-		if (x->second->duration && current > x->second->expiry)
-		{
-			ExpireLine(n, x);
-		}
-		x = safei;
-	}
-
 	return &(n->second);
 }
 
@@ -282,6 +281,12 @@ bool XLineManager::AddLine(XLine* line, User* user)
 		pending_lines.push_back(line);
 
 	lookup_lines[line->type][line->Displayable().c_str()] = line;
+	line_index[line->type].Add(line);
+	if (line->duration)
+	{
+		expiring.insert(std::make_pair(line->expiry, line));
+		ScheduleExpiry();
+	}
 	line->OnAdd();
 
 	FOREACH_MOD(I_OnAddLine,OnAddLine(user, line));
@@ -316,6 +321,8 @@ bool XLineManager::DelLine(const char* hostmask, const std::string &type, User*
 	if (pptr != pending_lines.end())
 		pending_lines.erase(pptr);
 
+	line_index[type].Remove(y->second);
+	RemoveExpiring(y->second);
 	delete y->second;
 	x->second.erase(y);
 
@@ -344,31 +351,43 @@ XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 	if (x == lookup_lines.end())
 		return NULL;
 
-	const time_t current = ServerInstance->Time();
+	const XLineIndex& index = line_index[type];
 
-	LookupIter safei;
+	/* Of all lines which match, return the one which comes first in lookup_lines,
+	 * which is the one that would have been found by matching every line in order.
+	 */
+	XLine* match = NULL;
+	irc::string matchkey;
 
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+	std::vector<XLine*> candidates;
+	index.Find(user, candidates);
+	for (std::vector<XLine*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
 	{
-		safei = i;
-		safei++;
+		XLine* line = *i;
+		if (match && !(irc::string(line->Displayable().c_str()) < matchkey))
+			continue;
 
-		if (i->second->duration && current > i->second->expiry)
+		if (line->Matches(user))
 		{
-			/* Expire the line, proceed to next one */
-			ExpireLine(x, i);
-			i = safei;
-			continue;
+			match = line;
+			matchkey = line->Displayable().c_str();
 		}
+	}
+
+	const XLineLookup& unindexed = index.GetUnindexed();
+	for (XLineLookup::const_iterator i = unindexed.begin(); i != unindexed.end(); ++i)
+	{
+		if (match && !(i->first < matchkey))
+			break;
 
 		if (i->second->Matches(user))
 		{
-			return i->second;
+			match = i->second;
+			break;
 		}
-
-		i = safei;
 	}
-	return NULL;
+
+	return match;
 }
 
 XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pattern)
@@ -378,30 +397,10 @@ XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pat
 	if (x == lookup_lines.end())
 		return NULL;
 
-	const time_t current = ServerInstance->Time();
-
-	 LookupIter safei;
-
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+	for (LookupIter i = x->second.begin(); i != x->second.end(); ++i)
 	{
-		safei = i;
-		safei++;
-
 		if (i->second->Matches(pattern))
-		{
-			if (i->second->duration && current > i->second->expiry)
-			{
-				/* Expire the line, return nothing */
-				ExpireLine(x, i);
-				/* See above */
-				i = safei;
-				continue;
-			}
-			else
-				return i->second;
-		}
-
-		i = safei;
+			return i->second;
 	}
 	return NULL;
 }
@@ -422,10 +421,198 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 	if (pptr != pending_lines.end())
 		pending_lines.erase(pptr);
 
+	line_index[container->first].Remove(item->second);
+	RemoveExpiring(item->second);
 	delete item->second;
 	container->second.erase(item);
 }
 
+void XLineManager::ExpireLines(time_t current)
+{
+	while (!expiring.empty() && current > expiring.begin()->first)
+	{
+		XLine* line = expiring.begin()->second;
+		if (line->expiry != expiring.begin()->first)
+		{
+			/* The creation time of the line was changed after it was added */
+			expiring.erase(expiring.begin());
+			expiring.insert(std::make_pair(line->expiry, line));
+			continue;
+		}
+
+		ContainerIter x = lookup_lines.find(line->type);
+		LookupIter item;
+		if (x == lookup_lines.end() || (item = x->second.find(line->Displayable().c_str())) == x->second.end())
+		{
+			expiring.erase(expiring.begin());
+			continue;
+		}
+
+		ExpireLine(x, item);
+	}
+
+	ScheduleExpiry();
+}
+
+void XLineManager::RemoveExpiring(XLine* line)
+{
+	if (!line->duration)
+		return;
+
+	if (expiring.erase(std::make_pair(line->expiry, line)))
+		return;
+
+	/* The creation time of the line was changed after it was added */
+	for (std::set<std::pair<time_t, XLine*> >::iterator i = expiring.begin(); i != expiring.end(); ++i)
+	{
+		if (i->second == line)
+		{
+			expiring.erase(i);
+			return;
+		}
+	}
+}
+
+void XLineManager::ScheduleExpiry()
+{
+	if (expiring.empty())
+	{
+		ServerInstance->Timers->DelTimer(expirytimer);
+		return;
+	}
+
+	/* Lines expire once the current time is past their expiry time */
+	expirytimer->SetTrigger(expiring.begin()->first + 1);
+	ServerInstance->Timers->AddTimer(expirytimer);
+}
+
+
+/** Lowercase a host or IP the way InspIRCd::Match() compares them for X-lines
+ */
+static std::string LowerHost(const std::string& host)
+{
+	std::string lower(host);
+	for (std::string::iterator i = lower.begin(); i != lower.end(); ++i)
+		*i = ascii_case_insensitive_map[(unsigned char)*i];
+	return lower;
+}
+
+bool XLineIndex::GetKey(XLine* line, std::string& mask, irc::sockets::cidr_mask& range, bool& isrange)
+{
+	mask = line->GetHostMask();
+	if (mask.empty() || mask.find_first_of("*?@") != std::string::npos)
+		return false;
+
+	isrange = false;
+	std::string::size_type slash = mask.rfind('/');
+	if (slash != std::string::npos)
+	{
+		irc::sockets::sockaddrs sa;
+		if (irc::sockets::aptosa(mask.substr(0, slash), 0, sa))
+		{
+			range = irc::sockets::cidr_mask(mask);
+			isrange = true;
+		}
+	}
+
+	mask = LowerHost(mask);
+	return true;
+}
+
+void XLineIndex::Add(XLine* line)
+{
+	std::string mask;
+	irc::sockets::cidr_mask range;
+	bool isrange;
+	if (!GetKey(line, mask, range, isrange))
+	{
+		unindexed[line->Displayable().c_str()] = line;
+		return;
+	}
+
+	if (isrange)
+	{
+		ranges.insert(std::make_pair(range, line));
+		prefixlens[std::make_pair(range.type, range.length)]++;
+	}
+	hosts.insert(std::make_pair(mask, line));
+}
+
+void XLineIndex::Remove(XLine* line)
+{
+	std::string mask;
+	irc::sockets::cidr_mask range;
+	bool isrange;
+	if (!GetKey(line, mask, range, isrange))
+	{
+		XLineLookup::iterator i = unindexed.find(line->Displayable().c_str());
+		if (i != unindexed.end() && i->second == line)
+			unindexed.erase(i);
+		return;
+	}
+
+	if (isrange)
+	{
+		std::pair<RangeMap::iterator, RangeMap::iterator> matches = ranges.equal_range(range);
+		for (RangeMap::iterator i = matches.first; i != matches.second; ++i)
+		{
+			if (i->second == line)
+			{
+				ranges.erase(i);
+				std::map<std::pair<int, int>, unsigned int>::iterator len = prefixlens.find(std::make_pair(range.type, range.length));
+				if (len != prefixlens.end() && !--len->second)
+					prefixlens.erase(len);
+				break;
+			}
+		}
+	}
+
+	std::pair<HostMap::iterator, HostMap::iterator> matches = hosts.equal_range(mask);
+	for (HostMap::iterator i = matches.first; i != matches.second; ++i)
+	{
+		if (i->second == line)
+		{
+			hosts.erase(i);
+			break;
+		}
+	}
+}
+
+void XLineIndex::Find(User* user, std::vector<XLine*>& out) const
+{
+	if (!hosts.empty())
+	{
+		const std::string host = LowerHost(user->host);
+		const std::string ip = LowerHost(user->GetIPString());
+
+		std::pair<HostMap::const_iterator, HostMap::const_iterator> matches = hosts.equal_range(host);
+		for (HostMap::const_iterator i = matches.first; i != matches.second; ++i)
+			out.push_back(i->second);
+
+		if (ip != host)
+		{
+			matches = hosts.equal_range(ip);
+			for (HostMap::const_iterator i = matches.first; i != matches.second; ++i)
+				out.push_back(i->second);
+		}
+	}
+
+	// Look up the user's address masked to each prefix length that has a range set on it
+	const int family = user->client_sa.sa.sa_family;
+	if (prefixlens.empty() || (family != AF_INET && family != AF_INET6))
+		return;
+
+	for (std::map<std::pair<int, int>, unsigned int>::const_iterator len = prefixlens.begin(); len != prefixlens.end(); ++len)
+	{
+		if (len->first.first != family)
+			continue;
+
+		irc::sockets::cidr_mask range(user->client_sa, len->first.second);
+		std::pair<RangeMap::const_iterator, RangeMap::const_iterator> matches = ranges.equal_range(range);
+		for (RangeMap::const_iterator i = matches.first; i != matches.second; ++i)
+			out.push_back(i->second);
+	}
+}
 
 // applies lines, removing clients and changing nicks etc as applicable
 void XLineManager::ApplyLines()
@@ -454,32 +641,20 @@ void XLineManager::InvokeStats(const std::string &type, int numeric, User* user,
 {
 	ContainerIter n = lookup_lines.find(type);
 
-	time_t current = ServerInstance->Time();
-
-	LookupIter safei;
-
 	if (n != lookup_lines.end())
 	{
 		XLineLookup& list = n->second;
-		for (LookupIter i = list.begin(); i != list.end(); )
+		for (LookupIter i = list.begin(); i != list.end(); ++i)
 		{
-			safei = i;
-			safei++;
-
-			if (i->second->duration && current > i->second->expiry)
-			{
-				ExpireLine(n, i);
-			}
-			else
-				results.push_back(ServerInstance->Config->ServerName+" "+ConvToStr(numeric)+" "+user->nick+" :"+i->second->Displayable()+" "+
-					ConvToStr(i->second->set_time)+" "+ConvToStr(i->second->duration)+" "+i->second->source+" :"+i->second->reason);
-			i = safei;
+			results.push_back(ServerInstance->Config->ServerName+" "+ConvToStr(numeric)+" "+user->nick+" :"+i->second->Displayable()+" "+
+				ConvToStr(i->second->set_time)+" "+ConvToStr(i->second->duration)+" "+i->second->source+" :"+i->second->reason);
 		}
 	}
 }
 
 
 XLineManager::XLineManager()
+	: expirytimer(new XLineExpiryTimer)
 {
 	GLineFactory* GFact;
 	ELineFactory* EFact;
@@ -518,6 +693,8 @@ XLineManager::~XLineManager()
 			delete j->second;
 		}
 	}
+
+	delete expirytimer;
 }
 
 void XLine::Apply(User* u)